@@ -559,7 +559,8 @@ void interface_adv(disk_t *disk_car, const int verbose,const int dump_ind, const
 	  {
 	    if(is_linux(current_element->part))
 	    {
-	      list_part_t *list_sb=search_superblock(disk_car,current_element->part,verbose,dump_ind,1);
+	      list_part_t *list_sb=search_superblock(disk_car,current_element->part,verbose,dump_ind,1,
+		  (expert>0 ? 0 : SEARCH_SUPERBLOCK_MAX));
 	      interface_superblock(disk_car,list_sb,current_cmd);
 	      part_free_list(list_sb);
 	    }
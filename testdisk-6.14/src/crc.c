@@ -25,9 +25,39 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
 #include "types.h"
 #include "common.h"
 #include "crc.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+/* The compiler targets the ARMv8 CRC32 instructions */
+#include <arm_acle.h>
+#define HAVE_CRC32_ARM 1
+#define CRC32_ARM_TARGET
+#define crc32_arm_b(crc, v)	__crc32b(crc, v)
+#define crc32_arm_d(crc, v)	__crc32d(crc, v)
+#define crc32c_arm_b(crc, v)	__crc32cb(crc, v)
+#define crc32c_arm_d(crc, v)	__crc32cd(crc, v)
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 6
+/* The CRC32 instructions are optional in ARMv8.0,
+ * they are used only if the kernel reports them in AT_HWCAP */
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define HAVE_CRC32_ARM 1
+#define HAVE_CRC32_ARM_HWCAP 1
+#define CRC32_ARM_TARGET __attribute__((target("+crc")))
+#define crc32_arm_b(crc, v)	__builtin_aarch64_crc32b(crc, v)
+#define crc32_arm_d(crc, v)	__builtin_aarch64_crc32x(crc, v)
+#define crc32c_arm_b(crc, v)	__builtin_aarch64_crc32cb(crc, v)
+#define crc32c_arm_d(crc, v)	__builtin_aarch64_crc32cx(crc, v)
+#endif
 
 /* crc32_tab=make_crc32_table(0xEDB88320); */
 static const uint32_t crc32_tab[] = {
@@ -85,24 +115,31 @@ static const uint32_t crc32_tab[] = {
   0x2d02ef8dL
 };
 
-unsigned int get_crc32(const void*buf, const unsigned int len, const uint32_t seed)
+/* Slicing-by-8: crc32_slice[k][i] is the CRC of byte i followed by k zero bytes,
+ * crc32_slice[0] is crc32_tab */
+static uint32_t crc32_slice[8][256];
+/* Same tables for the Castagnoli polynomial (CRC-32C) */
+static uint32_t crc32c_slice[8][256];
+#ifdef HAVE_PTHREAD
+/* header_check_*() may run from several threads, build the tables once */
+static pthread_once_t crc_once=PTHREAD_ONCE_INIT;
+#else
+static int crc_initialized=0;
+#endif
+static uint32_t (*crc32_update)(const unsigned char *s, unsigned int len, uint32_t crc);
+static uint32_t (*crc32c_update)(const unsigned char *s, unsigned int len, uint32_t crc);
+
+static void make_crc32_slices(uint32_t slice[8][256])
 {
-  unsigned int i;
-  register uint32_t crc32val;
-  const unsigned char *s=(const unsigned char *)buf;
-  crc32val = seed; 
-  for (i = 0;  i < len;  i ++)
-  {
-    crc32val = crc32_tab[(crc32val ^ s[i]) & 0xff] ^ (crc32val >> 8);
-  }
-  return (unsigned int)crc32val;
+  unsigned int i,k;
+  for(i=0; i<256; i++)
+    for(k=1; k<8; k++)
+      slice[k][i]=(slice[k-1][i] >> 8) ^ slice[0][slice[k-1][i] & 0xff];
 }
 
-#if 0
-uint32_t* make_crc32_table(uint32_t poly)
+static void make_crc32_table(uint32_t *crctable, const uint32_t poly)
 {
-  unsigned i,j;
-  uint32_t *crctable = (uint32_t *)MALLOC(256*sizeof(uint32_t));
+  unsigned int i,j;
   for (i=0;i<256;i++)
   {
     uint32_t r=i;
@@ -110,19 +147,145 @@ uint32_t* make_crc32_table(uint32_t poly)
       r=((r&1)?(r>>1)^poly:(r>>1));
     crctable[i] = r;
   }
-  return crctable;
 }
 
-unsigned int get_crc32_gen(const void *buf, const unsigned int len, const uint32_t seed, const uint32_t *crctab)
+static uint32_t crc32_update_slice8(const uint32_t slice[8][256], const unsigned char *s, unsigned int len, uint32_t crc)
+{
+  for(; len >= 8; len-=8, s+=8)
+  {
+    uint32_t lo, hi;
+    memcpy(&lo, s, 4);
+    memcpy(&hi, s + 4, 4);
+    lo=le32(lo) ^ crc;
+    hi=le32(hi);
+    crc=slice[7][lo & 0xff] ^ slice[6][(lo >> 8) & 0xff] ^
+      slice[5][(lo >> 16) & 0xff] ^ slice[4][lo >> 24] ^
+      slice[3][hi & 0xff] ^ slice[2][(hi >> 8) & 0xff] ^
+      slice[1][(hi >> 16) & 0xff] ^ slice[0][hi >> 24];
+  }
+  for(; len > 0; len--, s++)
+    crc=slice[0][(crc ^ *s) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+static uint32_t crc32_update_ieee_slice8(const unsigned char *s, unsigned int len, uint32_t crc)
+{
+  return crc32_update_slice8((const uint32_t (*)[256])crc32_slice, s, len, crc);
+}
+
+static uint32_t crc32c_update_slice8(const unsigned char *s, unsigned int len, uint32_t crc)
+{
+  return crc32_update_slice8((const uint32_t (*)[256])crc32c_slice, s, len, crc);
+}
+
+#if defined(HAVE_CRC32_ARM)
+/* ARMv8 CRC32 instructions, they handle both polynomials */
+CRC32_ARM_TARGET
+static uint32_t crc32_update_arm(const unsigned char *s, unsigned int len, uint32_t crc)
+{
+  for(; len >= 8; len-=8, s+=8)
+  {
+    uint64_t v;
+    memcpy(&v, s, 8);
+    crc=crc32_arm_d(crc, le64(v));
+  }
+  for(; len > 0; len--, s++)
+    crc=crc32_arm_b(crc, *s);
+  return crc;
+}
+
+CRC32_ARM_TARGET
+static uint32_t crc32c_update_arm(const unsigned char *s, unsigned int len, uint32_t crc)
 {
-  unsigned int i;
-  register uint32_t crc32val;
-  const unsigned char *s=buf;
-  crc32val = seed; 
-  for (i = 0;  i < len;  i ++)
+  for(; len >= 8; len-=8, s+=8)
   {
-    crc32val = crctab[(crc32val ^ s[i]) & 0xff] ^ (crc32val >> 8);
+    uint64_t v;
+    memcpy(&v, s, 8);
+    crc=crc32c_arm_d(crc, le64(v));
   }
-  return crc32val;
+  for(; len > 0; len--, s++)
+    crc=crc32c_arm_b(crc, *s);
+  return crc;
 }
+#elif defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CRC32C_SSE42 1
+/* SSE4.2 crc32 instruction, it only handles the Castagnoli polynomial.
+ * Used only if the CPU supports it. */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_sse42(const unsigned char *s, unsigned int len, uint32_t crc)
+{
+#if defined(__x86_64__)
+  uint64_t crc64=crc;
+  for(; len >= 8; len-=8, s+=8)
+  {
+    uint64_t v;
+    memcpy(&v, s, 8);
+    crc64=__builtin_ia32_crc32di(crc64, v);
+  }
+  crc=(uint32_t)crc64;
+#endif
+  for(; len >= 4; len-=4, s+=4)
+  {
+    uint32_t v;
+    memcpy(&v, s, 4);
+    crc=__builtin_ia32_crc32si(crc, v);
+  }
+  for(; len > 0; len--, s++)
+    crc=__builtin_ia32_crc32qi(crc, *s);
+  return crc;
+}
+#endif
+
+static void crc_init(void)
+{
+  memcpy(crc32_slice[0], crc32_tab, sizeof(crc32_slice[0]));
+  make_crc32_slices(crc32_slice);
+  make_crc32_table(crc32c_slice[0], 0x82F63B78);
+  make_crc32_slices(crc32c_slice);
+  crc32_update=&crc32_update_ieee_slice8;
+  crc32c_update=&crc32c_update_slice8;
+#if defined(HAVE_CRC32_ARM_HWCAP)
+  if((getauxval(AT_HWCAP) & HWCAP_CRC32)!=0)
+  {
+    crc32_update=&crc32_update_arm;
+    crc32c_update=&crc32c_update_arm;
+  }
+#elif defined(HAVE_CRC32_ARM)
+  crc32_update=&crc32_update_arm;
+  crc32c_update=&crc32c_update_arm;
+#elif defined(HAVE_CRC32C_SSE42)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.2"))
+    crc32c_update=&crc32c_update_sse42;
+#endif
+#ifndef HAVE_PTHREAD
+  crc_initialized=1;
 #endif
+}
+
+static void crc_check_init(void)
+{
+#ifdef HAVE_PTHREAD
+  pthread_once(&crc_once, &crc_init);
+#else
+  if(crc_initialized==0)
+    crc_init();
+#endif
+}
+
+/* CRC-32 (IEEE 802.3, used by zip, png, gzip, GPT...)
+ * The caller handles the initial and final inversion, so the CRC of
+ * a stream can be computed block by block. */
+unsigned int get_crc32(const void*buf, const unsigned int len, const uint32_t seed)
+{
+  crc_check_init();
+  return crc32_update((const unsigned char *)buf, len, seed);
+}
+
+/* CRC-32C (Castagnoli, used by btrfs, ext4 metadata_csum, iSCSI...)
+ * Same conventions as get_crc32() */
+unsigned int get_crc32c(const void*buf, const unsigned int len, const uint32_t seed)
+{
+  crc_check_init();
+  return crc32c_update((const unsigned char *)buf, len, seed);
+}
@@ -24,11 +24,8 @@
 extern "C" {
 #endif
 
-#if 0
-uint32_t* make_crc32_table(uint32_t poly);
-unsigned int get_crc32_gen(const unsigned char *s, const unsigned int len, const uint32_t seed, const uint32_t *crctab);
-#endif
 unsigned int get_crc32(const void *s, const unsigned int len, const uint32_t seed);
+unsigned int get_crc32c(const void *s, const unsigned int len, const uint32_t seed);
 
 #ifdef __cplusplus
 } /* closing brace for extern "C" */
@@ -0,0 +1,125 @@
+/*
+
+    File: crcbench.c
+
+    Copyright (C) 2007 Christophe GRENIER <grenier@cgsecurity.org>
+
+    This software is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write the Free Software Foundation, Inc., 51
+    Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+/* Check get_crc32() and get_crc32c() against a bitwise implementation
+ * and measure their speed. Not built by default: make crcbench */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#include "types.h"
+#include "common.h"
+#include "crc.h"
+
+#define BENCH_SIZE (16*1024*1024)
+
+static uint32_t crc32_bitwise(const unsigned char *s, unsigned int len, uint32_t crc, const uint32_t poly)
+{
+  for(; len > 0; len--, s++)
+  {
+    unsigned int j;
+    crc^=*s;
+    for(j=0; j<8; j++)
+      crc=((crc&1)?(crc>>1)^poly:(crc>>1));
+  }
+  return crc;
+}
+
+/* Compare with the bitwise implementation on random offsets, lengths and
+ * seeds, the CRC being computed in one or two updates */
+static int crc_check(const unsigned char *buffer, const unsigned int size)
+{
+  unsigned int i;
+  for(i=0; i<10000; i++)
+  {
+    const unsigned int offset=rand() % 64;
+    const unsigned int len=rand() % (size < 4096 ? size - 64 : 4096);
+    const unsigned int split=(len>0 ? rand() % len : 0);
+    const uint32_t seed=((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    const unsigned char *s=&buffer[offset];
+    const uint32_t ref32=crc32_bitwise(s, len, seed, 0xEDB88320);
+    const uint32_t ref32c=crc32_bitwise(s, len, seed, 0x82F63B78);
+    if(get_crc32(s, len, seed)!=ref32 ||
+	get_crc32(&s[split], len - split, get_crc32(s, split, seed))!=ref32)
+    {
+      printf("get_crc32 mismatch offset=%u len=%u seed=%08x\n", offset, len, seed);
+      return -1;
+    }
+    if(get_crc32c(s, len, seed)!=ref32c ||
+	get_crc32c(&s[split], len - split, get_crc32c(s, split, seed))!=ref32c)
+    {
+      printf("get_crc32c mismatch offset=%u len=%u seed=%08x\n", offset, len, seed);
+      return -1;
+    }
+  }
+  /* Check values: "123456789" */
+  if((get_crc32("123456789", 9, 0xFFFFFFFF) ^ 0xFFFFFFFF)!=0xCBF43926 ||
+      (get_crc32c("123456789", 9, 0xFFFFFFFF) ^ 0xFFFFFFFF)!=0xE3069283)
+  {
+    printf("Check values mismatch\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void crc_bench(const char *name, unsigned int (*crc_fnct)(const void *s, const unsigned int len, const uint32_t seed), const unsigned char *buffer, const unsigned int size)
+{
+  unsigned int i;
+  uint32_t crc=0xFFFFFFFF;
+  const clock_t start=clock();
+  double elapsed;
+  for(i=0; i<16; i++)
+    crc=crc_fnct(buffer, size, crc);
+  elapsed=(double)(clock() - start) / CLOCKS_PER_SEC;
+  if(elapsed > 0)
+    printf("%-12s %8.0f MB/s (%08x)\n", name, 16.0 * size / elapsed / 1000000, crc);
+  else
+    printf("%-12s too fast to measure (%08x)\n", name, crc);
+}
+
+int main(void)
+{
+  unsigned char *buffer=(unsigned char *)malloc(BENCH_SIZE);
+  unsigned int i;
+  if(buffer==NULL)
+    return 1;
+  srand(1);
+  for(i=0; i<BENCH_SIZE; i++)
+    buffer[i]=rand();
+  if(crc_check(buffer, BENCH_SIZE)<0)
+  {
+    free(buffer);
+    return 1;
+  }
+  printf("get_crc32 and get_crc32c match the bitwise implementation\n");
+  crc_bench("get_crc32", &get_crc32, buffer, BENCH_SIZE);
+  crc_bench("get_crc32c", &get_crc32c, buffer, BENCH_SIZE);
+  free(buffer);
+  return 0;
+}
@@ -44,44 +44,69 @@ static const  uint64_t group_size[3]={
   };
 static const  uint64_t factors[3]={3,5,7};
 
-static uint64_t next_sb(const uint64_t hd_offset_old)
+/* Superblock candidates closer than this are read together */
+#define SB_READ_MAX (64*1024)
+
+static int sb_offset_cmp(const void *p1, const void *p2)
+{
+  const uint64_t o1=*(const uint64_t *)p1;
+  const uint64_t o2=*(const uint64_t *)p2;
+  return (o1 < o2 ? -1 : (o1 > o2 ? 1 : 0));
+}
+
+/* Compute the sorted list of the offsets where a superblock may be:
+ * the start of the filesystem for each blocksize and the first block of the
+ * groups 1 and powers of 3, 5 and 7 (sparse superblock) */
+static uint64_t *sb_candidates(const uint64_t part_size, unsigned int *nbr)
 {
-  uint64_t hd_offset=0;
-  int j;
-  if(hd_offset_old < EXT2_MIN_BLOCK_SIZE<<0)
-    hd_offset=EXT2_MIN_BLOCK_SIZE<<0;
-  else if(hd_offset_old < EXT2_MIN_BLOCK_SIZE<<1)
-    hd_offset=EXT2_MIN_BLOCK_SIZE<<1;
-  else if(hd_offset_old < EXT2_MIN_BLOCK_SIZE<<2)
-    hd_offset=EXT2_MIN_BLOCK_SIZE<<2;
+  uint64_t *offsets;
+  unsigned int max=4+3*3*64;
+  unsigned int i,j;
+  unsigned int n=0;
+  offsets=(uint64_t *)MALLOC(max*sizeof(uint64_t));
+  offsets[n++]=0;
+  offsets[n++]=EXT2_MIN_BLOCK_SIZE<<0;
+  offsets[n++]=EXT2_MIN_BLOCK_SIZE<<1;
+  offsets[n++]=EXT2_MIN_BLOCK_SIZE<<2;
   for(j=0; j<3; j++)
   {
-    int i;
     const uint64_t offset=(j==0?2*512:0);
     for(i=0; i<3; i++)
     {
       uint64_t val;
-      for(val=1; val * group_size[j] + offset <= hd_offset_old; val*=factors[i])
-	;
-      if(hd_offset==0 || val * group_size[j] + offset < hd_offset)
-	hd_offset=val* group_size[j] + offset;
+      for(val=1; val * group_size[j] + offset < part_size && n<max; val*=factors[i])
+	offsets[n++]=val * group_size[j] + offset;
     }
   }
-  return hd_offset;
+  qsort(offsets, n, sizeof(uint64_t), sb_offset_cmp);
+  /* Remove the duplicates and the offsets after the end */
+  for(i=0, j=0; i<n; i++)
+  {
+    if(offsets[i] >= part_size)
+      break;
+    if(j==0 || offsets[i]!=offsets[j-1])
+      offsets[j++]=offsets[i];
+  }
+  *nbr=j;
+  return offsets;
 }
 
-list_part_t *search_superblock(disk_t *disk_car, partition_t *partition, const int verbose, const int dump_ind, const int interface)
+list_part_t *search_superblock(disk_t *disk_car, partition_t *partition, const int verbose, const int dump_ind, const int interface, const unsigned int max_sb)
 {
-  unsigned char *buffer=(unsigned char *)MALLOC(2*0x200);
-  uint64_t hd_offset;
-  int nbr_sb=0;
+  unsigned char *buffer=(unsigned char *)MALLOC(SB_READ_MAX+1024);
+  uint64_t *offsets;
+  unsigned int offsets_nbr;
+  unsigned int i;
+  unsigned int nbr_sb=0;
   list_part_t *list_part=NULL;
   int ind_stop=0;
+  uint32_t best_wtime=0;
+  uint16_t best_mnt_count=0;
 #ifdef HAVE_NCURSES
   unsigned long int old_percent=0;
 #endif
-  struct ext2_super_block *sb=(struct ext2_super_block *)buffer;
   partition_t *new_partition=partition_new(disk_car->arch);
+  partition_t *best=NULL;
   log_trace("search_superblock\n");
 #ifdef HAVE_NCURSES
   if(interface>0)
@@ -98,23 +123,38 @@ list_part_t *search_superblock(disk_t *disk_car, partition_t *partition, const i
     wattroff(stdscr, A_REVERSE);
   }
 #endif
-  for(hd_offset=0;hd_offset<partition->part_size && nbr_sb<10 && ind_stop==0;hd_offset=next_sb(hd_offset))
+  offsets=sb_candidates(partition->part_size, &offsets_nbr);
+  for(i=0; i<offsets_nbr && ind_stop==0;)
   {
+    const uint64_t read_offset=offsets[i];
+    unsigned int read_size;
+    unsigned int last;
+    int res;
 #ifdef HAVE_NCURSES
-    const unsigned long int percent=hd_offset*100/partition->part_size;
+    const unsigned long int percent=read_offset*100/partition->part_size;
     if(interface>0 && percent!=old_percent)
     {
       wmove(stdscr,9,0);
       wclrtoeol(stdscr);
-      wprintw(stdscr,"Search ext2/ext3/ext4 superblock %10lu/%lu %lu%%", (long unsigned)(hd_offset/disk_car->sector_size),
+      wprintw(stdscr,"Search ext2/ext3/ext4 superblock %10lu/%lu %lu%%", (long unsigned)(read_offset/disk_car->sector_size),
 	  (long unsigned)(partition->part_size/disk_car->sector_size),percent);
       wrefresh(stdscr);
       ind_stop|=check_enter_key_or_s(stdscr);
       old_percent=percent;
     }
 #endif
-    if(disk_car->pread(disk_car, buffer, 1024, partition->part_offset + hd_offset) == 1024)
+    /* Coalesce the nearby candidates in a single read */
+    for(last=i; last+1<offsets_nbr && offsets[last+1] - read_offset <= SB_READ_MAX; last++);
+    read_size=offsets[last] - read_offset + 1024;
+    res=disk_car->pread(disk_car, buffer, read_size, partition->part_offset + read_offset);
+    for(; i<=last; i++)
     {
+      const uint64_t hd_offset=offsets[i];
+      const unsigned int buffer_offset=hd_offset - read_offset;
+      const struct ext2_super_block *sb=(const struct ext2_super_block *)&buffer[buffer_offset];
+      if(res < (signed)(buffer_offset + 1024) &&
+	  disk_car->pread(disk_car, &buffer[buffer_offset], 1024, partition->part_offset + hd_offset) != 1024)
+	continue;
       /* ext2/ext3/ext4 */
       if(le16(sb->s_magic)==EXT2_SUPER_MAGIC)
       {
@@ -122,36 +162,58 @@ list_part_t *search_superblock(disk_t *disk_car, partition_t *partition, const i
 	new_partition->part_offset+=hd_offset;
 	if(recover_EXT2(disk_car,sb,new_partition,verbose,dump_ind)==0)
 	{
-	  int insert_error=0;
 	  if(hd_offset<=(EXT2_MIN_BLOCK_SIZE<<2))
 	    new_partition->part_offset-=hd_offset;
-	  if(partition->blocksize==0)
+	  /* Keep the most recently written superblock */
+	  if(best==NULL || le32(sb->s_wtime) > best_wtime ||
+	      (le32(sb->s_wtime) == best_wtime && le16(sb->s_mnt_count) > best_mnt_count))
 	  {
-	    partition->sborg_offset=new_partition->sborg_offset;
-	    partition->sb_offset   =new_partition->sb_offset;
-	    partition->sb_size     =new_partition->sb_size;
-	    partition->blocksize   =new_partition->blocksize;
+	    if(best==NULL)
+	      best=partition_new(disk_car->arch);
+	    dup_partition_t(best, new_partition);
+	    best_wtime=le32(sb->s_wtime);
+	    best_mnt_count=le16(sb->s_mnt_count);
 	  }
-	  log_info("Ext2 superblock found at sector %llu (block=%llu, blocksize=%u)\n",
-	      (long long unsigned) hd_offset/DEFAULT_SECTOR_SIZE,
-	      (long long unsigned) hd_offset>>(EXT2_MIN_BLOCK_LOG_SIZE+le32(sb->s_log_block_size)),
-	      EXT2_MIN_BLOCK_SIZE<<le32(sb->s_log_block_size));
+	  if(max_sb==0 || nbr_sb<max_sb)
+	  {
+	    int insert_error=0;
+	    log_info("Ext2 superblock found at sector %llu (block=%llu, blocksize=%u)\n",
+		(long long unsigned) hd_offset/DEFAULT_SECTOR_SIZE,
+		(long long unsigned) hd_offset>>(EXT2_MIN_BLOCK_LOG_SIZE+le32(sb->s_log_block_size)),
+		EXT2_MIN_BLOCK_SIZE<<le32(sb->s_log_block_size));
 #ifdef HAVE_NCURSES
-	  wmove(stdscr,10+nbr_sb,0);
-	  wprintw(stdscr,"Ext2 superblock found at sector %llu (block=%llu, blocksize=%u)        \n",
-	      (long long unsigned) hd_offset/DEFAULT_SECTOR_SIZE,
-	      (long long unsigned) hd_offset>>(EXT2_MIN_BLOCK_LOG_SIZE+le32(sb->s_log_block_size)),
-	      EXT2_MIN_BLOCK_SIZE<<le32(sb->s_log_block_size));
+	    if(nbr_sb < 10)
+	    {
+	      wmove(stdscr,10+nbr_sb,0);
+	      wprintw(stdscr,"Ext2 superblock found at sector %llu (block=%llu, blocksize=%u)        \n",
+		  (long long unsigned) hd_offset/DEFAULT_SECTOR_SIZE,
+		  (long long unsigned) hd_offset>>(EXT2_MIN_BLOCK_LOG_SIZE+le32(sb->s_log_block_size)),
+		  EXT2_MIN_BLOCK_SIZE<<le32(sb->s_log_block_size));
+	    }
 #endif
-	  list_part=insert_new_partition(list_part, new_partition, 1, &insert_error);
-	  new_partition=partition_new(disk_car->arch);
+	    list_part=insert_new_partition(list_part, new_partition, 1, &insert_error);
+	    new_partition=partition_new(disk_car->arch);
+	  }
 	  nbr_sb++;
 	}
       }
     }
   }
+  if(best!=NULL)
+  {
+    log_info("%u ext2 superblocks found, the most recent one is superblock %lu, blocksize=%u\n",
+	nbr_sb, (long unsigned)(best->sb_offset/best->blocksize), best->blocksize);
+    if(partition->blocksize==0)
+    {
+      partition->sborg_offset=best->sborg_offset;
+      partition->sb_offset   =best->sb_offset;
+      partition->sb_size     =best->sb_size;
+      partition->blocksize   =best->blocksize;
+    }
+    free(best);
+  }
+  free(offsets);
   free(new_partition);
   free(buffer);
   return list_part;
 }
-
@@ -23,7 +23,10 @@
 extern "C" {
 #endif
 
-list_part_t *search_superblock(disk_t *disk_car, partition_t *partition, const int verbose, const int dump_ind, const int interface);
+#define SEARCH_SUPERBLOCK_MAX 10
+/* Every superblock location is checked, max_sb limits the number of
+ * superblocks listed (0: no limit) */
+list_part_t *search_superblock(disk_t *disk_car, partition_t *partition, const int verbose, const int dump_ind, const int interface, const unsigned int max_sb);
 
 #ifdef __cplusplus
 } /* closing brace for extern "C" */
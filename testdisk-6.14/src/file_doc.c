@@ -44,6 +44,9 @@ static int header_check_doc(const unsigned char *buffer, const unsigned int buff
 static void file_rename_doc(const char *old_filename);
 static uint32_t *OLE_load_FAT(FILE *IN, const struct OLE_HDR *header);
 static uint32_t *OLE_load_MiniFAT(FILE *IN, const struct OLE_HDR *header, const uint32_t *fat, const unsigned int fat_entries);
+static uint32_t *OLE_get_chain(const uint32_t *fat, const unsigned int fat_entries, const unsigned int block_start, const unsigned int max_blocks, unsigned int *nbr_blocks, unsigned int *next_block);
+static int OLE_read_sectors(FILE *IN, const uint32_t *blocks, const unsigned int nbr_blocks, const unsigned int uSectorShift, unsigned char *data);
+static void OLE_cache_free(void);
 
 const file_hint_t file_hint_doc= {
   .extension="doc",
@@ -57,6 +60,20 @@ const file_hint_t file_hint_doc= {
 
 static const unsigned char doc_header[]= { 0xd0, 0xcf, 0x11, 0xe0, 0xa1, 0xb1, 0x1a, 0xe1};
 
+/* FAT and directory of the last file validated by file_check_doc(),
+ * file_rename_doc() is called just after and uses them instead of
+ * parsing the same file again */
+static struct
+{
+  char filename[2048];
+  uint64_t file_size;
+  unsigned char header[512];
+  uint32_t *fat;
+  unsigned int fat_entries;
+  unsigned char *dir;
+  unsigned int dir_blocks;
+} ole_cache;
+
 static void register_header_check_doc(file_stat_t *file_stat)
 {
   register_header_check(0, doc_header,sizeof(doc_header), &header_check_doc, file_stat);
@@ -83,6 +100,7 @@ static void file_check_doc(file_recovery_t *file_recovery)
   const struct OLE_HDR *header=(const struct OLE_HDR*)&buffer_header;
   const uint64_t doc_file_size_org=file_recovery->file_size;
   file_recovery->file_size=0;
+  OLE_cache_free();
   /*reads first sector including OLE header */
   if(fseek(file_recovery->handle, 0, SEEK_SET) < 0 ||
       fread(&buffer_header, sizeof(buffer_header), 1, file_recovery->handle) != 1)
@@ -126,71 +144,70 @@ static void file_check_doc(file_recovery_t *file_recovery)
   log_trace("==> size : %llu\n", (long long unsigned)doc_file_size);
 #endif
   {
-    unsigned int block;
     const unsigned int fat_entries=(le32(header->num_FAT_blocks)==0 ?
 	109:
 	(le32(header->num_FAT_blocks)<<le16(header->uSectorShift))/4);
+    uint32_t *blocks;
+    unsigned char *dir;
+    unsigned int dir_blocks;
+    unsigned int next_block;
+    unsigned int j;
 #ifdef DEBUG_OLE
     log_info("root_start_block=%u, fat_entries=%u\n", le32(header->root_start_block), fat_entries);
 #endif
     /* FFFFFFFE = ENDOFCHAIN
-     * Use a loop count i to avoid endless loop */
-    for(block=le32(header->root_start_block), i=0;
-	block!=0xFFFFFFFE && i<fat_entries;
-	block=le32(fat[block]), i++)
+     * The chain length is limited to fat_entries to avoid endless loop */
+    blocks=OLE_get_chain(fat, fat_entries, le32(header->root_start_block), fat_entries, &dir_blocks, &next_block);
+    if(dir_blocks < fat_entries && next_block!=0xFFFFFFFE)
+    {
+      free(blocks);
+      free(fat);
+      return ;
+    }
+    dir=(unsigned char *)MALLOC((dir_blocks>0?dir_blocks:1)<<le16(header->uSectorShift));
+    if(OLE_read_sectors(file_recovery->handle, blocks, dir_blocks, le16(header->uSectorShift), dir) < 0)
     {
-      struct OLE_DIR *dir_entries;
-#ifdef DEBUG_OLE
-      log_info("read block %u\n", block);
-#endif
-      if(!(block < fat_entries))
-      {
-	free(fat);
-	return ;
-      }
-      if(fseek(file_recovery->handle, 512+(block<<le16(header->uSectorShift)), SEEK_SET)<0)
-      {
-#ifdef DEBUG_OLE
-	log_info("fseek failed\n");
-#endif
-	free(fat);
-	return ;
-      }
-      dir_entries=(struct OLE_DIR *)MALLOC(1<<le16(header->uSectorShift));
-      if(fread(dir_entries, (1<<le16(header->uSectorShift)), 1, file_recovery->handle)!=1)
-      {
 #ifdef DEBUG_OLE
-	log_info("fread failed\n");
+      log_info("fread failed\n");
 #endif
-	free(dir_entries);
-	free(fat);
-	return ;
-      }
+      free(dir);
+      free(blocks);
+      free(fat);
+      return ;
+    }
+    free(blocks);
+    for(j=0; j<dir_blocks; j++)
+    {
+      unsigned int sid;
+      const struct OLE_DIR *dir_entry;
+      for(sid=0, dir_entry=(const struct OLE_DIR *)&dir[j<<le16(header->uSectorShift)];
+	  sid<(1<<le16(header->uSectorShift))/sizeof(struct OLE_DIR) && dir_entry->type!=NO_ENTRY;
+	  sid++,dir_entry++)
       {
-	unsigned int sid;
-	struct OLE_DIR *dir_entry;
-	for(sid=0, dir_entry=dir_entries;
-	    sid<(1<<le16(header->uSectorShift))/sizeof(struct OLE_DIR) && dir_entry->type!=NO_ENTRY;
-	    sid++,dir_entry++)
+	if(le32(dir_entry->start_block) > 0 && le32(dir_entry->size) > 0 &&
+	    ((le32(dir_entry->size) >= le32(header->miniSectorCutoff)
+	      && le32(dir_entry->start_block) > fat_entries) ||
+	     le32(dir_entry->size) > doc_file_size))
 	{
-	    if(le32(dir_entry->start_block) > 0 && le32(dir_entry->size) > 0 &&
-		((le32(dir_entry->size) >= le32(header->miniSectorCutoff)
-		  && le32(dir_entry->start_block) > fat_entries) ||
-		 le32(dir_entry->size) > doc_file_size))
-	  {
 #ifdef DEBUG_OLE
-	    log_info("error at sid %u\n", sid);
+	  log_info("error at sid %u\n", sid);
 #endif
-	    free(dir_entries);
-	    free(fat);
-	    return ;
-	  }
+	  free(dir);
+	  free(fat);
+	  return ;
 	}
       }
-      free(dir_entries);
     }
+    /* Keep the FAT and the directory for file_rename_doc() */
+    strncpy(ole_cache.filename, file_recovery->filename, sizeof(ole_cache.filename)-1);
+    ole_cache.filename[sizeof(ole_cache.filename)-1]='\0';
+    ole_cache.file_size=doc_file_size;
+    memcpy(ole_cache.header, buffer_header, sizeof(ole_cache.header));
+    ole_cache.fat=fat;
+    ole_cache.fat_entries=fat_entries;
+    ole_cache.dir=dir;
+    ole_cache.dir_blocks=dir_blocks;
   }
-  free(fat);
   file_recovery->file_size=doc_file_size;
 }
 
@@ -505,91 +522,115 @@ static uint32_t *OLE_load_FAT(FILE *IN, const struct OLE_HDR *header)
     }
   }
   fat=(uint32_t*)MALLOC(le32(header->num_FAT_blocks)<<le16(header->uSectorShift));
-  { /* Load FAT */
+  { /* Load FAT, consecutive FAT sectors are read at once */
     unsigned long int j;
-    unsigned char *data;
-    for(j=0, data=(unsigned char*)fat;
-	j<le32(header->num_FAT_blocks);
-	j++, data+=(1<<le16(header->uSectorShift)))
+    for(j=0; j<le32(header->num_FAT_blocks); j++)
+      dif[j]=le32(dif[j]);
+    if(OLE_read_sectors(IN, dif, le32(header->num_FAT_blocks), le16(header->uSectorShift), (unsigned char *)fat) < 0)
     {
-      if(fseek(IN,512+(le32(dif[j])<<le16(header->uSectorShift)),SEEK_SET)<0)
-      {
-	free(dif);
-	free(fat);
-	return NULL;
-      }
-      if(fread(data, (1<<le16(header->uSectorShift)), 1, IN)!=1)
-      {
-	free(dif);
-	free(fat);
-	return NULL;
-      }
+      free(dif);
+      free(fat);
+      return NULL;
     }
   }
   free(dif);
   return fat;
 }
 
+/* Return the sectors of the chain beginning at block_start, at most max_blocks.
+ * next_block is set to the first block outside the chain */
+static uint32_t *OLE_get_chain(const uint32_t *fat, const unsigned int fat_entries, const unsigned int block_start, const unsigned int max_blocks, unsigned int *nbr_blocks, unsigned int *next_block)
+{
+  uint32_t *blocks;
+  unsigned int block;
+  unsigned int i;
+  for(block=block_start, i=0;
+      block < fat_entries && i < max_blocks;
+      block=le32(fat[block]), i++);
+  blocks=(uint32_t *)MALLOC((i>0?i:1)*sizeof(*blocks));
+  *nbr_blocks=i;
+  for(block=block_start, i=0;
+      i < *nbr_blocks;
+      block=le32(fat[block]), i++)
+    blocks[i]=block;
+  *next_block=block;
+  return blocks;
+}
+
+/* Read the sectors listed in blocks[], consecutive sectors are read with a single fread() */
+static int OLE_read_sectors(FILE *IN, const uint32_t *blocks, const unsigned int nbr_blocks, const unsigned int uSectorShift, unsigned char *data)
+{
+  unsigned int i;
+  for(i=0; i<nbr_blocks; )
+  {
+    unsigned int nbr;
+    for(nbr=1; i+nbr<nbr_blocks && blocks[i+nbr]==blocks[i]+nbr; nbr++);
+    if(fseek(IN, 512+((uint64_t)blocks[i]<<uSectorShift), SEEK_SET) < 0)
+      return -1;
+    if(fread(data, (size_t)nbr<<uSectorShift, 1, IN)!=1)
+      return -1;
+    data+=(size_t)nbr<<uSectorShift;
+    i+=nbr;
+  }
+  return 0;
+}
+
 static void *OLE_read_stream(FILE *IN,
     const uint32_t *fat, const unsigned int fat_entries, const unsigned int uSectorShift,
     const unsigned int block_start, const unsigned int len)
 {
   unsigned char *dataPt;
-  unsigned int block;
-  unsigned int size_read;
-  dataPt=(unsigned char *)MALLOC((len+(1<<uSectorShift)-1) / (1<<uSectorShift) * (1<<uSectorShift));
-  for(block=block_start, size_read=0;
-      size_read < len;
-      block=le32(fat[block]), size_read+=(1<<uSectorShift))
+  uint32_t *blocks;
+  unsigned int nbr_blocks;
+  unsigned int next_block;
+  const unsigned int len_blocks=(len+(1<<uSectorShift)-1) >> uSectorShift;
+  blocks=OLE_get_chain(fat, fat_entries, block_start, len_blocks, &nbr_blocks, &next_block);
+  if(nbr_blocks < len_blocks)
   {
-    if(!(block < fat_entries))
-    {
-      free(dataPt);
-      return NULL;
-    }
-    if(fseek(IN, 512+(block<<uSectorShift), SEEK_SET)<0)
-    {
-      free(dataPt);
-      return NULL;
-    }
-    if(fread(&dataPt[size_read], (1<<uSectorShift), 1, IN)!=1)
-    {
-      free(dataPt);
-      return NULL;
-    }
+    free(blocks);
+    return NULL;
   }
+  dataPt=(unsigned char *)MALLOC((len_blocks>0?len_blocks:1) << uSectorShift);
+  if(OLE_read_sectors(IN, blocks, nbr_blocks, uSectorShift, dataPt) < 0)
+  {
+    free(blocks);
+    free(dataPt);
+    return NULL;
+  }
+  free(blocks);
   return dataPt;
 }
 
 static uint32_t *OLE_load_MiniFAT(FILE *IN, const struct OLE_HDR *header, const uint32_t *fat, const unsigned int fat_entries)
 {
-  unsigned char*minifat_pos;
   uint32_t *minifat;
-  unsigned int block;
-  unsigned int i;
+  uint32_t *blocks;
+  unsigned int nbr_blocks;
+  unsigned int next_block;
   if(le32(header->csectMiniFat)==0)
     return NULL;
   minifat=(uint32_t*)MALLOC(le32(header->csectMiniFat) << le16(header->uSectorShift));
-  minifat_pos=(unsigned char*)minifat;
-  block=le32(header->MiniFat_block);
-  for(i=0; i < le32(header->csectMiniFat) && block < fat_entries; i++)
+  blocks=OLE_get_chain(fat, fat_entries, le32(header->MiniFat_block), le32(header->csectMiniFat), &nbr_blocks, &next_block);
+  if(OLE_read_sectors(IN, blocks, nbr_blocks, le16(header->uSectorShift), (unsigned char *)minifat) < 0)
   {
-    if(fseek(IN, ((uint64_t)block << le16(header->uSectorShift)) + 512, SEEK_SET) < 0)
-    {
-      free(minifat);
-      return NULL;
-    }
-    if(fread(minifat_pos, 1 << le16(header->uSectorShift), 1, IN) != 1)
-    {
-      free(minifat);
-      return NULL;
-    }
-    minifat_pos+=1 << le16(header->uSectorShift);
-    block=le32(fat[block]);
+    free(blocks);
+    free(minifat);
+    return NULL;
   }
+  free(blocks);
   return minifat;
 }
 
+static void OLE_cache_free(void)
+{
+  free(ole_cache.fat);
+  free(ole_cache.dir);
+  ole_cache.filename[0]='\0';
+  ole_cache.fat=NULL;
+  ole_cache.dir=NULL;
+  ole_cache.dir_blocks=0;
+}
+
 static uint32_t get32u(const void *buffer, const unsigned int offset)
 {
   const uint32_t *val=(const uint32_t *)((const unsigned char *)buffer+offset);
@@ -823,33 +864,61 @@ static void file_rename_doc(const char *old_filename)
   FILE *file;
   unsigned char buffer_header[512];
   uint32_t *fat;
+  unsigned char *dir;
+  unsigned int dir_blocks;
   const struct OLE_HDR *header=(const struct OLE_HDR*)&buffer_header;
   time_t file_time=0;
   unsigned int fat_entries;
   if(strstr(old_filename, ".sdd")!=NULL)
     ext="sdd";
   if((file=fopen(old_filename, "rb"))==NULL)
+  {
+    OLE_cache_free();
     return;
+  }
 #ifdef DEBUG_OLE
   log_info("file_rename_doc(%s)\n", old_filename);
 #endif
-  /*reads first sector including OLE header */
-  if(fseek(file, 0, SEEK_SET) < 0 ||
-      fread(&buffer_header, sizeof(buffer_header), 1, file) != 1)
+  if(ole_cache.fat!=NULL && strcmp(ole_cache.filename, old_filename)==0 &&
+      fseek(file, 0, SEEK_END)==0 && (uint64_t)ftell(file)==ole_cache.file_size)
   {
-    fclose(file);
-    return ;
+    /* file_check_doc() has just loaded the FAT and the directory */
+    memcpy(&buffer_header, ole_cache.header, sizeof(buffer_header));
+    fat=ole_cache.fat;
+    fat_entries=ole_cache.fat_entries;
+    dir=ole_cache.dir;
+    dir_blocks=ole_cache.dir_blocks;
+    ole_cache.fat=NULL;
+    ole_cache.dir=NULL;
   }
-  /* Sanity check */
-  if(le32(header->num_FAT_blocks)==0 ||
-      le32(header->num_extra_FAT_blocks)>50 ||
-      le32(header->num_FAT_blocks)>109+le32(header->num_extra_FAT_blocks)*((1<<le16(header->uSectorShift))-1))
+  else
   {
-    fclose(file);
-    return ;
+    OLE_cache_free();
+    /*reads first sector including OLE header */
+    if(fseek(file, 0, SEEK_SET) < 0 ||
+	fread(&buffer_header, sizeof(buffer_header), 1, file) != 1)
+    {
+      fclose(file);
+      return ;
+    }
+    /* Sanity check */
+    if(le32(header->num_FAT_blocks)==0 ||
+	le32(header->num_extra_FAT_blocks)>50 ||
+	le32(header->num_FAT_blocks)>109+le32(header->num_extra_FAT_blocks)*((1<<le16(header->uSectorShift))-1))
+    {
+      fclose(file);
+      return ;
+    }
+    fat=NULL;
+    dir=NULL;
+    fat_entries=0;
+    dir_blocks=0;
   }
+  OLE_cache_free();
   if(le16(header->uSectorShift)==12)
   {
+    free(fat);
+    free(dir);
     fclose(file);
     if(le32(header->csectDir)==1)
       file_rename(old_filename, NULL, 0, 0, "max", 1);
@@ -857,46 +926,44 @@ static void file_rename_doc(const char *old_filename)
       file_rename(old_filename, NULL, 0, 0, "qbb", 1);
     return ;
   }
-  if((fat=OLE_load_FAT(file, header))==NULL)
+  if(fat==NULL)
   {
-    fclose(file);
-    return ;
+    uint32_t *blocks;
+    unsigned int next_block;
+    if((fat=OLE_load_FAT(file, header))==NULL)
+    {
+      fclose(file);
+      return ;
+    }
+    fat_entries=(le32(header->num_FAT_blocks)==0 ?
+	109:
+	(le32(header->num_FAT_blocks)<<le16(header->uSectorShift))/4);
+#ifdef DEBUG_OLE
+    log_info("file_rename_doc root_start_block=%u, fat_entries=%u\n", le32(header->root_start_block), fat_entries);
+#endif
+    /* FFFFFFFE = ENDOFCHAIN
+     * The chain length is limited to fat_entries to avoid endless loop */
+    blocks=OLE_get_chain(fat, fat_entries, le32(header->root_start_block), fat_entries, &dir_blocks, &next_block);
+    dir=(unsigned char *)MALLOC((dir_blocks>0?dir_blocks:1)<<le16(header->uSectorShift));
+    if(OLE_read_sectors(file, blocks, dir_blocks, le16(header->uSectorShift), dir) < 0)
+    {
+      free(blocks);
+      free(dir);
+      free(fat);
+      fclose(file);
+      return ;
+    }
+    free(blocks);
   }
-  fat_entries=(le32(header->num_FAT_blocks)==0 ?
-      109:
-      (le32(header->num_FAT_blocks)<<le16(header->uSectorShift))/4);
   {
     unsigned int ministream_block=0;
     unsigned int ministream_size=0;
-    unsigned int block;
     unsigned int i;
-    /* FFFFFFFE = ENDOFCHAIN
-     * Use a loop count i to avoid endless loop */
-#ifdef DEBUG_OLE
-    log_info("file_rename_doc root_start_block=%u, fat_entries=%u\n", le32(header->root_start_block), fat_entries);
-#endif
-    for(block=le32(header->root_start_block), i=0;
-	block<fat_entries && block!=0xFFFFFFFE && i<fat_entries;
-	block=le32(fat[block]), i++)
+    for(i=0; i<dir_blocks; i++)
     {
-      struct OLE_DIR *dir_entries;
-      if(fseek(file, 512+(block<<le16(header->uSectorShift)), SEEK_SET)<0)
-      {
-	free(fat);
-	fclose(file);
-	return ;
-      }
-      dir_entries=(struct OLE_DIR *)MALLOC(1<<le16(header->uSectorShift));
-      if(fread(dir_entries, (1<<le16(header->uSectorShift)), 1, file)!=1)
-      {
-	free(fat);
-	free(dir_entries);
-	fclose(file);
-	return ;
-      }
-
+      const struct OLE_DIR *dir_entries=(const struct OLE_DIR *)&dir[i<<le16(header->uSectorShift)];
 #ifdef DEBUG_OLE
-      log_info("Root Directory block=%u (0x%x)\n", block, block);
+      log_info("Root Directory sector %u\n", i);
 #endif
       {
 	unsigned int sid;
@@ -1049,9 +1116,9 @@ static void file_rename_doc(const char *old_filename)
 	  }
 	}
       }
-      free(dir_entries);
     }
   }
+  free(dir);
   free(fat);
   fclose(file);
   if(file_time!=0 && file_time!=(time_t)-1)
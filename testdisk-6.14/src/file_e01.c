@@ -50,8 +50,21 @@ static const unsigned char e01_header[9]=  {
     0x01
 };
 
+/* Extension of each segment: E01, E02... filled once at registration,
+ * header_check_e01() may be called from several threads */
+#define E01_SEGMENT_MAX 1000
+static char e01_ext[E01_SEGMENT_MAX][4];
+
 static void register_header_check_e01(file_stat_t *file_stat)
 {
+  unsigned int i;
+  for(i=0; i<E01_SEGMENT_MAX; i++)
+  {
+    e01_ext[i][0]='E'+i/100;
+    e01_ext[i][1]='0'+(i%100)/10;
+    e01_ext[i][2]='0'+(i%10);
+    e01_ext[i][3]='\0';
+  }
   register_header_check(0, e01_header, sizeof(e01_header), &header_check_e01, file_stat);
 }
 
@@ -83,13 +96,12 @@ static int header_check_e01(const unsigned char *buffer, const unsigned int buff
   if(memcmp(buffer, e01_header, sizeof(e01_header))==0)
   {
     const struct ewf_file_header *ewf=(const struct ewf_file_header *)buffer;
-    static char ext[4];
+    const unsigned int segment=le16(ewf->fields_segment);
     reset_file_recovery(file_recovery_new);
-    ext[0]='E'+le16(ewf->fields_segment)/100;
-    ext[1]='0'+(le16(ewf->fields_segment)%100)/10;
-    ext[2]='0'+(le16(ewf->fields_segment)%10);
-    ext[3]='\0';
-    file_recovery_new->extension=(const char*)&ext;
+    if(segment < E01_SEGMENT_MAX)
+      file_recovery_new->extension=e01_ext[segment];
+    else
+      file_recovery_new->extension=file_hint_e01.extension;
     file_recovery_new->file_check=&file_check_e01;
     return 1;
   }
@@ -59,6 +59,16 @@ static void register_header_check_jpg(file_stat_t *file_stat);
 static int header_check_jpg(const unsigned char *buffer, const unsigned int buffer_size, const unsigned int safe_header_only, const file_recovery_t *file_recovery, file_recovery_t *file_recovery_new);
 static void file_check_jpg(file_recovery_t *file_recovery);
 int data_check_jpg(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery);
+static int data_check_jpg2(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery);
+
+/* In the scan, data_check_tmp2 is the number of restart markers still
+ * expected: 0 without DRI, JPG_RESTART_UNLIMITED if the number of MCU
+ * isn't known */
+#define JPG_RESTART_UNLIMITED 0xffffffff
+/* Before the scan, data_check_tmp holds the restart interval (bits 0-15),
+ * the number of components (bits 16-23) and this flag if a DRI segment
+ * ended after the buffer: its restart interval is unknown */
+#define JPG_DRI_UNKNOWN 0x80000000
 
 const file_hint_t file_hint_jpg= {
   .extension="jpg",
@@ -1181,6 +1191,282 @@ static void jpg_check_picture(file_recovery_t *file_recovery)
     file_search_footer(file_recovery, jpg_footer, sizeof(jpg_footer), 0);
   }
 }
+
+/*
+ * Incremental decoding
+ * data_check_jpg()/data_check_jpg2() feed each carved block into a libjpeg
+ * decompression object whose data source suspends when it runs out of
+ * data. When the whole picture has been decoded during carving,
+ * file_check_jpg() doesn't need to read and decode the file again.
+ */
+
+enum { JPG_STREAM_NONE=0, JPG_STREAM_HEADER, JPG_STREAM_START, JPG_STREAM_SCAN, JPG_STREAM_FINISH, JPG_STREAM_DONE, JPG_STREAM_ERROR };
+
+struct jpg_stream_struct
+{
+  struct jpeg_source_mgr pub;	/* public fields, must be the first field */
+  struct jpeg_decompress_struct cinfo;
+  struct my_error_mgr jerr;
+  JOCTET *buffer;
+  unsigned int buffer_alloc;
+  unsigned char *frame;
+  uint64_t consumed;		/* file offset of buffer[0] */
+  uint64_t fed;			/* bytes given to the decoder */
+  uint64_t skip;		/* bytes to skip when they become available */
+  uint64_t location_start;
+  uint64_t jpeg_size;
+  unsigned int status;
+  unsigned int row_stride;
+  int frame_full;		/* the whole picture is kept in frame */
+  unsigned int offsets[JPG_MAX_OFFSETS];
+};
+
+static struct jpg_stream_struct jpg_stream;
+/* The data is only decoded while carving when the files are checked */
+static int jpg_stream_enabled=0;
+
+static void jpg_stream_init_source (j_decompress_ptr cinfo)
+{
+  (void)cinfo;
+}
+
+/* Suspend the decoder until the next block has been carved */
+static int jpg_stream_fill_input_buffer (j_decompress_ptr cinfo)
+{
+  (void)cinfo;
+  return FALSE;
+}
+
+static void jpg_stream_skip_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  struct jpg_stream_struct *stream=(struct jpg_stream_struct *)cinfo->src;
+  if(num_bytes <= 0)
+    return ;
+  if((unsigned long)num_bytes > stream->pub.bytes_in_buffer)
+  {
+    stream->skip=num_bytes - stream->pub.bytes_in_buffer;
+    stream->pub.next_input_byte+=stream->pub.bytes_in_buffer;
+    stream->pub.bytes_in_buffer=0;
+    return ;
+  }
+  stream->pub.next_input_byte+=(size_t) num_bytes;
+  stream->pub.bytes_in_buffer-=(size_t) num_bytes;
+}
+
+static void jpg_stream_free(struct jpg_stream_struct *stream)
+{
+  if(stream->status!=JPG_STREAM_NONE)
+    jpeg_destroy_decompress(&stream->cinfo);
+  free(stream->frame);
+  stream->frame=NULL;
+  stream->status=JPG_STREAM_NONE;
+}
+
+static void jpg_stream_start(struct jpg_stream_struct *stream, const file_recovery_t *file_recovery)
+{
+  jpg_stream_free(stream);
+  stream->cinfo.err = jpeg_std_error(&stream->jerr.pub);
+  stream->jerr.pub.output_message = my_output_message;
+  stream->jerr.pub.error_exit = my_error_exit;
+  stream->jerr.pub.emit_message= my_emit_message;
+  jpeg_create_decompress(&stream->cinfo);
+  stream->pub.init_source = jpg_stream_init_source;
+  stream->pub.fill_input_buffer = jpg_stream_fill_input_buffer;
+  stream->pub.skip_input_data = jpg_stream_skip_input_data;
+  stream->pub.resync_to_restart = jpeg_resync_to_restart; /* use default method */
+  stream->pub.term_source = jpg_term_source;
+  stream->pub.bytes_in_buffer = 0;
+  stream->pub.next_input_byte = stream->buffer;
+  stream->cinfo.src=&stream->pub;
+  stream->consumed=0;
+  stream->fed=0;
+  stream->skip=0;
+  stream->jpeg_size=0;
+  stream->location_start=file_recovery->location.start;
+  stream->status=JPG_STREAM_HEADER;
+}
+
+/* Append data after the bytes libjpeg has not consumed yet */
+static void jpg_stream_append(struct jpg_stream_struct *stream, const unsigned char *data, const unsigned int size)
+{
+  const unsigned int skip=(stream->skip < size ? stream->skip : size);
+  const unsigned int used=stream->pub.next_input_byte - stream->buffer;
+  const unsigned int left=stream->pub.bytes_in_buffer;
+  stream->fed+=size;
+  stream->skip-=skip;
+  if(left + size - skip > stream->buffer_alloc)
+  {
+    JOCTET *buffer_new;
+    stream->buffer_alloc=left + size - skip;
+    buffer_new=(JOCTET *)MALLOC(stream->buffer_alloc);
+    if(left > 0)
+      memcpy(buffer_new, stream->pub.next_input_byte, left);
+    free(stream->buffer);
+    stream->buffer=buffer_new;
+  }
+  else if(left > 0)
+    memmove(stream->buffer, stream->pub.next_input_byte, left);
+  stream->consumed+=used + skip;
+  memcpy(&stream->buffer[left], data + skip, size - skip);
+  stream->pub.next_input_byte=stream->buffer;
+  stream->pub.bytes_in_buffer=left + size - skip;
+}
+
+/* Run the decoder until it needs more data */
+static void jpg_stream_decode(struct jpg_stream_struct *stream)
+{
+  if (setjmp(stream->jerr.setjmp_buffer))
+  {
+    stream->jpeg_size=stream->consumed + (stream->pub.next_input_byte - stream->buffer);
+    stream->status=JPG_STREAM_ERROR;
+    return ;
+  }
+  if(stream->status==JPG_STREAM_HEADER)
+  {
+    const int res=jpeg_read_header(&stream->cinfo, TRUE);
+    if(res==JPEG_SUSPENDED)
+      return ;
+    if(res!=JPEG_HEADER_OK)
+    {
+      stream->status=JPG_STREAM_ERROR;
+      return ;
+    }
+    stream->cinfo.two_pass_quantize = FALSE;
+    stream->cinfo.dither_mode = JDITHER_NONE;
+    stream->cinfo.dct_method = JDCT_FASTEST;
+    stream->cinfo.do_block_smoothing = FALSE;
+    stream->cinfo.do_fancy_upsampling = FALSE;
+    stream->status=JPG_STREAM_START;
+  }
+  if(stream->status==JPG_STREAM_START)
+  {
+    if(!jpeg_start_decompress(&stream->cinfo))
+      return ;
+    stream->row_stride=stream->cinfo.output_width * stream->cinfo.output_components;
+    /* Like jpg_check_picture(), keep the picture to locate an error
+     * unless it is very big */
+    if((uint64_t)stream->cinfo.output_height * stream->row_stride > 500 * 1024 * 1024)
+    {
+      /* FIXME out of bound read access in libjpeg-turbo */
+      stream->frame=(unsigned char *)MALLOC(2 * stream->row_stride);
+      stream->frame_full=0;
+    }
+    else
+    {
+      stream->frame=(unsigned char *)MALLOC((stream->cinfo.output_height+1) * stream->row_stride);
+      memset(stream->frame, 0x80, (stream->cinfo.output_height+1) * stream->row_stride);
+      stream->frame_full=1;
+    }
+    memset(stream->offsets, 0, sizeof(stream->offsets));
+    stream->status=JPG_STREAM_SCAN;
+  }
+  if(stream->status==JPG_STREAM_SCAN)
+  {
+    while(stream->cinfo.output_scanline < stream->cinfo.output_height)
+    {
+      JSAMPROW row_pointer[1];
+      if(stream->cinfo.output_scanline/8 < JPG_MAX_OFFSETS && stream->offsets[stream->cinfo.output_scanline/8]==0)
+	stream->offsets[stream->cinfo.output_scanline/8]=stream->consumed + (stream->pub.next_input_byte - stream->buffer);
+      if(stream->frame_full>0)
+	row_pointer[0] = stream->frame + stream->cinfo.output_scanline * stream->row_stride;
+      else
+	row_pointer[0] = stream->frame;
+      if(jpeg_read_scanlines(&stream->cinfo, row_pointer, 1)==0)
+	return ;
+    }
+    stream->jpeg_size=stream->consumed + (stream->pub.next_input_byte - stream->buffer);
+    stream->status=JPG_STREAM_FINISH;
+  }
+  if(stream->status==JPG_STREAM_FINISH)
+  {
+    if(!jpeg_finish_decompress(&stream->cinfo))
+      return ;
+    stream->status=JPG_STREAM_DONE;
+  }
+}
+
+/* jpg_stream_data_check()
+   Give the new block to the decoder
+   @returns 1 if the picture is known to be corrupted, 0 otherwise
+ */
+static int jpg_stream_data_check(const unsigned char *buffer, const unsigned int buffer_size, const file_recovery_t *file_recovery)
+{
+  if(jpg_stream_enabled==0)
+    return 0;
+  if(file_recovery->file_size==0)
+    jpg_stream_start(&jpg_stream, file_recovery);
+  /* Block already given or carving has gone on without the decoder */
+  if(jpg_stream.status==JPG_STREAM_NONE ||
+      jpg_stream.status==JPG_STREAM_ERROR ||
+      jpg_stream.location_start!=file_recovery->location.start ||
+      jpg_stream.fed!=file_recovery->file_size)
+    return 0;
+  if(jpg_stream.status==JPG_STREAM_DONE)
+  {
+    jpg_stream.fed+=buffer_size/2;
+    return 0;
+  }
+  jpg_stream_append(&jpg_stream, &buffer[buffer_size/2], buffer_size/2);
+  jpg_stream_decode(&jpg_stream);
+  return (jpg_stream.status==JPG_STREAM_ERROR ? 1 : 0);
+}
+
+/* jpg_stream_offset_error()
+   @param blocksize - size of the block given to the decoder, it has already been written
+   @returns the offset of the error found by the decoder, refined by
+   jpg_find_error() like in jpg_check_picture()
+ */
+static uint64_t jpg_stream_offset_error(const file_recovery_t *file_recovery, const unsigned int blocksize)
+{
+  uint64_t offset_error=jpg_stream.jpeg_size;
+  if(jpg_stream.frame!=NULL && jpg_stream.frame_full>0 && file_recovery->handle!=NULL)
+  {
+    const uint64_t tmp=jpg_find_error(file_recovery->handle, jpg_stream.cinfo.output_scanline, jpg_stream.cinfo.output_width, jpg_stream.cinfo.output_components, jpg_stream.frame, &jpg_stream.offsets[0], 0, file_recovery->blocksize, file_recovery->checkpoint_offset);
+    if(tmp!=0 && offset_error > tmp)
+      offset_error=tmp;
+    /* The file has been read, go back to the end of the carved data */
+    fseek(file_recovery->handle, file_recovery->file_size + blocksize, SEEK_SET);
+  }
+  return offset_error;
+}
+
+/* jpg_stream_check()
+   @param file_size - size of the carved file
+   @returns 1 if the picture has already been decoded without error, 0 if it must be checked
+ */
+static int jpg_stream_check(file_recovery_t *file_recovery, const uint64_t file_size)
+{
+  static const unsigned char jpg_eoi[2]= { 0xff, 0xd9 };
+  uint64_t jpeg_size;
+  if(jpg_stream.status==JPG_STREAM_NONE ||
+      jpg_stream.location_start!=file_recovery->location.start ||
+      jpg_stream.fed!=file_size)
+    return 0;
+  if(jpg_stream.status==JPG_STREAM_FINISH)
+  {
+    /* Like jpg_fill_input_buffer(), add an EOI marker at the end of the file */
+    jpg_stream_append(&jpg_stream, jpg_eoi, sizeof(jpg_eoi));
+    jpg_stream_decode(&jpg_stream);
+  }
+  if(jpg_stream.status!=JPG_STREAM_DONE)
+  {
+    jpg_stream_free(&jpg_stream);
+    return 0;
+  }
+  jpeg_size=jpg_stream.jpeg_size;
+  jpg_stream_free(&jpg_stream);
+  file_recovery->checkpoint_status=0;
+  if(jpeg_size<=0)
+    return 1;
+  if(file_recovery->calculated_file_size>0)
+    file_recovery->file_size=file_recovery->calculated_file_size;
+  else
+  {
+    file_recovery->file_size=jpeg_size;
+    file_search_footer(file_recovery, jpg_footer, sizeof(jpg_footer), 0);
+  }
+  return 1;
+}
 #endif
 
 static int jpg_check_dht(const unsigned char *buffer, const unsigned int buffer_size, const unsigned i, const unsigned int size)
@@ -1488,6 +1774,7 @@ static uint64_t jpg_check_structure(file_recovery_t *file_recovery, const unsign
 
 static void file_check_jpg(file_recovery_t *file_recovery)
 {
+  const uint64_t file_size=file_recovery->file_size;
   uint64_t thumb_offset;
   static uint64_t thumb_error=0;
   /* FIXME REMOVE ME */
@@ -1535,7 +1822,8 @@ static void file_check_jpg(file_recovery_t *file_recovery)
   if(file_recovery->offset_error!=0)
     return ;
 #if defined(HAVE_LIBJPEG) && defined(HAVE_JPEGLIB_H)
-  jpg_check_picture(file_recovery);
+  if(jpg_stream_check(file_recovery, file_size)==0)
+    jpg_check_picture(file_recovery);
 #else
   file_recovery->file_size=file_recovery->calculated_file_size;
 #endif
@@ -1553,17 +1841,11 @@ static void file_check_jpg(file_recovery_t *file_recovery)
 #endif
 }
 
-static int data_check_jpg2(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery)
+/* Check the markers found in the entropy-coded data of the scan
+ * returns 0: the block can't continue the scan, offset_error is set
+ *         1: EOF not found, 2: EOF */
+static int data_check_jpg2_markers(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery)
 {
-#if 0
-  unsigned int old_marker=0;
-#endif
-  if(file_recovery->calculated_file_size<2)
-  {
-    /* Reset to the correct file checker */
-    file_recovery->data_check=&data_check_jpg;
-    return data_check_jpg(buffer, buffer_size, file_recovery);
-  }
   if(buffer[buffer_size/2]==0xff && buffer[buffer_size/2]==0xd8 && 
       file_recovery->calculated_file_size != file_recovery->file_size)
   {
@@ -1576,49 +1858,157 @@ static int data_check_jpg2(const unsigned char *buffer, const unsigned int buffe
   while(file_recovery->calculated_file_size + buffer_size/2  > file_recovery->file_size &&
       file_recovery->calculated_file_size < file_recovery->file_size + buffer_size/2)
   {
-    const unsigned int i=file_recovery->calculated_file_size - file_recovery->file_size + buffer_size/2;
-    if(buffer[i-1]==0xFF)
+    unsigned int i=file_recovery->calculated_file_size - file_recovery->file_size + buffer_size/2;
+    /* Only the bytes following 0xFF need to be checked,
+     * memchr() is usually vectorized by the C library */
+    const unsigned char *ff=(const unsigned char *)memchr(&buffer[i-1], 0xFF, buffer_size - i);
+    if(ff==NULL)
     {
-      if(buffer[i]==0xd9)
-      {
-	/* JPEG_EOI */
-	file_recovery->calculated_file_size++;
-	return 2;
-      }
-      else if(buffer[i] >= 0xd0 && buffer[i] <= 0xd7)
-      {
-	/* JPEG_RST0 .. JPEG_RST7 markers */
-#if 0
-	if((buffer[i]==0xd0 && old_marker!=0 && old_marker!=0xd7) ||
-	    (buffer[i]!=0xd0 && old_marker+1 != buffer[i]))
-	{
-#ifdef DEBUG_JPEG
-	  log_info("Rejected due to JPEG_RST marker\n");
-#endif
-	  file_recovery->calculated_file_size++;
-	  return 2;
-	}
-	/* TODO: store old_marker in file_recovery */
-	old_marker=buffer[i];
-#endif
-      }
-      else if(buffer[i]!=0x00)
+      file_recovery->calculated_file_size=file_recovery->file_size + buffer_size/2;
+      return 1;
+    }
+    file_recovery->calculated_file_size+=ff - &buffer[i-1];
+    i+=ff - &buffer[i-1];
+    if(buffer[i]==0xd9)
+    {
+      /* JPEG_EOI */
+      file_recovery->calculated_file_size++;
+      return 2;
+    }
+    else if(buffer[i] >= 0xd0 && buffer[i] <= 0xd7)
+    {
+      /* JPEG_RST0 .. JPEG_RST7 markers */
+      const unsigned int old_marker=file_recovery->data_check_tmp;
+      /* No restart interval or more restart markers than MCU intervals */
+      if(file_recovery->data_check_tmp2==0 ||
+	  (buffer[i]==0xd0 && old_marker!=0 && old_marker!=0xd7) ||
+	  (buffer[i]!=0xd0 && old_marker+1 != buffer[i]))
       {
 #ifdef DEBUG_JPEG
-	log_info("%s data_check_jpg2 marker 0x%02x at 0x%llx\n", file_recovery->filename, buffer[i],
+	log_info("%s data_check_jpg2 rejected due to JPEG_RST marker 0x%02x at 0x%llx\n", file_recovery->filename, buffer[i],
 	    (long long unsigned)file_recovery->calculated_file_size);
 #endif
 	file_recovery->offset_error=file_recovery->calculated_file_size;
-	return 2;
+	return 0;
       }
+      file_recovery->data_check_tmp=buffer[i];
+      if(file_recovery->data_check_tmp2!=JPG_RESTART_UNLIMITED)
+	file_recovery->data_check_tmp2--;
+    }
+    else if(buffer[i]!=0x00)
+    {
+#ifdef DEBUG_JPEG
+      log_info("%s data_check_jpg2 marker 0x%02x at 0x%llx\n", file_recovery->filename, buffer[i],
+	  (long long unsigned)file_recovery->calculated_file_size);
+#endif
+      file_recovery->offset_error=file_recovery->calculated_file_size;
+      return 0;
     }
     file_recovery->calculated_file_size++;
   }
   return 1;
 }
 
+static int data_check_jpg2(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery)
+{
+  int res;
+  if(file_recovery->calculated_file_size<2)
+  {
+    /* Reset to the correct file checker */
+    file_recovery->data_check=&data_check_jpg;
+    return data_check_jpg(buffer, buffer_size, file_recovery);
+  }
+  /* The markers are checked first, a block breaking the restart
+   * sequence is rejected without being decoded */
+  res=data_check_jpg2_markers(buffer, buffer_size, file_recovery);
+  if(res==0)
+    return 2;
+#if defined(HAVE_LIBJPEG) && defined(HAVE_JPEGLIB_H)
+  if(jpg_stream_data_check(buffer, buffer_size, file_recovery)!=0)
+  {
+#ifdef DEBUG_JPEG
+    log_info("%s data_check_jpg2 decoding error at 0x%llx\n", file_recovery->filename,
+	(long long unsigned)jpg_stream.jpeg_size);
+#endif
+    file_recovery->offset_error=jpg_stream_offset_error(file_recovery, buffer_size/2);
+    return 2;
+  }
+#endif
+  return res;
+}
+
+/* Check that the restart markers of a block can follow the data already
+ * checked by data_check_jpg2(). The brute force uses it to reject a
+ * fragment hypothesis before any decoding.
+ * returns 0 if the block can't continue the scan, 1 otherwise */
+int data_check_jpg_rst(const unsigned char *buffer, const unsigned int buffer_size, const file_recovery_t *file_recovery)
+{
+  unsigned int old_marker;
+  unsigned int remaining;
+  unsigned int i;
+  if(file_recovery->data_check!=&data_check_jpg2 ||
+      file_recovery->calculated_file_size!=file_recovery->file_size)
+    return 1;
+  old_marker=file_recovery->data_check_tmp;
+  remaining=file_recovery->data_check_tmp2;
+  for(i=0; i+1<buffer_size; i++)
+  {
+    const unsigned char *ff=(const unsigned char *)memchr(&buffer[i], 0xFF, buffer_size - 1 - i);
+    if(ff==NULL)
+      return 1;
+    i=ff - buffer;
+    if(buffer[i+1]==0x00)
+    {
+      i++;
+      continue;
+    }
+    /* EOI or another marker, leave it to data_check_jpg2() */
+    if(buffer[i+1]<0xd0 || buffer[i+1]>0xd7)
+      return 1;
+    if(remaining==0 ||
+	(buffer[i+1]==0xd0 && old_marker!=0 && old_marker!=0xd7) ||
+	(buffer[i+1]!=0xd0 && old_marker+1 != buffer[i+1]))
+      return 0;
+    old_marker=buffer[i+1];
+    if(remaining!=JPG_RESTART_UNLIMITED)
+      remaining--;
+    i++;
+  }
+  return 1;
+}
+
+/* PhotoRec only checks the recovered files in paranoid mode, without it
+ * data_check_jpg() and data_check_jpg2() only check the markers */
+void jpg_stream_enable(const int enable)
+{
+#if defined(HAVE_LIBJPEG) && defined(HAVE_JPEGLIB_H)
+  jpg_stream_free(&jpg_stream);
+  jpg_stream_enabled=enable;
+#else
+  (void)enable;
+#endif
+}
+
+/* The brute force tries several blocks after the same data, the state of
+ * the incremental decoder only matches the first of these hypotheses.
+ * Forget it so that each hypothesis is checked the same way.
+ * jpg_check_picture() still decodes each of them from byte 0. */
+void jpg_stream_reset(void)
+{
+#if defined(HAVE_LIBJPEG) && defined(HAVE_JPEGLIB_H)
+  jpg_stream_free(&jpg_stream);
+#endif
+}
+
 int data_check_jpg(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery)
 {
+#if defined(HAVE_LIBJPEG) && defined(HAVE_JPEGLIB_H)
+  if(jpg_stream_data_check(buffer, buffer_size, file_recovery)!=0)
+  {
+    file_recovery->offset_error=jpg_stream_offset_error(file_recovery, buffer_size/2);
+    return 2;
+  }
+#endif
   if(buffer[buffer_size/2]==0xff && buffer[buffer_size/2]==0xd8 && 
       file_recovery->calculated_file_size != file_recovery->file_size)
   {
@@ -1628,6 +2018,13 @@ int data_check_jpg(const unsigned char *buffer, const unsigned int buffer_size,
   /* Skip the SOI */
   if(file_recovery->calculated_file_size==0)
     file_recovery->calculated_file_size+=2;
+  if(file_recovery->calculated_file_size==2)
+  {
+    /* Until the SOS, data_check_tmp holds the restart interval and the
+     * number of components, data_check_tmp2 the number of MCU */
+    file_recovery->data_check_tmp=0;
+    file_recovery->data_check_tmp2=0;
+  }
   /* Search SOS */
   while(file_recovery->calculated_file_size + buffer_size/2  >= file_recovery->file_size &&
       file_recovery->calculated_file_size + 4 < file_recovery->file_size + buffer_size/2)
@@ -1649,8 +2046,55 @@ int data_check_jpg(const unsigned char *buffer, const unsigned int buffer_size,
 	if(jpg_check_dht(buffer, buffer_size, i, 2+size)!=0)
 	  return 2;
       }
+      if(buffer[i+1]==0xdd)	/* DRI */
+      {
+	if(size==4 && i+5 < buffer_size)
+	  file_recovery->data_check_tmp=(file_recovery->data_check_tmp & 0x00ff0000) |
+	    (buffer[i+4]<<8) | buffer[i+5];
+	else
+	  file_recovery->data_check_tmp|=JPG_DRI_UNKNOWN;
+      }
+      if(buffer[i+1]>=0xc0 && buffer[i+1]<=0xcf &&
+	  buffer[i+1]!=0xc4 && buffer[i+1]!=0xc8 && buffer[i+1]!=0xcc &&
+	  i+9 < buffer_size &&
+	  i+10+3*buffer[i+9] <= buffer_size)	/* SOF */
+      {
+	const unsigned int height=(buffer[i+5]<<8)+buffer[i+6];
+	const unsigned int width=(buffer[i+7]<<8)+buffer[i+8];
+	const unsigned int nf=buffer[i+9];
+	unsigned int hmax=1;
+	unsigned int vmax=1;
+	unsigned int j;
+	if(nf>1)
+	{
+	  for(j=0; j<nf; j++)
+	  {
+	    const unsigned int sampling=buffer[i+11+3*j];
+	    if((sampling>>4) > hmax)
+	      hmax=sampling>>4;
+	    if((sampling&0x0f) > vmax)
+	      vmax=sampling&0x0f;
+	  }
+	}
+	file_recovery->data_check_tmp=(file_recovery->data_check_tmp & (JPG_DRI_UNKNOWN|0xffff)) | (nf<<16);
+	file_recovery->data_check_tmp2=((width + 8*hmax - 1) / (8*hmax)) * ((height + 8*vmax - 1) / (8*vmax));
+      }
       if(buffer[i+1]==0xda)	/* SOS: Start Of Scan */
       {
+	const unsigned int restart_interval=file_recovery->data_check_tmp & 0xffff;
+	const unsigned int nf=(file_recovery->data_check_tmp >> 16) & 0xff;
+	const unsigned int mcu_nbr=file_recovery->data_check_tmp2;
+	/* The number of MCU is only known for an interleaved scan */
+	if((file_recovery->data_check_tmp & JPG_DRI_UNKNOWN)!=0)
+	  file_recovery->data_check_tmp2=JPG_RESTART_UNLIMITED;
+	else if(restart_interval==0)
+	  file_recovery->data_check_tmp2=0;
+	else if(mcu_nbr==0 || buffer[i+4]!=nf)
+	  file_recovery->data_check_tmp2=JPG_RESTART_UNLIMITED;
+	else
+	  file_recovery->data_check_tmp2=(mcu_nbr - 1) / restart_interval;
+	/* No restart marker seen yet */
+	file_recovery->data_check_tmp=0;
 	file_recovery->data_check=&data_check_jpg2;
 	return data_check_jpg2(buffer, buffer_size, file_recovery);
       }
@@ -24,6 +24,9 @@ extern "C" {
 #endif
 
 const char*td_jpeg_version(void);
+int data_check_jpg_rst(const unsigned char *buffer, const unsigned int buffer_size, const file_recovery_t *file_recovery);
+void jpg_stream_reset(void);
+void jpg_stream_enable(const int enable);
 
 #ifdef __cplusplus
 } /* closing brace for extern "C" */
@@ -243,8 +243,12 @@ static int header_check_mov(const unsigned char *buffer, const unsigned int buff
   return 0;
 }
 
+#define MOV_ATOM(a,b,c,d)	(((uint32_t)(a)<<24) | ((uint32_t)(b)<<16) | ((uint32_t)(c)<<8) | (uint32_t)(d))
+
 static int data_check_mov(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery)
 {
+  /* calculated_file_size is the offset of the next atom: while it is beyond
+   * this buffer (ie. inside a large mdat), there is nothing to check */
   while(file_recovery->calculated_file_size + buffer_size/2  >= file_recovery->file_size &&
       file_recovery->calculated_file_size + 8 < file_recovery->file_size + buffer_size/2)
   {
@@ -254,6 +258,9 @@ static int data_check_mov(const unsigned char *buffer, const unsigned int buffer
     if(atom_size==1)
     {
       const struct atom64_struct *atom64=(const struct atom64_struct*)&buffer[i];
+      /* The 64-bit size is in the next block */
+      if(i+16 > buffer_size)
+	return 1;
       atom_size=be64(atom64->size);
       if(atom_size<16)
 	return 2;
@@ -268,32 +275,33 @@ static int data_check_mov(const unsigned char *buffer, const unsigned int buffer
         (long long unsigned)atom_size,
         (long long unsigned)file_recovery->calculated_file_size);
 #endif
-    if( (buffer[i+4]=='c' && buffer[i+5]=='m' && buffer[i+6]=='o' && buffer[i+7]=='v') ||
-	(buffer[i+4]=='c' && buffer[i+5]=='m' && buffer[i+6]=='v' && buffer[i+7]=='d') ||
-	(buffer[i+4]=='d' && buffer[i+5]=='c' && buffer[i+6]=='o' && buffer[i+7]=='m') ||
-	(buffer[i+4]=='f' && buffer[i+5]=='r' && buffer[i+6]=='e' && buffer[i+7]=='e') ||
-	(buffer[i+4]=='f' && buffer[i+5]=='t' && buffer[i+6]=='y' && buffer[i+7]=='p') ||
-	(buffer[i+4]=='j' && buffer[i+5]=='p' && buffer[i+6]=='2' && buffer[i+7]=='h') ||
-	(buffer[i+4]=='m' && buffer[i+5]=='d' && buffer[i+6]=='a' && buffer[i+7]=='t') ||
-	(buffer[i+4]=='m' && buffer[i+5]=='d' && buffer[i+6]=='i' && buffer[i+7]=='a') ||
-	(buffer[i+4]=='m' && buffer[i+5]=='o' && buffer[i+6]=='o' && buffer[i+7]=='v') ||
-	(buffer[i+4]=='P' && buffer[i+5]=='I' && buffer[i+6]=='C' && buffer[i+7]=='T') ||
-	(buffer[i+4]=='p' && buffer[i+5]=='n' && buffer[i+6]=='o' && buffer[i+7]=='t') ||
-	(buffer[i+4]=='s' && buffer[i+5]=='k' && buffer[i+6]=='i' && buffer[i+7]=='p') ||
-	(buffer[i+4]=='s' && buffer[i+5]=='t' && buffer[i+6]=='b' && buffer[i+7]=='l') ||
-	(buffer[i+4]=='t' && buffer[i+5]=='r' && buffer[i+6]=='a' && buffer[i+7]=='k') ||
-	(buffer[i+4]=='u' && buffer[i+5]=='u' && buffer[i+6]=='i' && buffer[i+7]=='d') ||
-	(buffer[i+4]=='w' && buffer[i+5]=='i' && buffer[i+6]=='d' && buffer[i+7]=='e') )
-    {
-      file_recovery->calculated_file_size+=atom_size;
-    }
-    else
+    switch(be32(atom->type))
     {
-      if(!(buffer[i+4]==0 && buffer[i+5]==0 && buffer[i+6]==0 && buffer[i+7]==0))
-        log_warning("file_mov.c: unknown atom 0x%02x%02x%02x%02x at %llu\n",
-            buffer[i+4],buffer[i+5],buffer[i+6],buffer[i+7],
-            (long long unsigned)file_recovery->calculated_file_size);
-      return 2;
+      case MOV_ATOM('c','m','o','v'):
+      case MOV_ATOM('c','m','v','d'):
+      case MOV_ATOM('d','c','o','m'):
+      case MOV_ATOM('f','r','e','e'):
+      case MOV_ATOM('f','t','y','p'):
+      case MOV_ATOM('j','p','2','h'):
+      case MOV_ATOM('m','d','a','t'):
+      case MOV_ATOM('m','d','i','a'):
+      case MOV_ATOM('m','o','o','v'):
+      case MOV_ATOM('P','I','C','T'):
+      case MOV_ATOM('p','n','o','t'):
+      case MOV_ATOM('s','k','i','p'):
+      case MOV_ATOM('s','t','b','l'):
+      case MOV_ATOM('t','r','a','k'):
+      case MOV_ATOM('u','u','i','d'):
+      case MOV_ATOM('w','i','d','e'):
+	/* Jump directly to the next atom */
+	file_recovery->calculated_file_size+=atom_size;
+	break;
+      default:
+	if(!(buffer[i+4]==0 && buffer[i+5]==0 && buffer[i+6]==0 && buffer[i+7]==0))
+	  log_warning("file_mov.c: unknown atom 0x%02x%02x%02x%02x at %llu\n",
+	      buffer[i+4],buffer[i+5],buffer[i+6],buffer[i+7],
+	      (long long unsigned)file_recovery->calculated_file_size);
+	return 2;
     }
   }
 #ifdef DEBUG_MOV
@@ -302,4 +310,3 @@ static int data_check_mov(const unsigned char *buffer, const unsigned int buffer
 #endif
   return 1;
 }
-
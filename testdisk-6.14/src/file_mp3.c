@@ -31,13 +31,13 @@
 #include "common.h"
 #include "filegen.h"
 #include "log.h"
+#include "memmem.h"
 
 extern const file_hint_t file_hint_mkv;
 
 static void register_header_check_mp3(file_stat_t *file_stat);
 static int data_check_id3(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery);
 static int data_check_mp3(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery);
-static unsigned int pos_in_mem(const unsigned char *haystack, const unsigned int haystack_size, const unsigned char *needle, const unsigned int needle_size);
 static unsigned int search_MMT(const unsigned char *buffer, const unsigned int i, const unsigned int buffer_size);
 
 const file_hint_t file_hint_mp3= {
@@ -305,17 +305,17 @@ static int data_check_mp3(const unsigned char *buffer, const unsigned int buffer
 	 'LYRICS200'  Lyrics3v2 Tags
 	 The maximum length of the lyrics is 5100 bytes for Lyrics3 and 4096 bytes for Lyrics3 v2.
        */
-      unsigned int pos_lyrics=0;
+      const unsigned char *pos_lyrics;
       /* FIXME */
       if(file_recovery->calculated_file_size + 5100 >= file_recovery->file_size + buffer_size/2)
 	return 1;
-      if((pos_lyrics=pos_in_mem(&buffer[i], 4096, (const unsigned char*)"LYRICS200", 9)) != 0)
+      if((pos_lyrics=(const unsigned char *)td_memmem(&buffer[i], 4096, "LYRICS200", 9)) != NULL)
       {
-	file_recovery->calculated_file_size+=pos_lyrics;
+	file_recovery->calculated_file_size+=pos_lyrics-&buffer[i]+9;
       }
-      else if((pos_lyrics=pos_in_mem(&buffer[i], 5100, (const unsigned char*)"LYRICSEND", 9)) != 0)
+      else if((pos_lyrics=(const unsigned char *)td_memmem(&buffer[i], 5100, "LYRICSEND", 9)) != NULL)
       {
-	file_recovery->calculated_file_size+=pos_lyrics;
+	file_recovery->calculated_file_size+=pos_lyrics-&buffer[i]+9;
       }
       else 
       {
@@ -352,15 +352,6 @@ static int data_check_mp3(const unsigned char *buffer, const unsigned int buffer
   return 1;
 }
 
-static unsigned int pos_in_mem(const unsigned char *haystack, const unsigned int haystack_size, const unsigned char *needle, const unsigned int needle_size)
-{
-  unsigned int i;
-  for(i=0;i<haystack_size;i++)
-    if(memcmp(&haystack[i],needle,needle_size)==0)
-      return (i+needle_size);
-  return 0;
-}
-
 static unsigned int search_MMT(const unsigned char *buffer, const unsigned int i, const unsigned int buffer_size)
 {
   /*
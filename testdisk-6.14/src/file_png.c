@@ -29,13 +29,18 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
 #include <stdio.h>
 #include <ctype.h>
 #include "types.h"
+#include "common.h"
 #include "filegen.h"
+#include "crc.h"
 
 extern const file_hint_t file_hint_doc;
 
@@ -43,6 +48,7 @@ static void register_header_check_png(file_stat_t *file_stat);
 static int header_check_png(const unsigned char *buffer, const unsigned int buffer_size, const unsigned int safe_header_only, const file_recovery_t *file_recovery, file_recovery_t *file_recovery_new);
 static int data_check_png(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery);
 static int data_check_mng(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery);
+static void file_check_png(file_recovery_t *file_recovery);
 
 const file_hint_t file_hint_png= {
   .extension="png",
@@ -73,7 +79,7 @@ static int header_check_png(const unsigned char *buffer, const unsigned int buff
     file_recovery_new->extension="jng";
     file_recovery_new->calculated_file_size=8;
     file_recovery_new->data_check=&data_check_png;
-    file_recovery_new->file_check=&file_check_size;
+    file_recovery_new->file_check=&file_check_png;
     return 1;
   }
   if(memcmp(buffer,mng_header,sizeof(mng_header))==0)
@@ -82,7 +88,7 @@ static int header_check_png(const unsigned char *buffer, const unsigned int buff
     file_recovery_new->extension="mng";
     file_recovery_new->calculated_file_size=8;
     file_recovery_new->data_check=&data_check_mng;
-    file_recovery_new->file_check=&file_check_size;
+    file_recovery_new->file_check=&file_check_png;
     return 1;
   }
   /* SolidWorks files contains a png */
@@ -97,50 +103,188 @@ static int header_check_png(const unsigned char *buffer, const unsigned int buff
     file_recovery_new->extension=file_hint_png.extension;
     file_recovery_new->calculated_file_size=8;
     file_recovery_new->data_check=&data_check_png;
-    file_recovery_new->file_check=&file_check_size;
+    file_recovery_new->file_check=&file_check_png;
     return 1;
   }
   return 0;
 }
 
-static int data_check_mng(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery)
+/* State of the chunk walk, kept in data_check_tmp */
+#define PNG_CHUNK_HEADER	0	/* calculated_file_size is the offset of the next chunk */
+#define PNG_CHUNK_DATA		1	/* calculated_file_size is the end of the chunk being checked */
+#define PNG_CHUNK_FOOTER	2	/* same for the last chunk, IEND or MEND */
+#define PNG_CHUNK_END		3	/* all chunks have been checked */
+
+static int png_chunk_type_is_valid(const unsigned char *type)
+{
+// PNG chunk code
+// IDAT IHDR PLTE bKGD cHRM fRAc gAMA gIFg gIFt gIFx hIST iCCP
+// iTXt oFFs pCAL pHYs sBIT sCAL sPLT sRGB sTER tEXt tRNS zTXt
+  return ((isupper(type[0]) || islower(type[0])) &&
+      (isupper(type[1]) || islower(type[1])) &&
+      (isupper(type[2]) || islower(type[2])) &&
+      (isupper(type[3]) || islower(type[3])));
+}
+
+/* chunk: length, type, data, crc
+ * The CRC covers the type and the data, it's updated as the blocks are read.
+ * Stop at the first bad chunk, offset_error is set to help photorec_bf() */
+static int data_check_png_aux(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery, const char *footer, const int check_type)
 {
-  static const unsigned char mng_footer[4]= {'M','E','N','D'};
-  while(file_recovery->calculated_file_size + buffer_size/2  >= file_recovery->file_size &&
-      file_recovery->calculated_file_size + 8 < file_recovery->file_size + buffer_size/2)
+  if(file_recovery->file_size==0)
   {
-    const unsigned int i=file_recovery->calculated_file_size - file_recovery->file_size + buffer_size/2;
-    /* chunk: length, type, data, crc */
-    file_recovery->calculated_file_size+=(buffer[i]<<24)+(buffer[i+1]<<16)+(buffer[i+2]<<8)+buffer[i+3];
-    file_recovery->calculated_file_size+=12;
-    if(memcmp(&buffer[i+4], mng_footer, sizeof(mng_footer))==0)
+    /* Skip the signature */
+    file_recovery->calculated_file_size=8;
+    file_recovery->data_check_tmp=PNG_CHUNK_HEADER;
+  }
+  if(file_recovery->data_check_tmp==PNG_CHUNK_END)
+    return 2;
+  if((file_recovery->data_check_tmp==PNG_CHUNK_DATA || file_recovery->data_check_tmp==PNG_CHUNK_FOOTER) &&
+      file_recovery->calculated_file_size - 4 > file_recovery->file_size)
+  {
+    /* The current chunk continues in the new block */
+    const uint64_t crc_end=file_recovery->calculated_file_size - 4;
+    const unsigned int len=(crc_end < file_recovery->file_size + buffer_size/2 ?
+	crc_end - file_recovery->file_size : buffer_size/2);
+    file_recovery->data_check_crc=get_crc32(&buffer[buffer_size/2], len, file_recovery->data_check_crc);
+  }
+  while(1)
+  {
+    unsigned int i;
+    uint64_t length;
+    if(file_recovery->data_check_tmp==PNG_CHUNK_DATA || file_recovery->data_check_tmp==PNG_CHUNK_FOOTER)
+    {
+      /* The CRC is stored after the chunk data */
+      if(file_recovery->calculated_file_size > file_recovery->file_size + buffer_size/2)
+	return 1;
+      /* The CRC has already gone out of the buffer after an error */
+      if(file_recovery->calculated_file_size + buffer_size/2 < file_recovery->file_size + 4)
+	return 2;
+      i=file_recovery->calculated_file_size - file_recovery->file_size + buffer_size/2;
+      if((((uint32_t)buffer[i-4]<<24)|(buffer[i-3]<<16)|(buffer[i-2]<<8)|buffer[i-1]) !=
+	  (file_recovery->data_check_crc ^ 0xFFFFFFFF))
+      {
+	file_recovery->offset_error=file_recovery->calculated_file_size - 4;
+	return 2;
+      }
+      file_recovery->offset_ok=file_recovery->calculated_file_size;
+      if(file_recovery->data_check_tmp==PNG_CHUNK_FOOTER)
+      {
+	file_recovery->data_check_tmp=PNG_CHUNK_END;
+	return 2;
+      }
+      file_recovery->data_check_tmp=PNG_CHUNK_HEADER;
+    }
+    if(file_recovery->calculated_file_size + buffer_size/2 < file_recovery->file_size ||
+	file_recovery->calculated_file_size + 8 >= file_recovery->file_size + buffer_size/2)
+      return 1;
+    i=file_recovery->calculated_file_size - file_recovery->file_size + buffer_size/2;
+    length=((uint64_t)buffer[i]<<24)|(buffer[i+1]<<16)|(buffer[i+2]<<8)|buffer[i+3];
+    if(length > 0x7fffffff || (check_type!=0 && !png_chunk_type_is_valid(&buffer[i+4])))
+    {
+      file_recovery->offset_error=file_recovery->calculated_file_size;
       return 2;
+    }
+    file_recovery->data_check_crc=get_crc32(&buffer[i+4],
+	(i + 8 + length < buffer_size ? 4 + length : buffer_size - (i + 4)),
+	0xFFFFFFFF);
+    file_recovery->data_check_tmp=(memcmp(&buffer[i+4], footer, 4)==0 ? PNG_CHUNK_FOOTER : PNG_CHUNK_DATA);
+    file_recovery->calculated_file_size+=length+12;
   }
-  return 1;
+}
+
+static int data_check_mng(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery)
+{
+  return data_check_png_aux(buffer, buffer_size, file_recovery, "MEND", 0);
 }
 
 static int data_check_png(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery)
 {
-  while(file_recovery->calculated_file_size + buffer_size/2  >= file_recovery->file_size &&
-      file_recovery->calculated_file_size + 8 < file_recovery->file_size + buffer_size/2)
+  return data_check_png_aux(buffer, buffer_size, file_recovery, "IEND", 1);
+}
+
+static void file_check_png(file_recovery_t *file_recovery)
+{
+  const char *footer=(file_recovery->data_check==&data_check_mng ? "MEND" : "IEND");
+  const int check_type=(file_recovery->data_check==&data_check_png);
+  unsigned char *buffer;
+  uint64_t offset;
+  int found=0;
+  if(file_recovery->data_check_tmp==PNG_CHUNK_END && file_recovery->calculated_file_size > 0)
   {
-    const unsigned int i=file_recovery->calculated_file_size - file_recovery->file_size + buffer_size/2;
-    /* chunk: length, type, data, crc */
-    file_recovery->calculated_file_size+=(buffer[i]<<24)+(buffer[i+1]<<16)+(buffer[i+2]<<8)+buffer[i+3];
-    file_recovery->calculated_file_size+=12;
-    if(memcmp(&buffer[i+4], "IEND", 4)==0)
-      return 2;
-// PNG chunk code
-// IDAT IHDR PLTE bKGD cHRM fRAc gAMA gIFg gIFt gIFx hIST iCCP
-// iTXt oFFs pCAL pHYs sBIT sCAL sPLT sRGB sTER tEXt tRNS zTXt
-    if( !((isupper(buffer[i+4]) || islower(buffer[i+4])) &&
-	  (isupper(buffer[i+5]) || islower(buffer[i+5])) &&
-	  (isupper(buffer[i+6]) || islower(buffer[i+6])) &&
-	  (isupper(buffer[i+7]) || islower(buffer[i+7]))))
+    /* data_check_png() has already checked every chunk */
+    file_check_size(file_recovery);
+    return ;
+  }
+  if(file_recovery->offset_error > 0)
+  {
+    file_recovery->file_size=0;
+    return ;
+  }
+  /* The chunks have not been checked, ie. by fidentify or photorec_bf() */
+  offset=8;
+  if(file_recovery->checkpoint_status==1 && file_recovery->checkpoint_resume > 8)
+  {
+    /* The chunks before the checkpoint have already been checked */
+    offset=file_recovery->checkpoint_resume;
+    file_recovery->offset_ok=offset;
+  }
+  buffer=(unsigned char *)MALLOC(4096);
+  while(offset + 12 <= file_recovery->file_size)
+  {
+    unsigned char type[4];
+    uint64_t length;
+    uint64_t pos;
+    uint32_t crc;
+    if(file_recovery->checkpoint_status==0 && offset <= file_recovery->checkpoint_offset)
     {
-      return 2;
+      /* The data before checkpoint_offset won't change, remember the last
+       * chunk beginning before it */
+      file_recovery->checkpoint_resume=offset;
+    }
+    if(fseek(file_recovery->handle, offset, SEEK_SET) < 0 ||
+	fread(buffer, 8, 1, file_recovery->handle) != 1)
+      break;
+    length=((uint64_t)buffer[0]<<24)|(buffer[1]<<16)|(buffer[2]<<8)|buffer[3];
+    memcpy(type, &buffer[4], 4);
+    if(length > 0x7fffffff || (check_type!=0 && !png_chunk_type_is_valid(type)))
+    {
+      file_recovery->offset_error=offset;
+      break;
+    }
+    if(offset + 12 + length > file_recovery->file_size)
+      break;
+    crc=get_crc32(type, 4, 0xFFFFFFFF);
+    for(pos=0; pos < length; pos+=4096)
+    {
+      const unsigned int len=(length - pos < 4096 ? length - pos : 4096);
+      if(fread(buffer, len, 1, file_recovery->handle) != 1)
+	break;
+      crc=get_crc32(buffer, len, crc);
+    }
+    if(pos < length || fread(buffer, 4, 1, file_recovery->handle) != 1)
+      break;
+    if((((uint32_t)buffer[0]<<24)|(buffer[1]<<16)|(buffer[2]<<8)|buffer[3]) != (crc ^ 0xFFFFFFFF))
+    {
+      file_recovery->offset_error=offset + 8 + length;
+      break;
+    }
+    offset+=length+12;
+    file_recovery->offset_ok=offset;
+    if(memcmp(type, footer, 4)==0)
+    {
+      found=1;
+      break;
     }
   }
-  return 1;
+  free(buffer);
+  if(file_recovery->checkpoint_offset > 0 && file_recovery->checkpoint_resume > 8)
+    file_recovery->checkpoint_status=1;
+  if(found==0)
+  {
+    file_recovery->file_size=0;
+    return ;
+  }
+  file_recovery->calculated_file_size=offset;
+  file_recovery->file_size=offset;
 }
-
@@ -40,6 +40,7 @@
 #include "filegen.h"
 #include "common.h"
 #include "log.h"
+#include "memmem.h"
 
 static void register_header_check_sig(file_stat_t *file_stat);
 static int header_check_sig(const unsigned char *buffer, const unsigned int buffer_size, const unsigned int safe_header_only, const file_recovery_t *file_recovery, file_recovery_t *file_recovery_new);
@@ -57,40 +58,238 @@ const file_hint_t file_hint_sig= {
 #define WIN_PHOTOREC_SIG "\\photorec.sig"
 #define DOT_PHOTOREC_SIG "/.photorec.sig"
 #define PHOTOREC_SIG "photorec.sig"
+#define SIG_FOOTER_MAX_SIZE 256
 
 typedef struct signature_s signature_t;
 struct signature_s
 {
-  const char *extension;
+  char *extension;
   unsigned char *sig;
+  unsigned char *mask;		/* NULL or 0 for the bytes matching any value */
   unsigned int sig_size;
   unsigned int offset;
+  unsigned int anchor;		/* first byte of sig that is not a wildcard */
+  unsigned char *footer;
+  unsigned int footer_size;
+  uint64_t max_size;
   signature_t *next;
 };
 
+/* The signatures are sorted by anchor offset, anchor byte and decreasing size.
+ * For each anchor offset, a group gives the signatures for each byte value */
+typedef struct
+{
+  unsigned int offset;
+  unsigned int start[257];	/* sig_array[start[c]] to sig_array[start[c+1]-1] */
+} sig_group_t;
+
 static signature_t *signatures=NULL;
-static void signature_insert(const char *extension, unsigned int offset, unsigned char *sig, unsigned int sig_size)
+static signature_t **sig_array=NULL;
+static unsigned int sig_nbr=0;
+static sig_group_t *sig_groups=NULL;
+static unsigned int sig_groups_nbr=0;
+/* The groups to check for each value of the first byte of the block:
+ * sig_bucket[sig_bucket_start[c]] to sig_bucket[sig_bucket_start[c+1]-1].
+ * A group at offset 0 is only listed for the bytes it has signatures for,
+ * the other groups are listed for every byte. */
+static unsigned int *sig_bucket=NULL;
+static unsigned int sig_bucket_start[257];
+
+static void signature_insert(char *extension, unsigned int offset, unsigned char *sig, unsigned char *mask, unsigned int sig_size, unsigned char *footer, unsigned int footer_size, uint64_t max_size)
 {
-  /* FIXME: small memory leak */
   signature_t *newsig=(signature_t*)MALLOC(sizeof(*newsig));
   newsig->extension=extension;
   newsig->sig=sig;
+  newsig->mask=mask;
   newsig->sig_size=sig_size;
   newsig->offset=offset;
+  for(newsig->anchor=0;
+      mask!=NULL && newsig->anchor < sig_size && mask[newsig->anchor]==0;
+      newsig->anchor++);
+  newsig->footer=footer;
+  newsig->footer_size=footer_size;
+  newsig->max_size=max_size;
   newsig->next=signatures;
   signatures=newsig;
 }
 
-static int header_check_sig(const unsigned char *buffer, const unsigned int buffer_size, const unsigned int safe_header_only, const file_recovery_t *file_recovery, file_recovery_t *file_recovery_new)
+static void signature_free(void)
+{
+  while(signatures!=NULL)
+  {
+    signature_t *next=signatures->next;
+    free(signatures->extension);
+    free(signatures->sig);
+    free(signatures->mask);
+    free(signatures->footer);
+    free(signatures);
+    signatures=next;
+  }
+  free(sig_array);
+  free(sig_groups);
+  free(sig_bucket);
+  sig_array=NULL;
+  sig_groups=NULL;
+  sig_bucket=NULL;
+  sig_nbr=0;
+  sig_groups_nbr=0;
+}
+
+static int signature_cmp(const void *a, const void *b)
+{
+  const signature_t *sig_a=*(const signature_t * const *)a;
+  const signature_t *sig_b=*(const signature_t * const *)b;
+  if(sig_a->offset + sig_a->anchor != sig_b->offset + sig_b->anchor)
+    return (sig_a->offset + sig_a->anchor < sig_b->offset + sig_b->anchor ? -1 : 1);
+  if(sig_a->sig[sig_a->anchor] != sig_b->sig[sig_b->anchor])
+    return (sig_a->sig[sig_a->anchor] < sig_b->sig[sig_b->anchor] ? -1 : 1);
+  /* Longest signatures first, they are the most specific */
+  if(sig_a->sig_size != sig_b->sig_size)
+    return (sig_a->sig_size > sig_b->sig_size ? -1 : 1);
+  return 0;
+}
+
+static int signature_match(const signature_t *sig, const unsigned char *buffer, const unsigned int buffer_size)
+{
+  unsigned int i;
+  if(sig->offset + sig->sig_size > buffer_size)
+    return 0;
+  if(sig->mask==NULL)
+    return (memcmp(&buffer[sig->offset], sig->sig, sig->sig_size)==0);
+  for(i=sig->anchor; i<sig->sig_size; i++)
+    if(sig->mask[i]!=0 && buffer[sig->offset+i]!=sig->sig[i])
+      return 0;
+  return 1;
+}
+
+/* Number of bytes, starting at the anchor, shared by all the signatures of
+ * sig_array[first..last-1] */
+static unsigned int signature_common_prefix(const unsigned int first, const unsigned int last)
+{
+  const signature_t *sig0=sig_array[first];
+  unsigned int len;
+  for(len=1; sig0->anchor + len < sig0->sig_size; len++)
+  {
+    unsigned int i;
+    for(i=first; i<last; i++)
+    {
+      const signature_t *sig=sig_array[i];
+      if(sig->anchor + len >= sig->sig_size ||
+	  (sig->mask!=NULL && sig->mask[sig->anchor + len]==0) ||
+	  sig->sig[sig->anchor + len]!=sig0->sig[sig0->anchor + len])
+	return len;
+    }
+  }
+  return len;
+}
+
+/* Sort the signatures and register a single header check for each
+ * anchor offset/byte value instead of one per signature */
+static void signature_compile(file_stat_t *file_stat)
 {
   signature_t *sig;
-  for(sig=signatures; sig!=NULL; sig=sig->next)
+  unsigned int i;
+  unsigned int bucket_nbr;
+  for(sig=signatures, sig_nbr=0; sig!=NULL; sig=sig->next)
+    sig_nbr++;
+  if(sig_nbr==0)
+    return ;
+  sig_array=(signature_t **)MALLOC(sig_nbr * sizeof(*sig_array));
+  for(sig=signatures, i=0; sig!=NULL; sig=sig->next, i++)
+    sig_array[i]=sig;
+  qsort(sig_array, sig_nbr, sizeof(*sig_array), signature_cmp);
+  sig_groups=(sig_group_t *)MALLOC(sig_nbr * sizeof(*sig_groups));
+  sig_groups_nbr=0;
+  for(i=0; i<sig_nbr; )
+  {
+    sig_group_t *group=&sig_groups[sig_groups_nbr++];
+    unsigned int c;
+    group->offset=sig_array[i]->offset + sig_array[i]->anchor;
+    for(c=0; c<256; c++)
+    {
+      const unsigned int first=i;
+      group->start[c]=i;
+      while(i<sig_nbr &&
+	  sig_array[i]->offset + sig_array[i]->anchor==group->offset &&
+	  sig_array[i]->sig[sig_array[i]->anchor]==c)
+	i++;
+      if(i > first)
+	register_header_check(group->offset, &sig_array[first]->sig[sig_array[first]->anchor],
+	    signature_common_prefix(first, i), &header_check_sig, file_stat);
+    }
+    group->start[256]=i;
+  }
+  sig_bucket=(unsigned int *)MALLOC(256 * sig_groups_nbr * sizeof(*sig_bucket));
+  for(i=0, bucket_nbr=0; i<256; i++)
   {
-    if(memcmp(&buffer[sig->offset], sig->sig, sig->sig_size)==0)
+    unsigned int g;
+    sig_bucket_start[i]=bucket_nbr;
+    for(g=0; g<sig_groups_nbr; g++)
     {
-      reset_file_recovery(file_recovery_new);
-      file_recovery_new->extension=sig->extension;
-      return 1;
+      const sig_group_t *group=&sig_groups[g];
+      if(group->offset > 0 || group->start[i] < group->start[i+1])
+	sig_bucket[bucket_nbr++]=g;
+    }
+  }
+  sig_bucket_start[256]=bucket_nbr;
+  log_info("%u custom signatures, %u anchor offsets\n", sig_nbr, sig_groups_nbr);
+}
+
+static int data_check_sig(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery)
+{
+  const signature_t *sig=sig_array[file_recovery->data_check_tmp];
+  if(sig->footer_size > 0)
+  {
+    /* The footer may begin in the previous block */
+    const unsigned int start=(file_recovery->file_size==0 ? buffer_size/2 : buffer_size/2 - sig->footer_size + 1);
+    const unsigned char *footer=(const unsigned char *)td_memmem(&buffer[start], buffer_size - start, sig->footer, sig->footer_size);
+    if(footer!=NULL)
+    {
+      file_recovery->calculated_file_size=file_recovery->file_size + (footer - buffer) + sig->footer_size - buffer_size/2;
+      return 2;
+    }
+  }
+  if(sig->max_size > 0 && file_recovery->file_size + buffer_size/2 >= sig->max_size)
+  {
+    file_recovery->calculated_file_size=sig->max_size;
+    return 2;
+  }
+  return 1;
+}
+
+static void file_check_sig(file_recovery_t *file_recovery)
+{
+  /* data_check_sig() has found the footer or reached max_size, the file
+   * ends there. Otherwise it ends at the next header. */
+  if(file_recovery->calculated_file_size > 0 &&
+      file_recovery->file_size > file_recovery->calculated_file_size)
+    file_recovery->file_size=file_recovery->calculated_file_size;
+}
+
+static int header_check_sig(const unsigned char *buffer, const unsigned int buffer_size, const unsigned int safe_header_only, const file_recovery_t *file_recovery, file_recovery_t *file_recovery_new)
+{
+  unsigned int b;
+  for(b=sig_bucket_start[buffer[0]]; b<sig_bucket_start[buffer[0]+1]; b++)
+  {
+    const sig_group_t *group=&sig_groups[sig_bucket[b]];
+    unsigned int i;
+    if(group->offset >= buffer_size)
+      continue;
+    for(i=group->start[buffer[group->offset]]; i<group->start[buffer[group->offset]+1]; i++)
+    {
+      const signature_t *sig=sig_array[i];
+      if(signature_match(sig, buffer, buffer_size))
+      {
+	reset_file_recovery(file_recovery_new);
+	file_recovery_new->extension=sig->extension;
+	if(sig->footer_size > 0 || sig->max_size > 0)
+	{
+	  file_recovery_new->data_check_tmp=i;
+	  file_recovery_new->data_check=&data_check_sig;
+	  file_recovery_new->file_check=&file_check_sig;
+	}
+	return 1;
+      }
     }
   }
   return 0;
@@ -183,7 +382,174 @@ static char *str_uint(char *src, unsigned int *resptr)
 
 }
 
-static char *parse_signature_file(file_stat_t *file_stat, char *pos)
+/* Same as str_uint() for a 64-bit value.
+ * Returns NULL if there is no digit or if the value overflows */
+static char *str_uint64(char *src, uint64_t *resptr)
+{
+  uint64_t res=0;
+  unsigned int base=10;
+  unsigned int digits=0;
+  if(*src=='0' && (*(src+1)=='x' || *(src+1)=='X'))
+  {
+    base=16;
+    src+=2;
+  }
+  for(;;src++, digits++)
+  {
+    unsigned int digit;
+    if(*src>='0' && *src<='9')
+      digit=*src-'0';
+    else if(base==16 && *src>='A' && *src<='F')
+      digit=*src-'A'+10;
+    else if(base==16 && *src>='a' && *src<='f')
+      digit=*src-'a'+10;
+    else
+      break;
+    if(res > ((uint64_t)-1 - digit) / base)
+      return NULL;
+    res=res*base+digit;
+  }
+  if(digits==0)
+    return NULL;
+  *resptr=res;
+  return src;
+}
+
+typedef struct
+{
+  unsigned char *data;
+  unsigned char *mask;
+  unsigned int size;
+  unsigned int max_size;
+  int wildcard;
+} sig_buffer_t;
+
+static void sig_buffer_add(sig_buffer_t *buf, const unsigned char val, const unsigned char mask)
+{
+  if(buf->size==buf->max_size)
+  {
+    buf->max_size*=2;
+    buf->data=(unsigned char *)realloc(buf->data, buf->max_size);
+    buf->mask=(unsigned char *)realloc(buf->mask, buf->max_size);
+    if(buf->data==NULL || buf->mask==NULL)
+    {
+      log_critical("file_sig.c: memory allocation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  buf->data[buf->size]=val;
+  buf->mask[buf->size]=mask;
+  buf->size++;
+  if(mask==0)
+    buf->wildcard=1;
+}
+
+static unsigned char sig_escape(const char c)
+{
+  switch(c)
+  {
+    case 'b':
+      return '\b';
+    case 'n':
+      return '\n';
+    case 'r':
+      return '\r';
+    case 't':
+      return '\t';
+    case '0':
+      return '\0';
+    default:
+      return c;
+  }
+}
+
+static unsigned int sig_hex(const char c)
+{
+  if(c>='0' && c<='9')
+    return c-'0';
+  if(c>='A' && c<='F')
+    return c-'A'+10;
+  return c-'a'+10;
+}
+
+static int sig_is_keyword(const char *pos, const char *keyword)
+{
+  const unsigned int len=strlen(keyword);
+  return (strncmp(pos, keyword, len)==0 && (isspace(pos[len]) || pos[len]=='\0'));
+}
+
+/* Read the bytes of a signature or a footer up to the end of the line or
+ * to the next keyword. Returns NULL if the syntax is invalid. */
+static char *parse_signature_bytes(char *pos, sig_buffer_t *buf)
+{
+  while(*pos!='\n' && *pos!='\0' &&
+      !sig_is_keyword(pos, "footer") && !sig_is_keyword(pos, "max_size"))
+  {
+    if(isspace(*pos) || *pos=='\r' || *pos==',')
+      pos++;
+    else if(*pos== '\'')
+    {
+      pos++;
+      if(*pos=='\0')
+	return NULL;
+      else if(*pos=='\\')
+      {
+	pos++;
+	if(*pos=='\0')
+	  return NULL;
+	sig_buffer_add(buf, sig_escape(*pos), 0xff);
+	pos++;
+      }
+      else
+      {
+	sig_buffer_add(buf, *pos, 0xff);
+	pos++;
+      }
+      if(*pos!='\'')
+	return NULL;
+      pos++;
+    }
+    else if(*pos=='"')
+    {
+      pos++;
+      for(; *pos!='"' && *pos!='\0'; pos++)
+      {
+	if(*pos=='\\')
+	{
+	  pos++;
+	  if(*pos=='\0')
+	    return NULL;
+	  sig_buffer_add(buf, sig_escape(*pos), 0xff);
+	}
+	else
+	  sig_buffer_add(buf, *pos, 0xff);
+      }
+      if(*pos!='"')
+	return NULL;
+      pos++;
+    }
+    else if(*pos=='0' && (*(pos+1)=='x' || *(pos+1)=='X'))
+    {
+      /* hexadecimal bytes, ?? matches any value */
+      pos+=2;
+      while((isxdigit(*pos) && isxdigit(*(pos+1))) ||
+	  (*pos=='?' && *(pos+1)=='?'))
+      {
+	if(*pos=='?')
+	  sig_buffer_add(buf, 0, 0);
+	else
+	  sig_buffer_add(buf, sig_hex(*pos)*16 + sig_hex(*(pos+1)), 0xff);
+	pos+=2;
+      }
+    }
+    else
+      return NULL;
+  }
+  return pos;
+}
+
+/* each line is composed of "extension offset signature [footer footer] [max_size size]" */
+static char *parse_signature_file(char *pos)
 {
   while(*pos!='\0')
   {
@@ -196,13 +562,13 @@ static char *parse_signature_file(file_stat_t *file_stat, char *pos)
 	return pos;
       pos++;
     }
-    /* each line is composed of "extension offset signature" */
     {
       char *extension;
+      char *line=pos;
       unsigned int offset=0;
-      unsigned char *tmp=NULL;
-      unsigned int signature_max_size=512;
-      unsigned int signature_size=0;
+      uint64_t max_size=0;
+      sig_buffer_t sig={ NULL, NULL, 0, 512, 0 };
+      sig_buffer_t footer={ NULL, NULL, 0, 512, 0 };
       {
 	const char *extension_start=pos;
 	while(*pos!='\0' && !isspace(*pos))
@@ -219,160 +585,64 @@ static char *parse_signature_file(file_stat_t *file_stat, char *pos)
       /* read offset */
       pos=str_uint(pos, &offset);
       /* read signature */
-      tmp=(unsigned char *)MALLOC(signature_max_size);
-      while(*pos!='\n' && *pos!='\0')
+      sig.data=(unsigned char *)MALLOC(sig.max_size);
+      sig.mask=(unsigned char *)MALLOC(sig.max_size);
+      footer.data=(unsigned char *)MALLOC(footer.max_size);
+      footer.mask=(unsigned char *)MALLOC(footer.max_size);
+      pos=parse_signature_bytes(pos, &sig);
+      while(pos!=NULL && *pos!='\n' && *pos!='\0')
       {
-	if(signature_size==signature_max_size)
-	{
-	  unsigned char *tmp_old=tmp;
-	  signature_max_size*=2;
-	  tmp=(unsigned char *)realloc(tmp, signature_max_size);
-	  if(tmp==NULL)
-	  {
-	    free(extension);
-	    free(tmp_old);
-	    return pos;
-	  }
-	}
-	if(isspace(*pos) || *pos=='\r' || *pos==',')
-	  pos++;
-	else if(*pos== '\'')
-	{
-	  pos++;
-	  if(*pos=='\0')
-	  {
-	    free(extension);
-	    return pos;
-	  }
-	  else if(*pos=='\\')
-	  {
-	    pos++;
-	    if(*pos=='\0')
-	    {
-	      free(extension);
-	      return pos;
-	    }
-	    else if(*pos=='b')
-	      tmp[signature_size++]='\b';
-	    else if(*pos=='n')
-	      tmp[signature_size++]='\n';
-	    else if(*pos=='t')
-	      tmp[signature_size++]='\t';
-	    else if(*pos=='r')
-	      tmp[signature_size++]='\r';
-	    else if(*pos=='0')
-	      tmp[signature_size++]='\0';
-	    else
-	      tmp[signature_size++]=*pos;
-	    pos++;
-	  }
-	  else
-	  {
-	    tmp[signature_size++]=*pos;
-	    pos++;
-	  }
-	  if(*pos!='\'')
-	  {
-	    free(extension);
-	    return pos;
-	  }
-	  pos++;
-	}
-	else if(*pos=='"')
+	if(sig_is_keyword(pos, "footer"))
+	  pos=parse_signature_bytes(pos+6, &footer);
+	else if(sig_is_keyword(pos, "max_size"))
 	{
-	  pos++;
-	  for(; *pos!='"' && *pos!='\0'; pos++)
+	  for(pos+=8; isspace(*pos) && *pos!='\n'; pos++);
+	  pos=str_uint64(pos, &max_size);
+	  if(pos!=NULL)
 	  {
-	    if(signature_size==signature_max_size)
-	    {
-	      unsigned char *tmp_old=tmp;
-	      signature_max_size*=2;
-	      tmp=(unsigned char *)realloc(tmp, signature_max_size);
-	      if(tmp==NULL)
-	      {
-		free(extension);
-		free(tmp_old);
-		return pos;
-	      }
-	    }
-	    if(*pos=='\\')
-	    {
+	    while(*pos!='\n' && isspace(*pos))
 	      pos++;
-	      if(*pos=='\0')
-	      {
-		free(extension);
-		return pos;
-	      }
-	      else if(*pos=='b')
-		tmp[signature_size++]='\b';
-	      else if(*pos=='n')
-		tmp[signature_size++]='\n';
-	      else if(*pos=='r')
-		tmp[signature_size++]='\r';
-	      else if(*pos=='t')
-		tmp[signature_size++]='\t';
-	      else if(*pos=='0')
-		tmp[signature_size++]='\0';
-	      else
-		tmp[signature_size++]=*pos;
-	    }
-	    else
-	      tmp[signature_size++]=*pos;;
-	  }
-	  if(*pos!='"')
-	  {
-	    free(extension);
-	    return pos;
-	  }
-	  pos++;
-	}
-	else if(*pos=='0' && (*(pos+1)=='x' || *(pos+1)=='X'))
-	{
-	  pos+=2;
-	  while(isxdigit(*pos) && isxdigit(*(pos+1)))
-	  {
-	    unsigned int val=(*pos);
-	    if(*pos>='0' && *pos<='9')
-	      val-='0';
-	    else if(*pos>='A' && *pos<='F')
-	      val=val-'A'+10;
-	    else if(*pos>='a' && *pos<='f')
-	      val=val-'a'+10;
-	    pos++;
-	    val*=16;
-	    val+=(*pos);
-	    if(*pos>='0' && *pos<='9')
-	      val-='0';
-	    else if(*pos>='A' && *pos<='F')
-	      val=val-'A'+10;
-	    else if(*pos>='a' && *pos<='f')
-	      val=val-'a'+10;
-	    pos++;
-	    tmp[signature_size++]=val;
 	  }
 	}
 	else
-	{
-	  free(extension);
-	  return pos;
-	}
+	  pos=NULL;
+      }
+      if(pos==NULL || footer.wildcard!=0 || footer.size > SIG_FOOTER_MAX_SIZE ||
+	  (sig.size>0 && sig.wildcard!=0 && memchr(sig.mask, 0xff, sig.size)==NULL))
+      {
+	free(extension);
+	free(sig.data);
+	free(sig.mask);
+	free(footer.data);
+	free(footer.mask);
+	return line;
       }
       if(*pos=='\n')
 	pos++;
-      if(signature_size>0)
+      if(sig.size>0)
       {
-	/* FIXME: Small memory leak */
-	unsigned char *signature=(unsigned char *)MALLOC(signature_size);
 	log_info("register a signature for %s\n", extension);
-	memcpy(signature, tmp, signature_size);
-	register_header_check(offset, signature, signature_size, &header_check_sig, file_stat);
-	signature_insert(extension, offset, signature, signature_size);
+	if(sig.wildcard==0)
+	{
+	  free(sig.mask);
+	  sig.mask=NULL;
+	}
+	if(footer.size==0)
+	{
+	  free(footer.data);
+	  footer.data=NULL;
+	}
+	free(footer.mask);
+	signature_insert(extension, offset, sig.data, sig.mask, sig.size, footer.data, footer.size, max_size);
       }
       else
       {
 	free(extension);
+	free(sig.data);
+	free(sig.mask);
+	free(footer.data);
+	free(footer.mask);
       }
-      free(tmp);
     }
   }
   return pos;
@@ -385,6 +655,7 @@ static void register_header_check_sig(file_stat_t *file_stat)
   off_t buffer_size;
   struct stat stat_rec;
   FILE *handle;
+  signature_free();
   handle=open_signature_file();
   if(!handle)
     return;
@@ -403,12 +674,13 @@ static void register_header_check_sig(file_stat_t *file_stat)
   fclose(handle);
   buffer[buffer_size]='\0';
   pos=buffer;
-  pos=parse_signature_file(file_stat, pos);
+  pos=parse_signature_file(pos);
   if(*pos!='\0')
   {
     log_warning("Can't parse signature: %s\n", pos);
   }
   free(buffer);
+  signature_compile(file_stat);
 }
 
 
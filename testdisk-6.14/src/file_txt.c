@@ -194,65 +194,40 @@ static const txt_header_t fasttxt_headers[] = {
 
 // #define DEBUG_FILETXT
 
+#define TXT_CHAR_TEXT	1
+#define TXT_CHAR_KEYWORD	2
+
+/* TXT_CHAR_TEXT: char can be found in text file,
+ *   '\b', '\t', '\r', '\n', ' '-'~' and from cp1252
+ *   '€', 0x82-0x8d, '’', 0x93-0x98, '™', 'œ',
+ *   nonbreaking space, '¡', '¢', '£', '§', '¨', '©', '«', '®', '°', '´',
+ *   '·', '»', 'À', 'Ç', 'É', 'Ö', '×', 'Ù', 'ß', 'à', 'á', 'â', 'ã',
+ *   'ä', 'æ', 'ç', 'è', 'é', 'ê', 'ë', 'í', 'î', 'ï', 'ô', 'ö', 'ø',
+ *   'ù', 'ú', 'û', 'ü'
+ * TXT_CHAR_KEYWORD: first char of an entry of txt_keywords[] */
+static const unsigned char txt_char[256]= {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 3, 0, 0, 1, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 3, 1, 1, 1,
+  1, 1, 1, 3, 1, 1, 1, 1, 1, 3, 1, 1, 1, 1, 1, 1,
+  3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0,
+  1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0,
+  0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1, 0, 0, 0,
+  1, 1, 1, 1, 0, 0, 0, 1, 1, 1, 0, 1, 0, 0, 1, 0,
+  1, 0, 0, 0, 1, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0,
+  1, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 1, 1, 0, 1, 0, 0, 0, 0, 0, 1,
+  1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1,
+  0, 0, 0, 0, 1, 0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 0
+};
+
 /* return 1 if char can be found in text file */
-static int filtre(unsigned int car)
+static inline int filtre(unsigned int car)
 {
-  switch(car)
-  {
-    case 0x7c:  /* similar to | */
-    case 0x80:	/* '€' */
-    case 0x92:	/* '’' */
-    case 0x99:	/* '™' */
-    case 0x9c:	/* 'œ' */
-    case 0xa0:  /* nonbreaking space */
-    case 0xa1:  /* '¡' */
-    case 0xa2:	/* '¢' */
-    case 0xa3:	/* '£' */
-    case 0xa7:	/* '§' */
-    case 0xa8:	/* '¨' */
-    case 0xa9:	/* '©' */
-    case 0xab:	/* '«' */
-    case 0xae:	/* '®' */
-    case 0xb0:	/* '°' */
-    case 0xb4:  /* '´' */
-    case 0xb7:	/* '·' */
-    case 0xbb:  /* '»' */
-    case 0xc0:  /* 'À' */
-    case 0xc7:  /* 'Ç' */
-    case 0xc9:  /* 'É' */
-    case 0xd6:  /* 'Ö' */
-    case 0xd7:	/* '×' */
-    case 0xd9:  /* 'Ù' */
-    case 0xdf:	/* 'ß' */
-    case 0xe0: 	/* 'à' */
-    case 0xe1: 	/* 'á' */
-    case 0xe2: 	/* 'â' */
-    case 0xe3:  /* 'ã' */
-    case 0xe4: 	/* 'ä' */
-    case 0xe6:  /* 'æ' */
-    case 0xe7: 	/* 'ç' */
-    case 0xe8: 	/* 'è' */
-    case 0xe9: 	/* 'é' */
-    case 0xea: 	/* 'ê' */
-    case 0xeb: 	/* 'ë' */
-    case 0xed:  /* 'í' */
-    case 0xee: 	/* 'î' */
-    case 0xef: 	/* 'ï' */
-    case 0xf4: 	/* 'ô' */
-    case 0xf6: 	/* 'ö' */
-    case 0xf8:  /* 'ø' */
-    case 0xf9: 	/* 'ù' */
-    case 0xfa:  /* 'ú' */
-    case 0xfb: 	/* 'û' */
-    case 0xfc: 	/* 'ü' */
-      return 1;
-  }
-  if(car=='\b' || car=='\t' || car=='\r' || car=='\n' ||
-      (car >=  ' ' && car <=  '~') ||
-      (car >= 0x82 && car <= 0x8d) ||
-      (car >= 0x93 && car <= 0x98))
-    return 1;
-  return 0;
+  return (car < 256 && (txt_char[car] & TXT_CHAR_TEXT)!=0);
 }
 
 /* destination should have an extra byte available for null terminator
@@ -380,12 +355,39 @@ int UTF2Lat(unsigned char *buffer_lower, const unsigned char *buffer, const int
   return(p-buffer);
 }
 
+/* return 1 if the 8 bytes are all in ' '-'~' */
+static inline int txt_is_printable8(const unsigned char *p)
+{
+  uint64_t x;
+  memcpy(&x, p, sizeof(x));
+  /* no byte >= 0x80, no byte < 0x20, no 0x7f */
+  return ((x & 0x8080808080808080ULL)==0 &&
+      ((x + 0x6060606060606060ULL) & 0x8080808080808080ULL)==0x8080808080808080ULL &&
+      ((x + 0x0101010101010101ULL) & 0x8080808080808080ULL)==0);
+}
+
 static int UTFsize(const unsigned char *buffer, const unsigned int buf_len)
 {
   const unsigned char *p=buffer; 	/* pointers to actual position in source buffer */
   unsigned int i=0;
   while(i<buf_len && *p!='\0')
   {
+    /* Skip plain ascii text 8 bytes at a time */
+    while(i+8 <= buf_len && txt_is_printable8(p))
+    {
+      p+=8;
+      i+=8;
+    }
+    if(i>=buf_len)
+      return i;
+    if(*p < 0x80)
+    {
+      if((txt_char[*p] & TXT_CHAR_TEXT)==0)
+	return i;
+      p++;
+      i++;
+      continue;
+    }
     /* Reject some invalid UTF-8 sequences */
     if(*p==0xc0 || *p==0xc1 || *p==0xf7 || *p>=0xfd)
       return i;
@@ -817,10 +819,92 @@ static void file_check_emlx(file_recovery_t *file_recovery)
   }
 }
 
+enum txt_keyword
+{
+  TXT_KW_AUTORUN=0,
+  TXT_KW_PHP,
+  TXT_KW_TEX,
+  TXT_KW_INCLUDE,
+  TXT_KW_JSP_DIRECTIVE,
+  TXT_KW_JSP_EXPRESSION,
+  TXT_KW_ASP,
+  TXT_KW_HTML,
+  TXT_KW_PRIVATE_STATIC,
+  TXT_KW_PUBLIC_INTERFACE,
+  TXT_KW_CLASS,
+  TXT_KW_INTEGER,
+  TXT_KW_LY_SCORE,
+  TXT_KW_C_COMMENT,
+  TXT_KW_BR,
+  TXT_KW_P,
+  TXT_KW_FORTRAN,
+  TXT_KW_NBR
+};
+
+typedef struct
+{
+  const char *string;
+  const unsigned int len;
+} txt_keyword_t;
+
+/* The first char of each keyword must be flagged TXT_CHAR_KEYWORD in txt_char[] */
+static const txt_keyword_t txt_keywords[TXT_KW_NBR] = {
+  { "[autorun]",		 9 },
+  { "<?php",			 5 },
+  { "\\begin{",			 7 },
+  { "#include",			 8 },
+  { "<%@",			 3 },
+  { "<%=",			 3 },
+  { "<% ",			 3 },
+  { "<html",			 5 },
+  { "private static",		14 },
+  { "public interface",		16 },
+  { "class",			 5 },
+  { "integer",			 7 },
+  { "\\score {",			 8 },
+  { "/*",			 2 },
+  { "<br>",			 4 },
+  { "<p>",			 3 },
+  { "\n      ",			 7 },
+};
+
+#define TXT_KW_NOT_FOUND	0xffffffff
+
+/* Search all the keywords in a single pass over the null terminated
+ * lowercase buffer, kw_pos[] gets the offset of the first occurrence
+ * and the return value is the number of occurrences of TXT_KW_FORTRAN */
+static unsigned int txt_keywords_search(const char *buffer_lower, unsigned int *kw_pos)
+{
+  const char *src;
+  unsigned int nbrf=0;
+  unsigned int k;
+  for(k=0; k<TXT_KW_NBR; k++)
+    kw_pos[k]=TXT_KW_NOT_FOUND;
+  for(src=buffer_lower; *src!='\0'; src++)
+  {
+    if((txt_char[(unsigned char)*src] & TXT_CHAR_KEYWORD)==0)
+      continue;
+    for(k=0; k<TXT_KW_NBR; k++)
+    {
+      const txt_keyword_t *keyword=&txt_keywords[k];
+      if(keyword->string[0]==*src &&
+	  (kw_pos[k]==TXT_KW_NOT_FOUND || k==TXT_KW_FORTRAN) &&
+	  strncmp(src, keyword->string, keyword->len)==0)
+      {
+	if(kw_pos[k]==TXT_KW_NOT_FOUND)
+	  kw_pos[k]=src-buffer_lower;
+	if(k==TXT_KW_FORTRAN)
+	  nbrf++;
+      }
+    }
+  }
+  return nbrf;
+}
+
 static int header_check_txt(const unsigned char *buffer, const unsigned int buffer_size, const unsigned int safe_header_only, const file_recovery_t *file_recovery, file_recovery_t *file_recovery_new)
 {
-  static char *buffer_lower=NULL;
-  static unsigned int buffer_lower_size=0;
+  /* No static buffer, the header checks may run in several threads */
+  char buffer_lower[2048+16];
   unsigned int l;
   const unsigned int buffer_size_test=(buffer_size < 2048 ? buffer_size : 2048);
   {
@@ -962,17 +1046,6 @@ static int header_check_txt(const unsigned char *buffer, const unsigned int buff
     else
       return 0;
   }
-  if(buffer_lower_size<buffer_size_test+16)
-  {
-    free(buffer_lower);
-    buffer_lower=NULL;
-  }
-  /* Don't malloc/free memory every time, small memory leak */
-  if(buffer_lower==NULL)
-  {
-    buffer_lower_size=buffer_size_test+16;
-    buffer_lower=(char *)MALLOC(buffer_lower_size);
-  }
   l=UTF2Lat((unsigned char*)buffer_lower, buffer, buffer_size_test);
   if(l<10)
     return 0;
@@ -1002,17 +1075,11 @@ static int header_check_txt(const unsigned char *buffer, const unsigned int buff
     /* ind=~0: random
      * ind=~1: constant	*/
     double ind=1;
-    unsigned int nbrf=0;
+    unsigned int kw_pos[TXT_KW_NBR];
+    unsigned int nbrf;
     unsigned int is_csv=1;
-    /* Detect Fortran */
-    {
-      char *str=buffer_lower;
-      while((str=strstr(str, "\n      "))!=NULL)
-      {
-	nbrf++;
-	str++;
-      }
-    }
+    /* Detect keywords and Fortran */
+    nbrf=txt_keywords_search(buffer_lower, kw_pos);
     /* Detect csv */
     {
       unsigned int csv_per_line_current=0;
@@ -1052,32 +1119,32 @@ static int header_check_txt(const unsigned char *buffer, const unsigned int buff
       ind=ind/l/(l-1);
     }
     /* Windows Autorun */
-    if(strstr(buffer_lower, "[autorun]")!=NULL)
+    if(kw_pos[TXT_KW_AUTORUN]!=TXT_KW_NOT_FOUND)
       ext="inf";
     /* Detect .ini */
     else if(buffer[0]=='[' && l>50 && is_ini(buffer_lower))
       ext="ini";
     /* php (Hypertext Preprocessor) script */
-    else if(strstr(buffer_lower, "<?php")!=NULL)
+    else if(kw_pos[TXT_KW_PHP]!=TXT_KW_NOT_FOUND)
       ext="php";
     /* Comma separated values */
     else if(is_csv>0)
       ext="csv";
     /* Detect LaTeX, C, PHP, JSP, ASP, HTML, C header */
-    else if(strstr(buffer_lower, "\\begin{")!=NULL)
+    else if(kw_pos[TXT_KW_TEX]!=TXT_KW_NOT_FOUND)
       ext="tex";
-    else if(strstr(buffer_lower, "#include")!=NULL)
+    else if(kw_pos[TXT_KW_INCLUDE]!=TXT_KW_NOT_FOUND)
       ext="c";
-    else if(l>20 && strstr(buffer_lower, "<%@")!=NULL)
+    else if(l>20 && kw_pos[TXT_KW_JSP_DIRECTIVE]!=TXT_KW_NOT_FOUND)
       ext="jsp";
-    else if(l>20 && strstr(buffer_lower, "<%=")!=NULL)
+    else if(l>20 && kw_pos[TXT_KW_JSP_EXPRESSION]!=TXT_KW_NOT_FOUND)
       ext="jsp";
-    else if(l>20 && strstr(buffer_lower, "<% ")!=NULL)
+    else if(l>20 && kw_pos[TXT_KW_ASP]!=TXT_KW_NOT_FOUND)
       ext="asp";
-    else if(strstr(buffer_lower, "<html")!=NULL)
+    else if(kw_pos[TXT_KW_HTML]!=TXT_KW_NOT_FOUND)
       ext="html";
-    else if(strstr(buffer_lower, "private static")!=NULL ||
-	strstr(buffer_lower, "public interface")!=NULL)
+    else if(kw_pos[TXT_KW_PRIVATE_STATIC]!=TXT_KW_NOT_FOUND ||
+	kw_pos[TXT_KW_PUBLIC_INTERFACE]!=TXT_KW_NOT_FOUND)
     {
 #ifdef DJGPP
       ext="jav";
@@ -1085,7 +1152,7 @@ static int header_check_txt(const unsigned char *buffer, const unsigned int buff
       ext="java";
 #endif
     }
-    else if(strstr(buffer_lower, "class")!=NULL &&
+    else if(kw_pos[TXT_KW_CLASS]!=TXT_KW_NOT_FOUND &&
 	(l>=100 || file_recovery==NULL))
     {
 #ifdef DJGPP
@@ -1095,13 +1162,13 @@ static int header_check_txt(const unsigned char *buffer, const unsigned int buff
 #endif
     }
     /* Fortran */
-    else if(nbrf>10 && ind<0.9 && strstr(buffer_lower, "integer")!=NULL)
+    else if(nbrf>10 && ind<0.9 && kw_pos[TXT_KW_INTEGER]!=TXT_KW_NOT_FOUND)
       ext="f";
     /* LilyPond http://lilypond.org*/
-    else if(strstr(buffer_lower, "\\score {")!=NULL)
+    else if(kw_pos[TXT_KW_LY_SCORE]!=TXT_KW_NOT_FOUND)
       ext="ly";
     /* C header file */
-    else if(strstr(buffer_lower, "/*")!=NULL && l>50)
+    else if(kw_pos[TXT_KW_C_COMMENT]!=TXT_KW_NOT_FOUND && l>50)
       ext="h";
     else if(l<100 || ind<0.03 || ind>0.90)
       ext=NULL;
@@ -1113,7 +1180,7 @@ static int header_check_txt(const unsigned char *buffer, const unsigned int buff
     if(ext==NULL)
       return 0;
     if(strcmp(ext,"txt")==0 &&
-	(strstr(buffer_lower,"<br>")!=NULL || strstr(buffer_lower,"<p>")!=NULL))
+	(kw_pos[TXT_KW_BR]!=TXT_KW_NOT_FOUND || kw_pos[TXT_KW_P]!=TXT_KW_NOT_FOUND))
     {
       ext="html";
     }
@@ -1144,8 +1211,8 @@ static int header_check_txt(const unsigned char *buffer, const unsigned int buff
 	  file_recovery->file_stat->file_hint == &file_hint_txt)
       {
 	/* file_recovery->filename is a .html */
-	buffer_lower[511]='\0';
-	if(strstr(buffer_lower, "<html")==NULL)
+	if(kw_pos[TXT_KW_HTML]==TXT_KW_NOT_FOUND ||
+	    kw_pos[TXT_KW_HTML] + txt_keywords[TXT_KW_HTML].len > 511)
 	  return 0;
 	/* Special case: two consecutive HTML files */
       }
@@ -39,13 +39,13 @@
 #include "filegen.h"
 #include "common.h"
 #include "log.h"
+#include "memmem.h"
 
 /* #define DEBUG_ZIP */
 extern const file_hint_t file_hint_doc;
 static void register_header_check_zip(file_stat_t *file_stat);
 static int header_check_zip(const unsigned char *buffer, const unsigned int buffer_size, const unsigned int safe_header_only, const file_recovery_t *file_recovery, file_recovery_t *file_recovery_new);
 static void file_check_zip(file_recovery_t *file_recovery);
-static unsigned int pos_in_mem(const unsigned char *haystack, const unsigned int haystack_size, const unsigned char *needle, const unsigned int needle_size);
 static void file_rename_zip(const char *old_filename);
 static char first_filename[256];
 
@@ -433,9 +433,10 @@ static int zip64_parse_end_central_dir(file_recovery_t *fr)
   }
   fr->file_size += sizeof(dir);
 
-  if (dir.end_size > 0)
+  /* end_size doesn't include the leading 12 bytes of the record */
+  if (le64(dir.end_size) > sizeof(dir) - 8)
   {
-    const uint64_t len = le64(dir.end_size);
+    const uint64_t len = le64(dir.end_size) - (sizeof(dir) - 8);
     if (fseek(fr->handle, len, SEEK_CUR) == -1)
     {
 #ifdef DEBUG_ZIP
@@ -566,15 +567,168 @@ static int zip64_parse_end_central_dir_locator(file_recovery_t *fr)
   return 0;
 }
 
+/* State of data_check_zip() kept in file_recovery->data_check_tmp */
+#define ZIP_STREAM_NONE		0	/* not followed, file_check_zip() parses the file */
+#define ZIP_STREAM_RECORD	1	/* a record begins at calculated_file_size */
+#define ZIP_STREAM_DESC		2	/* compressed data begins at calculated_file_size, search its data descriptor */
+#define ZIP_STREAM_DONE		3	/* end of central dir found, calculated_file_size is the archive size */
+
+/* Follow the zip records while the archive is carved, so the recovery
+ * can stop as soon as the end of central directory or an invalid record
+ * has been reached. When the records can't be followed, file_check_zip()
+ * parses the recovered file as before. */
+static int data_check_zip(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery)
+{
+  if(file_recovery->file_size==0)
+  {
+    file_recovery->calculated_file_size=0;
+    file_recovery->data_check_tmp=ZIP_STREAM_RECORD;
+  }
+  while(1)
+  {
+    unsigned int i;
+    if(file_recovery->data_check_tmp==ZIP_STREAM_NONE)
+      return 1;
+    if(file_recovery->data_check_tmp==ZIP_STREAM_DONE)
+      return (file_recovery->calculated_file_size <= file_recovery->file_size + buffer_size/2 ? 2 : 1);
+    if(file_recovery->data_check_tmp==ZIP_STREAM_DESC)
+    {
+      static const unsigned char zip_data_desc_header[4]= {0x50, 0x4B, 0x07, 0x08};
+      const unsigned char *desc;
+      uint64_t pos;
+      /* A data descriptor (16 bytes) may have been partially seen in the previous buffer */
+      i=buffer_size/2 - 15;
+      if(file_recovery->calculated_file_size >= file_recovery->file_size + buffer_size/2)
+	return 1;
+      if(file_recovery->calculated_file_size + buffer_size/2 > file_recovery->file_size + i)
+	i=file_recovery->calculated_file_size + buffer_size/2 - file_recovery->file_size;
+      desc=(const unsigned char *)td_memmem(&buffer[i], buffer_size - i, zip_data_desc_header, 4);
+      if(desc==NULL)
+	return 1;
+      i=desc - buffer;
+      if(i + 16 > buffer_size)
+	return 1;
+      pos=file_recovery->file_size + i - buffer_size/2;
+      if(le32(*(const uint32_t *)&buffer[i+8]) != (uint32_t)(pos - file_recovery->calculated_file_size))
+      {
+	/* Invalid archive, file_check_zip() will set offset_error */
+	file_recovery->data_check_tmp=ZIP_STREAM_NONE;
+	return 2;
+      }
+      file_recovery->calculated_file_size=pos + 16;
+      file_recovery->data_check_tmp=ZIP_STREAM_RECORD;
+      continue;
+    }
+    /* ZIP_STREAM_RECORD */
+    if(file_recovery->calculated_file_size + buffer_size/2 < file_recovery->file_size)
+    {
+      file_recovery->data_check_tmp=ZIP_STREAM_NONE;
+      return 1;
+    }
+    if(file_recovery->calculated_file_size + 4 > file_recovery->file_size + buffer_size/2)
+      return 1;
+    i=file_recovery->calculated_file_size + buffer_size/2 - file_recovery->file_size;
+    switch(le32(*(const uint32_t *)&buffer[i]))
+    {
+      case ZIP_FILE_ENTRY:
+	{
+	  const zip_file_entry_t *file=(const zip_file_entry_t *)&buffer[i+4];
+	  unsigned int header_size;
+	  uint64_t len;
+	  if(i + 4 + sizeof(zip_file_entry_t) > buffer_size)
+	    return 1;
+	  header_size=4 + sizeof(zip_file_entry_t) + le16(file->filename_length);
+	  len=le32(file->compressed_size);
+	  if(len==0xffffffff && le16(file->extra_length) > 0 &&
+	      header_size + sizeof(zip64_extra_entry_t) > buffer_size/2)
+	  {
+	    file_recovery->data_check_tmp=ZIP_STREAM_NONE;
+	    return 1;
+	  }
+	  if(len==0xffffffff && le16(file->extra_length) > 0)
+	  {
+	    const zip64_extra_entry_t *extra;
+	    if(i + header_size + sizeof(zip64_extra_entry_t) > buffer_size)
+	      return 1;
+	    extra=(const zip64_extra_entry_t *)&buffer[i + header_size];
+	    if(le16(extra->tag)==1)
+	      len=le64(extra->compressed_size);
+	  }
+	  {
+	    const time_t tmp=date_dos2unix(le16(file->last_mod_time), le16(file->last_mod_date));
+	    if(file_recovery->time < tmp)
+	      file_recovery->time=tmp;
+	  }
+	  file_recovery->calculated_file_size+=header_size + le16(file->extra_length) + len;
+	  if(file->has_descriptor && (le16(file->compression)==8 || le16(file->compression)==9))
+	    file_recovery->data_check_tmp=ZIP_STREAM_DESC;
+	}
+	break;
+      case ZIP_CENTRAL_DIR:
+	if(i + 46 > buffer_size)
+	  return 1;
+	file_recovery->calculated_file_size+=46 +
+	  le16(*(const uint16_t *)&buffer[i+28]) +	/* filename length */
+	  le16(*(const uint16_t *)&buffer[i+30]) +	/* extra field length */
+	  le16(*(const uint16_t *)&buffer[i+32]);	/* comment length */
+	break;
+      case ZIP_CENTRAL_DIR64:
+	if(i + 12 > buffer_size)
+	  return 1;
+	file_recovery->calculated_file_size+=12 + le64(*(const uint64_t *)&buffer[i+4]);
+	break;
+      case ZIP_END_CENTRAL_DIR64:
+	file_recovery->calculated_file_size+=20;
+	break;
+      case ZIP_SIGNATURE:
+	if(i + 6 > buffer_size)
+	  return 1;
+	file_recovery->calculated_file_size+=6 + le16(*(const uint16_t *)&buffer[i+4]);
+	break;
+      case ZIP_END_CENTRAL_DIR:
+	if(i + 22 > buffer_size)
+	  return 1;
+	file_recovery->calculated_file_size+=22 + le16(*(const uint16_t *)&buffer[i+20]);
+	file_recovery->data_check_tmp=ZIP_STREAM_DONE;
+	break;
+      case ZIP_DATA_DESCRIPTOR:
+	/* Not preceded by a compressed entry, let file_check_zip() handle it */
+	file_recovery->data_check_tmp=ZIP_STREAM_NONE;
+	return 1;
+      default:
+	/* Invalid archive, file_check_zip() will set offset_error */
+	file_recovery->data_check_tmp=ZIP_STREAM_NONE;
+	return 2;
+    }
+  }
+}
+
 static void file_check_zip(file_recovery_t *fr)
 {
   const char *ext=NULL;
   unsigned int file_nbr=0;
+  if(fr->data_check_tmp==ZIP_STREAM_DONE &&
+      fr->calculated_file_size > 0 &&
+      fr->file_size >= fr->calculated_file_size)
+  {
+    /* data_check_zip() has already followed the whole archive,
+     * brute force resets calculated_file_size to check the file again */
+    fr->file_size=fr->calculated_file_size;
+    fr->offset_error=0;
+    return ;
+  }
   fr->file_size = 0;
   fr->offset_error=0;
   fr->offset_ok=0;
   first_filename[0]='\0';
-  if(fseek(fr->handle, 0, SEEK_SET) < 0)
+  if(fr->checkpoint_status==1 && fr->checkpoint_resume > 0)
+  {
+    /* The records before the checkpoint have already been checked */
+    fr->file_size=fr->checkpoint_resume;
+    fr->offset_ok=fr->checkpoint_resume;
+    file_nbr=fr->checkpoint_tmp;
+  }
+  if(fseek(fr->handle, fr->file_size, SEEK_SET) < 0)
     return ;
   while (1)
   {
@@ -618,6 +772,14 @@ static void file_check_zip(file_recovery_t *fr)
         status = zip_parse_data_desc(fr);
         break;
       case ZIP_FILE_ENTRY: /* File Entry */
+	if(fr->checkpoint_status==0 && fr->checkpoint_offset > 0 &&
+	    file_size_old - 4 <= fr->checkpoint_offset)
+	{
+	  /* The data before checkpoint_offset won't change, parsing can
+	   * resume at this entry */
+	  fr->checkpoint_resume=file_size_old - 4;
+	  fr->checkpoint_tmp=file_nbr;
+	}
         status = zip_parse_file_entry(fr, &ext, file_nbr);
 	file_nbr++;
         break;
@@ -635,6 +797,8 @@ static void file_check_zip(file_recovery_t *fr)
         break;
     }
 
+    if(fr->checkpoint_offset > 0 && fr->checkpoint_resume > 0)
+      fr->checkpoint_status=1;
     /* Verify status */
     if (status<0)
     {
@@ -779,6 +943,7 @@ static int header_check_zip(const unsigned char *buffer, const unsigned int buff
       return 0;
     reset_file_recovery(file_recovery_new);
     file_recovery_new->min_filesize=21;
+    file_recovery_new->data_check=&data_check_zip;
     file_recovery_new->file_check=&file_check_zip;
     if(len==8 && memcmp(&buffer[30],"mimetype",8)==0)
     {
@@ -806,11 +971,11 @@ static int header_check_zip(const unsigned char *buffer, const unsigned int buff
     }
     else if(len==19 && memcmp(&buffer[30],"[Content_Types].xml",19)==0)
     {
-      if(pos_in_mem(&buffer[0], buffer_size, (const unsigned char*)"word/", 5)!=0)
+      if(td_memmem(buffer, buffer_size, "word/", 5)!=NULL)
 	file_recovery_new->extension="docx";
-      else if(pos_in_mem(&buffer[0], 2000, (const unsigned char*)"xl/", 3)!=0)
+      else if(td_memmem(buffer, 2000, "xl/", 3)!=NULL)
 	file_recovery_new->extension="xlsx";
-      else if(pos_in_mem(&buffer[0], buffer_size, (const unsigned char*)"ppt/", 4)!=0)
+      else if(td_memmem(buffer, buffer_size, "ppt/", 4)!=NULL)
 	file_recovery_new->extension="pptx";
       else
 	file_recovery_new->extension="docx";
@@ -838,12 +1003,3 @@ static int header_check_zip(const unsigned char *buffer, const unsigned int buff
   return 0;
 }
 
-static unsigned int pos_in_mem(const unsigned char *haystack, const unsigned int haystack_size, const unsigned char *needle, const unsigned int needle_size)
-{
-  unsigned int i;
-  for(i=0;i<haystack_size;i++)
-    if(memcmp(&haystack[i],needle,needle_size)==0)
-      return (i+needle_size);
-  return 0;
-}
-
@@ -188,37 +188,85 @@ void file_allow_nl(file_recovery_t *file_recovery, const unsigned int nl_mode)
     file_recovery->file_size++;
 }
 
-uint64_t file_rsearch(FILE *handle, uint64_t offset, const void*footer, const unsigned int footer_length)
+#define FILE_RSEARCH_MIN_READ	4096
+#define FILE_RSEARCH_MAX_READ	(1024*1024)
+
+/* Return the last occurrence of c in buffer[0..n-1], 8 bytes at a time */
+static const unsigned char *file_memrchr(const unsigned char *buffer, const unsigned char c, unsigned int n)
 {
-  unsigned char*buffer;
-  buffer=(unsigned char*)MALLOC(4096+footer_length-1);
-  memset(buffer+4096,0,footer_length-1);
-  do
+  const uint64_t ones=0x0101010101010101ULL;
+  const uint64_t pattern=ones * c;
+  while(n >= 8)
   {
-    int i;
-    int taille;
-    const unsigned int read_size=(offset%4096!=0 ? offset%4096 : 4096);
-    offset-=read_size;
-    if(fseek(handle,offset,SEEK_SET)<0)
-    {
-      free(buffer);
-      return 0;
-    }
-    taille=fread(buffer, 1, read_size, handle);
-    for(i=taille-1;i>=0;i--)
+    uint64_t x;
+    memcpy(&x, &buffer[n-8], sizeof(x));
+    x^=pattern;
+    /* Does one of the 8 bytes equal c ? */
+    if(((x - ones) & ~x & 0x8080808080808080ULL)!=0)
+      break;
+    n-=8;
+  }
+  while(n>0)
+  {
+    n--;
+    if(buffer[n]==c)
+      return &buffer[n];
+  }
+  return NULL;
+}
+
+/* Search the last footer fully contained in [0, offset[.
+ * Start with a small read as footers are often near the end of the file,
+ * then double the read size up to FILE_RSEARCH_MAX_READ.
+ * return 1 and set *pos if found */
+static int file_rsearch_aux(FILE *handle, uint64_t offset, const unsigned char *footer, const unsigned int footer_length, uint64_t *pos)
+{
+  unsigned char *buffer;
+  unsigned int read_size=FILE_RSEARCH_MIN_READ;
+  const unsigned int buffer_size=(offset < FILE_RSEARCH_MAX_READ ? offset : FILE_RSEARCH_MAX_READ);
+  if(footer_length==0 || footer_length > FILE_RSEARCH_MIN_READ || offset < footer_length)
+    return 0;
+  buffer=(unsigned char*)MALLOC(buffer_size);
+  while(1)
+  {
+    const uint64_t start=(offset > read_size ? offset - read_size : 0);
+    unsigned int taille;
+    unsigned int n;
+    const unsigned char *res;
+    if(fseek(handle, start, SEEK_SET)<0)
+      break;
+    taille=fread(buffer, 1, offset - start, handle);
+    /* Candidates must leave room for the whole footer */
+    n=(taille >= footer_length ? taille - footer_length + 1 : 0);
+    while((res=file_memrchr(buffer, footer[0], n))!=NULL)
     {
-      if(buffer[i]==*(const unsigned char *)footer && memcmp(buffer+i,footer,footer_length)==0)
+      if(memcmp(res, footer, footer_length)==0)
       {
-        free(buffer);
-        return offset + i;
+	*pos=start + (res - buffer);
+	free(buffer);
+	return 1;
       }
+      n=res - buffer;
     }
-    memcpy(buffer+read_size,buffer,footer_length-1);
-  } while(offset>0);
+    if(start==0)
+      break;
+    /* Read again the first footer_length-1 bytes, a footer may overlap both reads */
+    offset=start + footer_length - 1;
+    if(read_size < FILE_RSEARCH_MAX_READ)
+      read_size*=2;
+  }
   free(buffer);
   return 0;
 }
 
+uint64_t file_rsearch(FILE *handle, uint64_t offset, const void*footer, const unsigned int footer_length)
+{
+  uint64_t pos;
+  if(file_rsearch_aux(handle, offset, (const unsigned char *)footer, footer_length, &pos)==0)
+    return 0;
+  return pos;
+}
+
 void file_search_footer(file_recovery_t *file_recovery, const void*footer, const unsigned int footer_length, const unsigned int extra_length)
 {
   if(footer_length==0 || file_recovery->file_size <= extra_length)
@@ -228,49 +276,6 @@ void file_search_footer(file_recovery_t *file_recovery, const void*footer, const
     file_recovery->file_size+= footer_length + extra_length;
 }
 
-#if 0
-void file_search_lc_footer(file_recovery_t *file_recovery, const unsigned char*footer, const unsigned int footer_length)
-{
-  const unsigned int read_size=4096;
-  unsigned char*buffer;
-  int64_t file_size;
-  if(footer_length==0)
-    return ;
-  buffer=(unsigned char*)MALLOC(read_size+footer_length-1);
-  file_size=file_recovery->file_size;
-  memset(buffer+read_size,0,footer_length-1);
-  do
-  {
-    int i;
-    int taille;
-    if(file_size%read_size!=0)
-      file_size=file_size-(file_size%read_size);
-    else
-      file_size-=read_size;
-    if(fseek(file_recovery->handle,file_size,SEEK_SET)<0)
-    {
-      free(buffer);
-      return;
-    }
-    taille=fread(buffer,1,read_size,file_recovery->handle);
-    for(i=0;i<taille;i++)
-      buffer[i]=tolower(buffer[i]);
-    for(i=taille-1;i>=0;i--)
-    {
-      if(buffer[i]==footer[0] && memcmp(buffer+i,footer,footer_length)==0)
-      {
-        file_recovery->file_size=file_size+i+footer_length;
-        free(buffer);
-        return;
-      }
-    }
-    memcpy(buffer+read_size,buffer,footer_length-1);
-  } while(file_size>0);
-  file_recovery->file_size=0;
-  free(buffer);
-}
-#endif
-
 int data_check_size(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery)
 {
   if(file_recovery->file_size>=file_recovery->calculated_file_size)
@@ -318,9 +323,14 @@ void reset_file_recovery(file_recovery_t *file_recovery)
   file_recovery->offset_ok=0;
   file_recovery->checkpoint_status=0;
   file_recovery->checkpoint_offset=0;
+  file_recovery->checkpoint_resume=0;
+  file_recovery->checkpoint_tmp=0;
 //  file_recovery->blocksize=512;
   file_recovery->flags=0;
   file_recovery->extra=0;
+  file_recovery->data_check_tmp=0;
+  file_recovery->data_check_tmp2=0;
+  file_recovery->data_check_crc=0;
 }
 
 file_stat_t * init_file_stats(file_enable_t *files_enable)
@@ -85,8 +85,13 @@ struct file_recovery_struct
   void (*file_rename)(const char *old_filename);
   uint64_t checkpoint_offset;
   int checkpoint_status;	/* 0=suspend at offset_checkpoint if offset_checkpoint>0, 1=resume at offset_checkpoint */
+  uint64_t checkpoint_resume;	/* file_check: data before this offset is valid, parsing can resume there */
+  unsigned int checkpoint_tmp;	/* file_check: state of the parser at checkpoint_resume */
   unsigned int blocksize;
   unsigned int flags;
+  unsigned int data_check_tmp;	/* state kept by data_check between two blocks */
+  unsigned int data_check_tmp2;	/* second state value kept by data_check */
+  uint32_t data_check_crc;	/* running CRC kept by data_check between two blocks */
 };
 
 struct file_hint_struct
@@ -128,7 +133,6 @@ void free_header_check(void);
 void file_allow_nl(file_recovery_t *file_recovery, const unsigned int nl_mode);
 uint64_t file_rsearch(FILE *handle, uint64_t offset, const void*footer, const unsigned int footer_length);
 void file_search_footer(file_recovery_t *file_recovery, const void*footer, const unsigned int footer_length, const unsigned int extra_length);
-void file_search_lc_footer(file_recovery_t *file_recovery, const unsigned char*footer, const unsigned int footer_length);
 void del_search_space(alloc_data_t *list_search_space, const uint64_t start, const uint64_t end);
 int data_check_size(const unsigned char *buffer, const unsigned int buffer_size, file_recovery_t *file_recovery);
 void file_check_size_lax(file_recovery_t *file_recovery);
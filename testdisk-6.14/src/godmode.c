@@ -27,9 +27,13 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
 #include "types.h"
 #include "common.h"
 #include "fnctdsk.h"
+#include "hdcache.h"
 #include "analyse.h"
 #include "lang.h"
 #include "godmode.h"
@@ -47,10 +51,22 @@
 #include "tntfs.h"
 #include "thfs.h"
 #include "partmacn.h"
+#include "savehdr.h"
 
 #define RO 1
 #define RW 0
-#define MAX_SEARCH_LOCATION 1024
+/* Size of the reads done by a deeper search */
+#define SEARCH_PART_WINDOW (4*1024*1024)
+/* Seconds between two checkpoints of a deeper search */
+#define SEARCH_CHECKPOINT_INTERVAL 300
+
+/* Locations to check whatever the search mode, kept in a min-heap */
+typedef struct
+{
+  uint64_t *offsets;
+  unsigned int nbr;
+  unsigned int max;
+} search_hints_t;
 extern const arch_fnct_t arch_gpt;
 extern const arch_fnct_t arch_humax;
 extern const arch_fnct_t arch_i386;
@@ -70,7 +86,7 @@ static void ask_mbr_order_i386(disk_t *disk_car,list_part_t *list_part);
 #define INTER_BAD_PART	10
 #endif
 static list_part_t *add_ext_part_i386(disk_t *disk_car, list_part_t *list_part, const int max_ext, const int verbose);
-static void hint_insert(uint64_t *tab, const uint64_t offset, unsigned int *tab_nbr);
+static void hint_insert(search_hints_t *hints, const uint64_t offset);
 /* Optimization */
 static inline uint64_t CHS2offset_inline(const disk_t *disk_car,const CHS_t*CHS);
 static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_org, const int verbose, const int dump_ind, const int fast_mode, char **current_cmd);
@@ -361,48 +377,92 @@ static void warning_geometry_ncurses(disk_t *disk_car, const unsigned int recomm
 }
 #endif
 
-static void hint_insert(uint64_t *tab, const uint64_t offset, unsigned int *tab_nbr)
+static void hint_insert(search_hints_t *hints, const uint64_t offset)
+{
+  unsigned int i;
+  if(hints->nbr==hints->max)
+  {
+    hints->max=(hints->max==0 ? 256 : hints->max*2);
+    hints->offsets=(uint64_t *)realloc(hints->offsets, hints->max * sizeof(uint64_t));
+    if(hints->offsets==NULL)
+    {
+      log_critical("godmode.c: memory allocation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  /* Sift up */
+  for(i=hints->nbr++; i>0 && hints->offsets[(i-1)/2] > offset; i=(i-1)/2)
+    hints->offsets[i]=hints->offsets[(i-1)/2];
+  hints->offsets[i]=offset;
+}
+
+/* Returns the lowest hint or (uint64_t)-1 if there is none */
+static uint64_t hint_next(const search_hints_t *hints)
+{
+  return (hints->nbr>0 ? hints->offsets[0] : (uint64_t)-1);
+}
+
+static void hint_pop(search_hints_t *hints)
 {
-  if(*tab_nbr<MAX_SEARCH_LOCATION-1)
+  const uint64_t offset=hints->offsets[--hints->nbr];
+  unsigned int i=0;
+  /* Sift down */
+  while(1)
   {
-    unsigned int i,j;
-    for(i=0;i<*tab_nbr && tab[i]<offset;i++);
-    if(i<*tab_nbr && tab[i]==offset)
-      return;
-    (*tab_nbr)++;
-    for(j=*tab_nbr;j>i;j--)
-      tab[j]=tab[j-1];
-    tab[i]=offset;
+    unsigned int child=2*i+1;
+    if(child >= hints->nbr)
+      break;
+    if(child+1 < hints->nbr && hints->offsets[child+1] < hints->offsets[child])
+      child++;
+    if(offset <= hints->offsets[child])
+      break;
+    hints->offsets[i]=hints->offsets[child];
+    i=child;
   }
+  hints->offsets[i]=offset;
 }
 
-static void search_add_hints(const disk_t *disk, uint64_t *try_offset, unsigned int *try_offset_nbr)
+/* Remove the hints up to location, duplicates included,
+ * returns 1 if location itself was hinted */
+static int hint_reached(search_hints_t *hints, const uint64_t location)
+{
+  int found=0;
+  while(hints->nbr>0 && hints->offsets[0]<=location)
+  {
+    if(hints->offsets[0]==location)
+      found=1;
+    hint_pop(hints);
+  }
+  return found;
+}
+
+static void search_add_hints(const disk_t *disk, search_hints_t *try_offset)
 {
   if(disk->arch==&arch_i386)
   {
     /* sometimes users choose Intel instead of GPT */
-    hint_insert(try_offset, 2*disk->sector_size+16384, try_offset_nbr);
+    hint_insert(try_offset, 2*disk->sector_size+16384);
     /* sometimes users don't choose Vista by mistake */
-    hint_insert(try_offset, 2048*512, try_offset_nbr);
+    hint_insert(try_offset, 2048*512);
     /* try to deal with incorrect geometry */
     /* 0/1/1 */
-    hint_insert(try_offset, 32 * disk->sector_size, try_offset_nbr);
-    hint_insert(try_offset, 63 * disk->sector_size, try_offset_nbr);
+    hint_insert(try_offset, 32 * disk->sector_size);
+    hint_insert(try_offset, 63 * disk->sector_size);
     /* 1/[01]/1 CHS x  16 63 */
-    hint_insert(try_offset, 16 * 63 * disk->sector_size, try_offset_nbr);
-    hint_insert(try_offset, 17 * 63 * disk->sector_size, try_offset_nbr);
-    hint_insert(try_offset, 16 * disk->geom.sectors_per_head * disk->sector_size, try_offset_nbr);
-    hint_insert(try_offset, 17 * disk->geom.sectors_per_head * disk->sector_size, try_offset_nbr);
+    hint_insert(try_offset, 16 * 63 * disk->sector_size);
+    hint_insert(try_offset, 17 * 63 * disk->sector_size);
+    hint_insert(try_offset, 16 * disk->geom.sectors_per_head * disk->sector_size);
+    hint_insert(try_offset, 17 * disk->geom.sectors_per_head * disk->sector_size);
     /* 1/[01]/1 CHS x 240 63 */
-    hint_insert(try_offset, 240 * 63 * disk->sector_size, try_offset_nbr);
-    hint_insert(try_offset, 241 * 63 * disk->sector_size, try_offset_nbr);
-    hint_insert(try_offset, 240 * disk->geom.sectors_per_head * disk->sector_size, try_offset_nbr);
-    hint_insert(try_offset, 241 * disk->geom.sectors_per_head * disk->sector_size, try_offset_nbr);
+    hint_insert(try_offset, 240 * 63 * disk->sector_size);
+    hint_insert(try_offset, 241 * 63 * disk->sector_size);
+    hint_insert(try_offset, 240 * disk->geom.sectors_per_head * disk->sector_size);
+    hint_insert(try_offset, 241 * disk->geom.sectors_per_head * disk->sector_size);
     /* 1/[01]/1 CHS x 255 63 */
-    hint_insert(try_offset, 255 * 63 * disk->sector_size, try_offset_nbr);
-    hint_insert(try_offset, 256 * 63 * disk->sector_size, try_offset_nbr);
-    hint_insert(try_offset, 255 * disk->geom.sectors_per_head * disk->sector_size, try_offset_nbr);
-    hint_insert(try_offset, 256 * disk->geom.sectors_per_head * disk->sector_size, try_offset_nbr);
+    hint_insert(try_offset, 255 * 63 * disk->sector_size);
+    hint_insert(try_offset, 256 * 63 * disk->sector_size);
+    hint_insert(try_offset, 255 * disk->geom.sectors_per_head * disk->sector_size);
+    hint_insert(try_offset, 256 * disk->geom.sectors_per_head * disk->sector_size);
     /* Hints for NTFS backup */
     if(disk->geom.cylinders>1)
     {
@@ -410,19 +470,19 @@ static void search_add_hints(const disk_t *disk, uint64_t *try_offset, unsigned
       start.cylinder=disk->geom.cylinders-1;
       start.head=disk->geom.heads_per_cylinder-1;
       start.sector=disk->geom.sectors_per_head;
-      hint_insert(try_offset, CHS2offset_inline(disk, &start), try_offset_nbr);
+      hint_insert(try_offset, CHS2offset_inline(disk, &start));
       if(disk->geom.cylinders>2)
       {
 	start.cylinder--;
-	hint_insert(try_offset, CHS2offset_inline(disk, &start), try_offset_nbr);
+	hint_insert(try_offset, CHS2offset_inline(disk, &start));
       }
     }
-    hint_insert(try_offset, (disk->disk_size-512)/(2048*512)*(2048*512)+(2048-1)*512, try_offset_nbr);
+    hint_insert(try_offset, (disk->disk_size-512)/(2048*512)*(2048*512)+(2048-1)*512);
   }
   else if(disk->arch==&arch_mac)
   {
     /* sometime users choose Mac instead of GPT for i386 Mac */
-    hint_insert(try_offset, 2*disk->sector_size+16384, try_offset_nbr);
+    hint_insert(try_offset, 2*disk->sector_size+16384);
   }
 }
 
@@ -513,17 +573,63 @@ static void search_NTFS_from_backup(disk_t *disk_car, list_part_t *list_part, co
 }
 
 typedef enum { INDSTOP_CONTINUE=0, INDSTOP_STOP=1, INDSTOP_SKIP=2, INDSTOP_QUIT=3 } indstop_t;
+
+static void search_part_checkpoint(disk_t *disk_car, list_part_t *list_part, const int fast_mode, const uint64_t search_location, const search_hints_t *try_offset, const search_hints_t *try_offset_raid)
+{
+  search_checkpoint_t checkpoint;
+  checkpoint.fast_mode=fast_mode;
+  checkpoint.search_location=search_location;
+  checkpoint.try_offset=try_offset->offsets;
+  checkpoint.try_offset_nbr=try_offset->nbr;
+  checkpoint.try_offset_raid=try_offset_raid->offsets;
+  checkpoint.try_offset_raid_nbr=try_offset_raid->nbr;
+  checkpoint.list_part=list_part;
+  search_checkpoint_save(disk_car, &checkpoint);
+}
+
+#ifdef HAVE_NCURSES
+/* Continue a deeper search from the last checkpoint if the user wants to,
+ * returns the list of the partitions already found */
+static list_part_t *search_part_resume(disk_t *disk_car, const int verbose, const int fast_mode, uint64_t *search_location, search_hints_t *try_offset, search_hints_t *try_offset_raid)
+{
+  search_checkpoint_t *checkpoint=search_checkpoint_load(disk_car, fast_mode, verbose);
+  list_part_t *list_part=NULL;
+  if(checkpoint==NULL)
+    return NULL;
+  if(ask_confirmation("Continue the previous search from sector %llu ? (Y/N)",
+	(long long unsigned)(checkpoint->search_location/disk_car->sector_size))!=0)
+  {
+    unsigned int i;
+    list_part_t *element;
+    log_info("Resume the search from sector %llu\n",
+	(long long unsigned)(checkpoint->search_location/disk_car->sector_size));
+    *search_location=checkpoint->search_location;
+    for(i=0; i<checkpoint->try_offset_nbr; i++)
+      hint_insert(try_offset, checkpoint->try_offset[i]);
+    for(i=0; i<checkpoint->try_offset_raid_nbr; i++)
+      hint_insert(try_offset_raid, checkpoint->try_offset_raid[i]);
+    for(element=checkpoint->list_part;element!=NULL;element=element->next)
+    {
+      /* Check partition and load partition name */
+      disk_car->arch->check_part(disk_car,verbose,element->part,0);
+      log_partition(disk_car,element->part);
+    }
+    list_part=checkpoint->list_part;
+    checkpoint->list_part=NULL;
+  }
+  search_checkpoint_free(checkpoint);
+  return list_part;
+}
+#endif
+
 static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_org, const int verbose, const int dump_ind, const int fast_mode, char **current_cmd)
 {
   unsigned char *buffer_disk;
   unsigned char *buffer_disk0;
-  /* TODO use circular buffer for try_offset and try_offset_raid */
-  uint64_t try_offset[MAX_SEARCH_LOCATION];
-  uint64_t try_offset_raid[MAX_SEARCH_LOCATION];
+  search_hints_t try_offset={ NULL, 0, 0 };
+  search_hints_t try_offset_raid={ NULL, 0, 0 };
   const uint64_t min_location=get_min_location(disk_car);
   uint64_t search_location;
-  unsigned int try_offset_nbr=0;
-  unsigned int try_offset_raid_nbr=0;
 #ifdef HAVE_NCURSES
   unsigned int old_cylinder=0;
 #endif
@@ -532,12 +638,20 @@ static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_o
   list_part_t *list_part=NULL;
   list_part_t *list_part_bad=NULL;
   partition_t *partition;
+  unsigned int readahead_org=0;
+  time_t next_checkpoint=0;
   /* It's not a problem to read a little bit more than necessary */
   const uint64_t search_location_max=td_max((disk_car->disk_size /
       ((uint64_t) disk_car->geom.heads_per_cylinder * disk_car->geom.sectors_per_head * disk_car->sector_size) + 1 ) *
       ((uint64_t) disk_car->geom.heads_per_cylinder * disk_car->geom.sectors_per_head * disk_car->sector_size),
       disk_car->disk_real_size);
   partition=partition_new(disk_car->arch);
+  if(fast_mode>0)
+  {
+    /* Deeper search: most of the disk is read, read it by large windows,
+     * the probes are then done from memory */
+    readahead_org=diskcache_set_readahead(disk_car, SEARCH_PART_WINDOW);
+  }
   buffer_disk=(unsigned char*)MALLOC(16*DEFAULT_SECTOR_SIZE);
   buffer_disk0=(unsigned char*)MALLOC(16*DEFAULT_SECTOR_SIZE);
   {
@@ -545,7 +659,7 @@ static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_o
     const list_part_t *element;
     for(element=list_part_org;element!=NULL;element=element->next)
     {
-      hint_insert(try_offset, element->part->part_offset, &try_offset_nbr);
+      hint_insert(&try_offset, element->part->part_offset);
     }
   }
 
@@ -559,7 +673,15 @@ static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_o
   log_info("\nsearch_part()\n");
   log_info("%s\n",disk_car->description(disk_car));
   search_location=min_location;
-  search_add_hints(disk_car, try_offset, &try_offset_nbr);
+  search_add_hints(disk_car, &try_offset);
+  if(fast_mode>0)
+  {
+#ifdef HAVE_NCURSES
+    if(*current_cmd==NULL)
+      list_part=search_part_resume(disk_car, verbose, fast_mode, &search_location, &try_offset, &try_offset_raid);
+#endif
+    next_checkpoint=time(NULL)+SEARCH_CHECKPOINT_INTERVAL;
+  }
   /* Not every sector will be examined */
   search_location_init(disk_car, location_boundary, fast_mode);
   /* Scan the disk */
@@ -582,6 +704,9 @@ static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_o
       {
 	case 1:
 	  ind_stop=INDSTOP_STOP;
+	  /* The search may be continued later from here */
+	  if(fast_mode>0)
+	    search_part_checkpoint(disk_car, list_part, fast_mode, search_location, &try_offset, &try_offset_raid);
 	  break;
 	case 2:
 	  ind_stop=INDSTOP_SKIP;
@@ -589,20 +714,16 @@ static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_o
       }
     }
 #endif
+    if(fast_mode>0 && ind_stop==INDSTOP_CONTINUE && time(NULL)>=next_checkpoint)
+    {
+      search_part_checkpoint(disk_car, list_part, fast_mode, search_location, &try_offset, &try_offset_raid);
+      next_checkpoint=time(NULL)+SEARCH_CHECKPOINT_INTERVAL;
+    }
     {
       unsigned int sector_inc=0;
       int test_nbr=0;
-      int search_now=0;
-      int search_now_raid=0;
-      while(try_offset_nbr>0 && try_offset[0]<=search_location)
-      {
-        unsigned int j;
-        if(try_offset[0]==search_location)
-          search_now=1;
-        for(j=0;j<try_offset_nbr-1;j++)
-          try_offset[j]=try_offset[j+1];
-        try_offset_nbr--;
-      }
+      int search_now=hint_reached(&try_offset, search_location);
+      int search_now_raid;
       /* PC x/0/1 x/1/1 x/2/1 */
       /* PC Vista 2048 sectors unit */
       if(disk_car->arch==&arch_i386)
@@ -611,15 +732,7 @@ static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_o
           search_location%(2048*512)==0;
       else
         search_now|= (search_location%location_boundary==0);
-      while(try_offset_raid_nbr>0 && try_offset_raid[0]<=search_location)
-      {
-        unsigned int j;
-        if(try_offset_raid[0]==search_location)
-          search_now_raid=1;
-        for(j=0;j<try_offset_raid_nbr-1;j++)
-          try_offset_raid[j]=try_offset_raid[j+1];
-        try_offset_raid_nbr--;
-      }
+      search_now_raid=hint_reached(&try_offset_raid, search_location);
       do
       {
         int res=0;
@@ -825,7 +938,7 @@ static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_o
                 for(help_factor=0; help_factor<=MD_MAX_CHUNK_SIZE/MD_RESERVED_BYTES+3; help_factor++)
                 {
                   const uint64_t offset=(uint64_t)MD_NEW_SIZE_SECTORS((partition->part_size/disk_factor+help_factor*MD_RESERVED_BYTES-1)/MD_RESERVED_BYTES*MD_RESERVED_BYTES/512)*512;
-                  hint_insert(try_offset_raid, partition->part_offset+offset, &try_offset_raid_nbr);
+                  hint_insert(&try_offset_raid, partition->part_offset+offset);
                 }
               }
               /* TODO: Detect Linux md 1.0 software raid */
@@ -844,12 +957,12 @@ static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_o
               {
                 const uint64_t next_part_offset=partition->part_offset+partition->part_size-1+1;
                 const uint64_t head_size=disk_car->geom.sectors_per_head * disk_car->sector_size;
-                hint_insert(try_offset, next_part_offset, &try_offset_nbr);
-                hint_insert(try_offset, next_part_offset+head_size, &try_offset_nbr);
+                hint_insert(&try_offset, next_part_offset);
+                hint_insert(&try_offset, next_part_offset+head_size);
                 if(next_part_offset%head_size!=0)
                 {
-                  hint_insert(try_offset, (next_part_offset+head_size-1)/head_size*head_size, &try_offset_nbr);
-                  hint_insert(try_offset, (next_part_offset+head_size-1)/head_size*head_size+head_size, &try_offset_nbr);
+                  hint_insert(&try_offset, (next_part_offset+head_size-1)/head_size*head_size);
+                  hint_insert(&try_offset, (next_part_offset+head_size-1)/head_size*head_size+head_size);
                 }
               }
               if((fast_mode==0) && (partition->part_offset+partition->part_size-disk_car->sector_size > search_location))
@@ -894,23 +1007,23 @@ static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_o
     if(ind_stop==INDSTOP_SKIP)
     {
       ind_stop=INDSTOP_CONTINUE;
-      if(try_offset_nbr>0 && search_location < try_offset[0])
-	search_location=try_offset[0];
+      if(try_offset.nbr>0 && search_location < hint_next(&try_offset))
+	search_location=hint_next(&try_offset);
     }
     else if(ind_stop==INDSTOP_STOP)
     {
-      if(try_offset_nbr>0 && search_location < try_offset[0])
-	search_location=try_offset[0];
+      if(try_offset.nbr>0 && search_location < hint_next(&try_offset))
+	search_location=hint_next(&try_offset);
       else
 	ind_stop=INDSTOP_QUIT;
     }
     else
     { /* Optimized "search_location+=disk_car->sector_size;" */
       uint64_t min=search_location_update(search_location);
-      if(try_offset_nbr>0 && min>try_offset[0])
-        min=try_offset[0];
-      if(try_offset_raid_nbr>0 && min>try_offset_raid[0])
-        min=try_offset_raid[0];
+      if(min>hint_next(&try_offset))
+        min=hint_next(&try_offset);
+      if(min>hint_next(&try_offset_raid))
+        min=hint_next(&try_offset_raid);
       if(min==(uint64_t)-1 || min<=search_location)
         search_location+=disk_car->sector_size;
       else
@@ -924,6 +1037,8 @@ static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_o
   free(partition);
   if(ind_stop!=INDSTOP_CONTINUE)
     log_info("Search for partition aborted\n");
+  else if(fast_mode>0)
+    search_checkpoint_delete();
   if(list_part_bad!=NULL)
   {
     interface_part_bad_log(disk_car,list_part_bad);
@@ -933,8 +1048,12 @@ static list_part_t *search_part(disk_t *disk_car, const list_part_t *list_part_o
 #endif
   }
   part_free_list(list_part_bad);
+  free(try_offset.offsets);
+  free(try_offset_raid.offsets);
   free(buffer_disk0);
   free(buffer_disk);
+  if(fast_mode>0)
+    diskcache_set_readahead(disk_car, readahead_org);
   return list_part;
 }
 
@@ -29,6 +29,9 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include "types.h"
 #include "common.h"
 #include "hdcache.h"
@@ -36,6 +39,8 @@
 
 #define CACHE_BUFFER_NBR 16
 #define CACHE_DEFAULT_SIZE 64*512
+/* Read-ahead windows from this size are prefetched by a helper thread */
+#define CACHE_PREFETCH_MIN (1024*1024)
 //#define DEBUG_CACHE 1
 
 struct cache_buffer_struct
@@ -47,6 +52,10 @@ struct cache_buffer_struct
   int		cache_status;
 };
 
+#ifdef HAVE_PTHREAD
+enum { CACHE_PREFETCH_NONE=0, CACHE_PREFETCH_PENDING, CACHE_PREFETCH_DONE, CACHE_PREFETCH_QUIT };
+#endif
+
 struct cache_struct
 {
   disk_t *disk_car;
@@ -56,10 +65,26 @@ struct cache_struct
   uint64_t 	nbr_pread_sect;
   unsigned int 	nbr_fnct_call;
   unsigned int 	nbr_pread_call;
+  unsigned int 	nbr_prefetch_call;
+  unsigned int 	nbr_prefetch_hit;
 #endif
   unsigned int  cache_buffer_nbr;
   unsigned int  cache_size_min;
   unsigned int  last_io_error_nbr;
+  /* Last read-ahead window that could not be fully read,
+   * it is read by small chunks */
+  uint64_t	error_offset;
+  unsigned int	error_size;
+#ifdef HAVE_PTHREAD
+  /* The next window is read by prefetch_thread while the current one is
+   * used, the underlying disk is never accessed by both threads at once */
+  struct cache_buffer_struct prefetch;
+  int		prefetch_state;
+  int		prefetch_thread_ok;
+  pthread_t	prefetch_thread;
+  pthread_mutex_t prefetch_mutex;
+  pthread_cond_t prefetch_cond;
+#endif
 };
 
 static int cache_pread_aux(disk_t *disk_car, void *buffer, const unsigned int count, const uint64_t offset, const unsigned int read_ahead);
@@ -70,6 +95,143 @@ static void cache_clean(disk_t *disk);
 static const char *cache_description(disk_t *disk_car);
 static const char *cache_description_short(disk_t *disk_car);
 
+#ifdef HAVE_PTHREAD
+static void *cache_prefetch_worker(void *arg)
+{
+  struct cache_struct *data=(struct cache_struct *)arg;
+  pthread_mutex_lock(&data->prefetch_mutex);
+  while(data->prefetch_state!=CACHE_PREFETCH_QUIT)
+  {
+    if(data->prefetch_state==CACHE_PREFETCH_PENDING)
+    {
+      struct cache_buffer_struct *cache=&data->prefetch;
+      int status;
+      pthread_mutex_unlock(&data->prefetch_mutex);
+      status=data->disk_car->pread(data->disk_car, cache->buffer, cache->cache_size, cache->cache_offset);
+      pthread_mutex_lock(&data->prefetch_mutex);
+      cache->cache_status=status;
+      data->prefetch_state=CACHE_PREFETCH_DONE;
+      pthread_cond_broadcast(&data->prefetch_cond);
+    }
+    else
+      pthread_cond_wait(&data->prefetch_cond, &data->prefetch_mutex);
+  }
+  pthread_mutex_unlock(&data->prefetch_mutex);
+  return NULL;
+}
+
+/* Wait for the end of the read done by the prefetch thread */
+static void cache_prefetch_wait(struct cache_struct *data)
+{
+  if(data->prefetch_thread_ok==0)
+    return;
+  pthread_mutex_lock(&data->prefetch_mutex);
+  while(data->prefetch_state==CACHE_PREFETCH_PENDING)
+    pthread_cond_wait(&data->prefetch_cond, &data->prefetch_mutex);
+  pthread_mutex_unlock(&data->prefetch_mutex);
+}
+
+static void cache_prefetch_start(struct cache_struct *data, const uint64_t offset, const unsigned int count)
+{
+  struct cache_buffer_struct *cache=&data->prefetch;
+  if(data->prefetch_thread_ok==0)
+  {
+    data->prefetch_state=CACHE_PREFETCH_NONE;
+    if(pthread_create(&data->prefetch_thread, NULL, &cache_prefetch_worker, data)!=0)
+      return;
+    data->prefetch_thread_ok=1;
+  }
+  if(cache->buffer_size < count)
+  {
+    free(cache->buffer);
+    cache->buffer=NULL;
+  }
+  if(cache->buffer==NULL)
+  {
+    cache->buffer_size=count;
+    cache->buffer=(unsigned char *)MALLOC(cache->buffer_size);
+  }
+  cache->cache_size=count;
+  cache->cache_offset=offset;
+  cache->cache_status=0;
+#ifdef DEBUG_CACHE
+  data->nbr_prefetch_call++;
+#endif
+  pthread_mutex_lock(&data->prefetch_mutex);
+  data->prefetch_state=CACHE_PREFETCH_PENDING;
+  pthread_cond_broadcast(&data->prefetch_cond);
+  pthread_mutex_unlock(&data->prefetch_mutex);
+}
+
+/* Remember the window if the prefetch thread failed to read it */
+static void cache_prefetch_check_error(struct cache_struct *data)
+{
+  const struct cache_buffer_struct *prefetch=&data->prefetch;
+  if(data->prefetch_thread_ok==0)
+    return;
+  cache_prefetch_wait(data);
+  if(data->prefetch_state!=CACHE_PREFETCH_DONE ||
+      prefetch->cache_status==(signed)prefetch->cache_size)
+    return;
+  data->error_offset=prefetch->cache_offset;
+  data->error_size=prefetch->cache_size;
+  pthread_mutex_lock(&data->prefetch_mutex);
+  data->prefetch_state=CACHE_PREFETCH_NONE;
+  pthread_mutex_unlock(&data->prefetch_mutex);
+}
+
+/* If the window has been fully read by the prefetch thread, exchange its
+ * buffer with the cache buffer and return 1 */
+static int cache_prefetch_get(struct cache_struct *data, struct cache_buffer_struct *cache)
+{
+  struct cache_buffer_struct *prefetch=&data->prefetch;
+  unsigned char *buffer;
+  unsigned int buffer_size;
+  if(data->prefetch_thread_ok==0)
+    return 0;
+  cache_prefetch_wait(data);
+  if(data->prefetch_state!=CACHE_PREFETCH_DONE ||
+      prefetch->cache_offset!=cache->cache_offset ||
+      prefetch->cache_size!=cache->cache_size ||
+      prefetch->cache_status!=(signed)prefetch->cache_size)
+    return 0;
+  buffer=cache->buffer;
+  buffer_size=cache->buffer_size;
+  cache->buffer=prefetch->buffer;
+  cache->buffer_size=prefetch->buffer_size;
+  cache->cache_status=prefetch->cache_status;
+  prefetch->buffer=buffer;
+  prefetch->buffer_size=buffer_size;
+  prefetch->cache_size=0;
+  pthread_mutex_lock(&data->prefetch_mutex);
+  data->prefetch_state=CACHE_PREFETCH_NONE;
+  pthread_mutex_unlock(&data->prefetch_mutex);
+#ifdef DEBUG_CACHE
+  data->nbr_prefetch_hit++;
+#endif
+  return 1;
+}
+
+static void cache_prefetch_stop(struct cache_struct *data)
+{
+  if(data->prefetch_thread_ok!=0)
+  {
+    cache_prefetch_wait(data);
+    pthread_mutex_lock(&data->prefetch_mutex);
+    data->prefetch_state=CACHE_PREFETCH_QUIT;
+    pthread_cond_broadcast(&data->prefetch_cond);
+    pthread_mutex_unlock(&data->prefetch_mutex);
+    pthread_join(data->prefetch_thread, NULL);
+    data->prefetch_thread_ok=0;
+  }
+  data->prefetch_state=CACHE_PREFETCH_NONE;
+  free(data->prefetch.buffer);
+  data->prefetch.buffer=NULL;
+  data->prefetch.buffer_size=0;
+  data->prefetch.cache_size=0;
+}
+#endif
+
 static int cache_pread(disk_t *disk_car, void *buffer, const unsigned int count, const uint64_t offset)
 {
   const struct cache_struct *data=(const struct cache_struct *)disk_car->data;
@@ -126,7 +288,33 @@ static int cache_pread_aux(disk_t *disk_car, void *buffer, const unsigned int co
   }
   {
     struct cache_buffer_struct *cache;
-    const unsigned int count_new=(read_ahead!=0 && count<data->cache_size_min && (offset+data->cache_size_min<data->disk_car->disk_real_size)?data->cache_size_min:count);
+    uint64_t offset_new=offset;
+    unsigned int count_new=count;
+#ifdef HAVE_PTHREAD
+    cache_prefetch_check_error(data);
+#endif
+    if(read_ahead!=0 && count<data->cache_size_min)
+    {
+      /* Read the aligned window containing the data, a scan progressing
+       * through the disk hits the same window until its end */
+      unsigned int size=data->cache_size_min;
+      if(data->error_size>0 && size>CACHE_DEFAULT_SIZE &&
+	  data->error_offset <= offset &&
+	  offset < data->error_offset + data->error_size)
+	size=CACHE_DEFAULT_SIZE;
+      offset_new=offset / size * size;
+      count_new=(unsigned int)td_max((uint64_t)size, offset - offset_new + count);
+      if(offset_new + count_new > data->disk_car->disk_real_size)
+      {
+	if(offset + count < data->disk_car->disk_real_size)
+	  count_new=data->disk_car->disk_real_size - offset_new;
+	else
+	{
+	  offset_new=offset;
+	  count_new=count;
+	}
+      }
+    }
     data->cache_buffer_nbr=(data->cache_buffer_nbr+1)%CACHE_BUFFER_NBR;
     cache=&data->cache[data->cache_buffer_nbr];
     if(cache->buffer_size < count_new)
@@ -140,28 +328,53 @@ static int cache_pread_aux(disk_t *disk_car, void *buffer, const unsigned int co
       cache->buffer=(unsigned char *)MALLOC(cache->buffer_size);
     }
     cache->cache_size=count_new;
-    cache->cache_offset=offset;
-    cache->cache_status=data->disk_car->pread(data->disk_car, cache->buffer, count_new, offset);
+    cache->cache_offset=offset_new;
+#ifdef HAVE_PTHREAD
+    if(cache_prefetch_get(data, cache)==0)
+#endif
+      cache->cache_status=data->disk_car->pread(data->disk_car, cache->buffer, count_new, offset_new);
+#ifdef HAVE_PTHREAD
+    /* A large window is likely followed by the next one */
+    if(data->cache_size_min >= CACHE_PREFETCH_MIN &&
+	count_new==data->cache_size_min &&
+	cache->cache_status==(signed)count_new &&
+	offset_new + count_new < data->disk_car->disk_real_size &&
+	!(data->error_size>0 && data->error_offset==offset_new + count_new))
+    {
+      const uint64_t offset_next=offset_new + count_new;
+      cache_prefetch_start(data, offset_next,
+	  (unsigned int)td_min((uint64_t)count_new, data->disk_car->disk_real_size - offset_next));
+    }
+#endif
 #ifdef DEBUG_CACHE
     data->nbr_fnct_sect+=count;
     data->nbr_pread_call++;
     data->nbr_pread_sect+=count_new;
     log_info("cache PREAD(buffer[%u], count=%u, count_new=%u, offset=%llu, cstatus=%d)\n",
-	data->cache_buffer_nbr, count, count_new, (long long unsigned)offset,
+	data->cache_buffer_nbr, count, count_new, (long long unsigned)offset_new,
 	cache->cache_status);
 #endif
-    if(cache->cache_status >= (signed)count)
+    if(cache->cache_status >= (signed)(offset - offset_new + count))
     {
       data->last_io_error_nbr=0;
-      memcpy(buffer, cache->buffer, count);
+      memcpy(buffer, cache->buffer + offset - offset_new, count);
       return count;
     }
     /* Read failure */
     data->last_io_error_nbr++;
+    if(data->cache_size_min > CACHE_DEFAULT_SIZE &&
+	count_new >= data->cache_size_min && count_new > count)
+    {
+      /* Don't read the whole window again */
+      data->error_offset=offset_new;
+      data->error_size=count_new;
+    }
     if(count_new<=disk_car->sector_size || disk_car->sector_size<=0 || data->last_io_error_nbr>1)
     {
-      memcpy(buffer, cache->buffer, count);
-      return cache->cache_status;
+      memcpy(buffer, cache->buffer + offset - offset_new, count);
+      if(cache->cache_status < 0)
+	return cache->cache_status;
+      return (cache->cache_status > (signed)(offset - offset_new) ? cache->cache_status - (signed)(offset - offset_new) : 0);
     }
     /* Free the existing cache */
     cache->cache_size=0;
@@ -188,6 +401,16 @@ static int cache_pwrite(disk_t *disk_car, const void *buffer, const unsigned int
 {
   struct cache_struct *data=(struct cache_struct *)disk_car->data;
   unsigned int i;
+#ifdef HAVE_PTHREAD
+  /* The prefetched window may contain the data being written */
+  cache_prefetch_wait(data);
+  if(data->prefetch_thread_ok!=0)
+  {
+    pthread_mutex_lock(&data->prefetch_mutex);
+    data->prefetch_state=CACHE_PREFETCH_NONE;
+    pthread_mutex_unlock(&data->prefetch_mutex);
+  }
+#endif
   for(i=0;i<CACHE_BUFFER_NBR;i++)
   {
     struct cache_buffer_struct *cache=&data->cache[i];
@@ -212,6 +435,13 @@ static void cache_clean(disk_t *disk_car)
 	data->disk_car->description(data->disk_car),
 	data->nbr_fnct_call, (long long unsigned)data->nbr_fnct_sect,
 	data->nbr_pread_call, (long long unsigned)data->nbr_pread_sect);
+    log_info("  prefetch total_call=%u, used=%u\n",
+	data->nbr_prefetch_call, data->nbr_prefetch_hit);
+#endif
+#ifdef HAVE_PTHREAD
+    cache_prefetch_stop(data);
+    pthread_cond_destroy(&data->prefetch_cond);
+    pthread_mutex_destroy(&data->prefetch_mutex);
 #endif
     data->disk_car->clean(data->disk_car);
     for(i=0;i<CACHE_BUFFER_NBR;i++)
@@ -228,9 +458,44 @@ static void cache_clean(disk_t *disk_car)
 static int cache_sync(disk_t *disk_car)
 {
   struct cache_struct *data=(struct cache_struct *)disk_car->data;
+#ifdef HAVE_PTHREAD
+  cache_prefetch_wait(data);
+#endif
   return data->disk_car->sync(data->disk_car);
 }
 
+unsigned int diskcache_set_readahead(disk_t *disk_car, const unsigned int cache_size_min)
+{
+  struct cache_struct *data;
+  unsigned int old_cache_size_min;
+  if(disk_car->pread!=cache_pread)
+    return 0;
+  data=(struct cache_struct *)disk_car->data;
+  old_cache_size_min=data->cache_size_min;
+  data->cache_size_min=cache_size_min;
+#ifdef HAVE_PTHREAD
+  if(cache_size_min < CACHE_PREFETCH_MIN)
+    cache_prefetch_stop(data);
+#endif
+  if(cache_size_min < old_cache_size_min)
+  {
+    /* Release the large buffers */
+    unsigned int i;
+    for(i=0;i<CACHE_BUFFER_NBR;i++)
+    {
+      struct cache_buffer_struct *cache=&data->cache[i];
+      if(cache->buffer_size > CACHE_DEFAULT_SIZE && cache->buffer_size > cache_size_min)
+      {
+	free(cache->buffer);
+	cache->buffer=NULL;
+	cache->buffer_size=0;
+	cache->cache_size=0;
+      }
+    }
+  }
+  return old_cache_size_min;
+}
+
 static void dup_geometry(CHSgeometry_t * CHS_dst, const CHSgeometry_t * CHS_source)
 {
   CHS_dst->cylinders=CHS_source->cylinders;
@@ -250,9 +515,13 @@ disk_t *new_diskcache(disk_t *disk_car, const unsigned int testdisk_mode)
   data->nbr_pread_sect=0;
   data->nbr_fnct_call=0;
   data->nbr_pread_call=0;
+  data->nbr_prefetch_call=0;
+  data->nbr_prefetch_hit=0;
 #endif
   data->cache_buffer_nbr=0;
   data->last_io_error_nbr=0;
+  data->error_offset=0;
+  data->error_size=0;
   if(testdisk_mode&TESTDISK_O_READAHEAD_8K)
     data->cache_size_min=16*512;
   else if(testdisk_mode&TESTDISK_O_READAHEAD_32K)
@@ -279,6 +548,15 @@ disk_t *new_diskcache(disk_t *disk_car, const unsigned int testdisk_mode)
     data->cache[i].buffer=NULL;
     data->cache[i].buffer_size=0;
   }
+#ifdef HAVE_PTHREAD
+  data->prefetch.buffer=NULL;
+  data->prefetch.buffer_size=0;
+  data->prefetch.cache_size=0;
+  data->prefetch_state=CACHE_PREFETCH_NONE;
+  data->prefetch_thread_ok=0;
+  pthread_mutex_init(&data->prefetch_mutex, NULL);
+  pthread_cond_init(&data->prefetch_cond, NULL);
+#endif
   return new_disk_car;
 }
 
@@ -24,6 +24,9 @@ extern "C" {
 #endif
 
 disk_t *new_diskcache(disk_t *disk_car, const unsigned int cache_size_min);
+/* Set the minimal size of the reads done by the cache on the disk,
+ * returns the previous value or 0 if disk_car isn't a disk cache */
+unsigned int diskcache_set_readahead(disk_t *disk_car, const unsigned int cache_size_min);
 
 #ifdef __cplusplus
 } /* closing brace for extern "C" */
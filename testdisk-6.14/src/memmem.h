@@ -24,8 +24,11 @@
 
 static inline const void *td_memmem(const void *haystack, const unsigned int haystack_len, const void *needle, const unsigned int needle_len)
 {
-  const char *begin;
-  const char *const last_possible = (const char *) haystack + haystack_len - needle_len;
+  const unsigned char *begin=(const unsigned char *)haystack;
+  const unsigned char *const needle_char=(const unsigned char *)needle;
+  const unsigned char *last_possible;
+  unsigned char first;
+  unsigned char last;
 
   if (needle_len == 0)
     /* The first occurrence of the empty string is deemed to occur at
@@ -37,11 +40,26 @@ static inline const void *td_memmem(const void *haystack, const unsigned int hay
   if (haystack_len < needle_len)
     return NULL;
 
-  for (begin = (const char *) haystack; begin <= last_possible; ++begin)
-    if (begin[0] == ((const char *) needle)[0] &&
+  first=needle_char[0];
+  if (needle_len == 1)
+    return memchr(haystack, first, haystack_len);
+
+  /* Let memchr() (vectorized by the C library) find the candidates for
+     the first byte, then reject most false positives by checking the
+     last byte before comparing the whole needle.  */
+  last=needle_char[needle_len - 1];
+  last_possible = begin + haystack_len - needle_len;
+  while (begin <= last_possible)
+  {
+    begin=(const unsigned char *)memchr(begin, first, last_possible - begin + 1);
+    if (begin == NULL)
+      return NULL;
+    if (begin[needle_len - 1] == last &&
         !memcmp ((const void *) &begin[1],
-                 (const void *) ((const char *) needle + 1),
-                 needle_len - 1))
+                 (const void *) &needle_char[1],
+                 needle_len - 2))
       return (const void *) begin;
+    begin++;
+  }
   return NULL;
 }
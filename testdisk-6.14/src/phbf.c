@@ -31,12 +31,18 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #ifdef HAVE_TIME_H
 #include <time.h>
 #endif
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
 #include "types.h"
 #include "common.h"
 #include "intrf.h"
@@ -62,6 +68,7 @@
 #include "log.h"
 #include "log_part.h"
 #include "file_tar.h"
+#include "file_jpg.h"
 #include "phcfg.h"
 #include "pblocksize.h"
 #include "pnext.h"
@@ -71,11 +78,90 @@
 //#define DEBUG_BF
 //#define DEBUG_BF2
 #define READ_SIZE 1024*512
+/* Memory used to keep the blocks read by the brute force */
+#define BF_CACHE_SIZE (32*1024*1024)
+/* Number of consecutive blocks read when a block isn't in the cache */
+#define BF_CACHE_READAHEAD 64
+/* Files bigger than this are assembled in the output file */
+#define BF_MEMFILE_MAX (256*1024*1024)
+#if defined(__GLIBC__) && defined(HAVE_SYS_WAIT_H) && defined(_SC_NPROCESSORS_ONLN)
+/* The fragment hypotheses are evaluated by worker processes, not threads:
+ * data_check and file_check keep their state in static variables
+ * (jpg_stream in file_jpg.c...), each process has its own copy */
+#define BF_WORKERS 1
+#define BF_WORKERS_MAX 16
+#endif
+extern const file_hint_t file_hint_jpg;
 extern file_check_list_t file_check_list;
 extern uint64_t free_list_allocation_end;
 
 typedef enum { BF_OK=0, BF_STOP=1, BF_EACCES=2, BF_ENOSPC=3, BF_FRAG_FOUND=4, BF_EOF=5, BF_ENOENT=6, BF_ERANGE=7} bf_status_t;
 
+/* Each fragment hypothesis reads again the blocks of the file, they are
+ * kept in a direct-mapped cache shared by all the hypotheses */
+typedef struct
+{
+  uint64_t *offsets;		/* offset+1 of the block stored in each slot, 0 if none */
+  unsigned char *blocks;
+  unsigned char *readahead;
+  unsigned char *classes;	/* bf_class_t of the block stored in each slot */
+  unsigned char *block;
+  unsigned int slots;
+  unsigned int blocksize;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t skipped;
+  uint64_t parallel;
+} bf_cache_t;
+
+/* Content class of a block, a fragment can only be continued by a block
+ * of a compatible class */
+typedef enum { BF_CLASS_NONE=0, BF_CLASS_ZERO=1, BF_CLASS_TEXT=2, BF_CLASS_JPEG=3, BF_CLASS_ENTROPY=4, BF_CLASS_UNKNOWN=5 } bf_class_t;
+
+static bf_cache_t bf_cache;
+
+#ifdef BF_WORKERS
+/* Result sent by a worker process */
+typedef struct
+{
+  int known;			/* 0 if the worker couldn't evaluate the hypothesis */
+  bf_status_t res;
+  uint64_t offset_error;
+} bf_result_t;
+
+/* Fragment hypothesis evaluated by a worker process */
+typedef struct
+{
+  int blocs_to_skip;
+  alloc_data_t *start_search_space;
+  uint64_t start_offset;
+  pid_t pid;
+  int fd;
+  bf_result_t result;
+} bf_spec_t;
+
+static unsigned int bf_workers_nbr=0;
+/* Set in the worker processes */
+static int bf_worker=0;
+static int bf_worker_miss=0;
+#endif
+
+#if defined(__GLIBC__)
+/* The fragment hypotheses are assembled in memory, only the layout
+ * accepted by file_check is written to the output file */
+typedef struct
+{
+  unsigned char *data;
+  uint64_t size;
+  uint64_t alloc;
+  uint64_t pos;
+  FILE *disk;			/* output file used when the data can't be kept in memory */
+  const char *filename;
+} bf_memfile_t;
+
+static bf_memfile_t *bf_memfile=NULL;
+#endif
+
 static pstatus_t photorec_bf_aux(struct ph_param *params, file_recovery_t *file_recovery, alloc_data_t *list_search_space, alloc_data_t *start_search_space, const int phase);
 static bf_status_t photorec_bf_frag(struct ph_param *params, file_recovery_t *file_recovery, alloc_data_t *list_search_space, alloc_data_t *start_search_space, const int phase, alloc_data_t **current_search_space, uint64_t *offset, unsigned char *buffer, unsigned char *block_buffer, const unsigned int frag);
 
@@ -104,6 +190,434 @@ static void list_space_used(const file_recovery_t *file_recovery, const unsigned
 }
 #endif
 
+static void bf_cache_init(const unsigned int blocksize)
+{
+  bf_cache.blocksize=blocksize;
+  bf_cache.slots=(BF_CACHE_SIZE / blocksize > BF_CACHE_READAHEAD ? BF_CACHE_SIZE / blocksize : BF_CACHE_READAHEAD);
+  bf_cache.offsets=(uint64_t *)MALLOC(bf_cache.slots * sizeof(uint64_t));
+  memset(bf_cache.offsets, 0, bf_cache.slots * sizeof(uint64_t));
+  bf_cache.blocks=(unsigned char *)MALLOC(bf_cache.slots * blocksize);
+  bf_cache.readahead=(unsigned char *)MALLOC(BF_CACHE_READAHEAD * blocksize);
+  bf_cache.classes=(unsigned char *)MALLOC(bf_cache.slots);
+  memset(bf_cache.classes, BF_CLASS_NONE, bf_cache.slots);
+  bf_cache.block=(unsigned char *)MALLOC(blocksize);
+  bf_cache.hits=0;
+  bf_cache.misses=0;
+  bf_cache.skipped=0;
+  bf_cache.parallel=0;
+#ifdef BF_WORKERS
+  {
+    const long cpu_nbr=sysconf(_SC_NPROCESSORS_ONLN);
+    bf_workers_nbr=(cpu_nbr < 2 ? 0 : (cpu_nbr < BF_WORKERS_MAX ? cpu_nbr : BF_WORKERS_MAX));
+  }
+#endif
+}
+
+static void bf_cache_free(void)
+{
+  log_info("Brute force: %llu blocks read from the cache, %llu disk reads\n",
+      (long long unsigned)bf_cache.hits, (long long unsigned)bf_cache.misses);
+  log_info("Brute force: %llu hypotheses skipped, the next block can't continue the file\n",
+      (long long unsigned)bf_cache.skipped);
+#ifdef BF_WORKERS
+  log_info("Brute force: %llu hypotheses rejected by %u worker processes\n",
+      (long long unsigned)bf_cache.parallel, bf_workers_nbr);
+#endif
+  free(bf_cache.offsets);
+  free(bf_cache.blocks);
+  free(bf_cache.readahead);
+  free(bf_cache.classes);
+  free(bf_cache.block);
+  bf_cache.offsets=NULL;
+  bf_cache.blocks=NULL;
+  bf_cache.readahead=NULL;
+  bf_cache.classes=NULL;
+  bf_cache.block=NULL;
+}
+
+/* Read one block, the following blocks are read at the same time */
+static void bf_pread(disk_t *disk, unsigned char *buffer, const uint64_t offset)
+{
+  const unsigned int blocksize=bf_cache.blocksize;
+  const uint64_t block=offset / blocksize;
+  unsigned int nbr=BF_CACHE_READAHEAD;
+  unsigned int i;
+  if(bf_cache.offsets[block % bf_cache.slots]==offset+1)
+  {
+    bf_cache.hits++;
+    memcpy(buffer, &bf_cache.blocks[(block % bf_cache.slots) * blocksize], blocksize);
+    return ;
+  }
+  bf_cache.misses++;
+#ifdef BF_WORKERS
+  if(bf_worker)
+  {
+    /* Only the main process reads the disk, the hypothesis will be
+     * evaluated again by it */
+    bf_worker_miss=1;
+    memset(buffer, 0, blocksize);
+    return ;
+  }
+#endif
+  if(offset < disk->disk_size && (disk->disk_size - offset) / blocksize < nbr)
+    nbr=(disk->disk_size - offset) / blocksize;
+  if(offset >= disk->disk_size || nbr==0 ||
+      disk->pread(disk, bf_cache.readahead, nbr * blocksize, offset) != (int)(nbr * blocksize))
+  {
+    /* Partial block or read error, don't keep it */
+    disk->pread(disk, buffer, blocksize, offset);
+    return ;
+  }
+  for(i=0; i<nbr; i++)
+  {
+    const unsigned int slot=(block + i) % bf_cache.slots;
+    bf_cache.offsets[slot]=offset + (uint64_t)i * blocksize + 1;
+    bf_cache.classes[slot]=BF_CLASS_NONE;
+    memcpy(&bf_cache.blocks[slot * blocksize], &bf_cache.readahead[i * blocksize], blocksize);
+  }
+  memcpy(buffer, bf_cache.readahead, blocksize);
+}
+
+#if defined(__GLIBC__)
+static ssize_t bf_memfile_read(void *cookie, char *buf, size_t size)
+{
+  bf_memfile_t *memfile=(bf_memfile_t *)cookie;
+  if(memfile->pos >= memfile->size)
+    return 0;
+  if(size > memfile->size - memfile->pos)
+    size=memfile->size - memfile->pos;
+  if(memfile->disk!=NULL)
+  {
+    if(fseeko(memfile->disk, memfile->pos, SEEK_SET)<0)
+      return -1;
+    size=fread(buf, 1, size, memfile->disk);
+  }
+  else
+    memcpy(buf, &memfile->data[memfile->pos], size);
+  memfile->pos+=size;
+  return size;
+}
+
+/* Move the data to the output file, it's used for the next accesses */
+static int bf_memfile_spill(bf_memfile_t *memfile)
+{
+#ifdef BF_WORKERS
+  /* A worker process must not create the output file */
+  if(bf_worker)
+  {
+    errno=ENOSPC;
+    return -1;
+  }
+#endif
+  memfile->disk=fopen(memfile->filename, "w+b");
+  if(memfile->disk==NULL)
+    return -1;
+  if(memfile->size > 0 &&
+      fwrite(memfile->data, memfile->size, 1, memfile->disk)<1)
+  {
+    fclose(memfile->disk);
+    memfile->disk=NULL;
+    unlink(memfile->filename);
+    errno=ENOSPC;
+    return -1;
+  }
+  log_info("Brute force: %s is too big to be assembled in memory\n", memfile->filename);
+  free(memfile->data);
+  memfile->data=NULL;
+  memfile->alloc=0;
+  return 0;
+}
+
+static ssize_t bf_memfile_write(void *cookie, const char *buf, size_t size)
+{
+  bf_memfile_t *memfile=(bf_memfile_t *)cookie;
+  if(memfile->disk==NULL && memfile->pos + size > memfile->alloc)
+  {
+    unsigned char *data=NULL;
+    if(memfile->pos + size <= BF_MEMFILE_MAX)
+    {
+      uint64_t alloc=(memfile->alloc > 0 ? memfile->alloc : 1024*1024);
+      while(memfile->pos + size > alloc)
+	alloc*=2;
+      if(alloc > BF_MEMFILE_MAX)
+	alloc=BF_MEMFILE_MAX;
+      data=(unsigned char *)realloc(memfile->data, alloc);
+      if(data!=NULL)
+      {
+	memfile->data=data;
+	memfile->alloc=alloc;
+      }
+    }
+    /* Too big or out of memory */
+    if(data==NULL && bf_memfile_spill(memfile)<0)
+      return -1;
+  }
+  if(memfile->disk!=NULL)
+  {
+    if(fseeko(memfile->disk, memfile->pos, SEEK_SET)<0 ||
+	fwrite(buf, size, 1, memfile->disk)<1)
+      return -1;
+  }
+  else
+  {
+    if(memfile->pos > memfile->size)
+      memset(&memfile->data[memfile->size], 0, memfile->pos - memfile->size);
+    memcpy(&memfile->data[memfile->pos], buf, size);
+  }
+  memfile->pos+=size;
+  if(memfile->size < memfile->pos)
+    memfile->size=memfile->pos;
+  return size;
+}
+
+static int bf_memfile_seek(void *cookie, off64_t *position, int whence)
+{
+  bf_memfile_t *memfile=(bf_memfile_t *)cookie;
+  off64_t new_pos;
+  switch(whence)
+  {
+    case SEEK_SET:
+      new_pos=*position;
+      break;
+    case SEEK_CUR:
+      new_pos=memfile->pos + *position;
+      break;
+    case SEEK_END:
+      new_pos=memfile->size + *position;
+      break;
+    default:
+      errno=EINVAL;
+      return -1;
+  }
+  if(new_pos < 0)
+  {
+    errno=EINVAL;
+    return -1;
+  }
+  memfile->pos=new_pos;
+  *position=new_pos;
+  return 0;
+}
+
+static int bf_memfile_close(void *cookie)
+{
+  bf_memfile_t *memfile=(bf_memfile_t *)cookie;
+  if(memfile->disk!=NULL)
+    fclose(memfile->disk);
+  free(memfile->data);
+  free(memfile);
+  if(bf_memfile==memfile)
+    bf_memfile=NULL;
+  return 0;
+}
+
+static FILE *bf_memfile_open(const char *filename)
+{
+  static const cookie_io_functions_t bf_memfile_io={
+    .read=bf_memfile_read,
+    .write=bf_memfile_write,
+    .seek=bf_memfile_seek,
+    .close=bf_memfile_close
+  };
+  FILE *handle;
+  bf_memfile_t *memfile=(bf_memfile_t *)MALLOC(sizeof(*memfile));
+  memset(memfile, 0, sizeof(*memfile));
+  memfile->filename=filename;
+  handle=fopencookie(memfile, "w+b", bf_memfile_io);
+  if(handle==NULL)
+  {
+    free(memfile);
+    return NULL;
+  }
+  bf_memfile=memfile;
+  return handle;
+}
+
+/* Write the file assembled in memory to the output file if file_check
+ * accepts it. file_recovery is left as it was so that file_finish()
+ * checks the output file exactly like before. */
+static bf_status_t bf_memfile_flush(file_recovery_t *file_recovery)
+{
+  file_recovery_t file_recovery_backup;
+  FILE *handle;
+  fflush(file_recovery->handle);
+  memcpy(&file_recovery_backup, file_recovery, sizeof(file_recovery_backup));
+  if(file_recovery->file_stat!=NULL && file_recovery->file_check!=NULL)
+    file_recovery->file_check(file_recovery);
+  fflush(file_recovery->handle);
+  if(file_recovery->file_size==0)
+  {
+    /* Rejected, nothing has to be written */
+    const int on_disk=(bf_memfile->disk!=NULL);
+    fclose(file_recovery->handle);
+    file_recovery->handle=NULL;
+    if(on_disk)
+      unlink(file_recovery->filename);
+    return BF_OK;
+  }
+  memcpy(file_recovery, &file_recovery_backup, sizeof(file_recovery_backup));
+  if(bf_memfile->disk!=NULL)
+  {
+    /* The data is already in the output file */
+    handle=bf_memfile->disk;
+    bf_memfile->disk=NULL;
+    fclose(file_recovery->handle);
+    file_recovery->handle=handle;
+    return BF_OK;
+  }
+  handle=fopen(file_recovery->filename, "w+b");
+  if(handle==NULL)
+  {
+    log_critical("Cannot create file %s: %s\n", file_recovery->filename, strerror(errno));
+    fclose(file_recovery->handle);
+    file_recovery->handle=NULL;
+    file_recovery->file_size=0;
+    return BF_EACCES;
+  }
+  if(bf_memfile->size > 0 &&
+      fwrite(bf_memfile->data, bf_memfile->size, 1, handle)<1)
+  {
+    log_critical("Cannot write to file %s: %s\n", file_recovery->filename, strerror(errno));
+    fclose(handle);
+    unlink(file_recovery->filename);
+    fclose(file_recovery->handle);
+    file_recovery->handle=NULL;
+    file_recovery->file_size=0;
+    return BF_ENOSPC;
+  }
+  fclose(file_recovery->handle);
+  file_recovery->handle=handle;
+  return BF_OK;
+}
+#endif
+
+/* Open the file used to assemble the fragment hypotheses */
+static FILE *bf_fopen(const file_recovery_t *file_recovery)
+{
+#if defined(__GLIBC__)
+  if(file_recovery->offset_error <= BF_MEMFILE_MAX)
+  {
+    FILE *handle=bf_memfile_open(file_recovery->filename);
+    if(handle!=NULL)
+      return handle;
+  }
+#endif
+  return fopen(file_recovery->filename, "w+b");
+}
+
+/* Remove the data written by the previous hypotheses after the end of
+ * the file, file_check must only see the blocks of this hypothesis */
+static void bf_truncate(file_recovery_t *file_recovery)
+{
+  FILE *handle=file_recovery->handle;
+  fflush(handle);
+#if defined(__GLIBC__)
+  if(bf_memfile!=NULL)
+  {
+    if(bf_memfile->size > file_recovery->file_size)
+      bf_memfile->size=file_recovery->file_size;
+    if(bf_memfile->disk==NULL)
+      return ;
+    handle=bf_memfile->disk;
+    fflush(handle);
+  }
+#endif
+#ifdef HAVE_FTRUNCATE
+  if(ftruncate(fileno(handle), file_recovery->file_size)<0)
+  {
+    log_critical("ftruncate failed.\n");
+  }
+#endif
+}
+
+static bf_status_t bf_file_finish(file_recovery_t *file_recovery, struct ph_param *params, alloc_data_t *list_search_space, alloc_data_t **current_search_space, uint64_t *offset)
+{
+  bf_status_t res=BF_OK;
+#if defined(__GLIBC__)
+  if(bf_memfile!=NULL && file_recovery->handle!=NULL)
+    res=bf_memfile_flush(file_recovery);
+#endif
+  file_finish(file_recovery, params, list_search_space, current_search_space, offset);
+  return res;
+}
+
+/* Classify a block using its byte histogram:
+ * - ZERO: the same byte repeated (zero-filled or erased space)
+ * - TEXT: only printable characters, TAB, CR, LF or UTF-8 bytes
+ * - JPEG: high entropy, each 0xff is followed by 0x00 or a RST marker
+ *   like in the entropy-coded segment of a JPEG scan
+ * - ENTROPY: high entropy (compressed or encrypted data)
+ * The histogram is nearly uniform for high entropy data: the sum of
+ * the squared counts stays close to n*n/256 */
+static bf_class_t bf_classify(const unsigned char *buffer, const unsigned int blocksize)
+{
+  unsigned int count[256];
+  uint64_t collisions=0;
+  unsigned int not_text=0;
+  unsigned int stuffed=0;
+  unsigned int i;
+  memset(count, 0, sizeof(count));
+  for(i=0; i<blocksize; i++)
+    count[buffer[i]]++;
+  if(count[buffer[0]]==blocksize)
+    return BF_CLASS_ZERO;
+  for(i=0; i<0x20; i++)
+    if(i!='\t' && i!='\n' && i!='\r')
+      not_text+=count[i];
+  not_text+=count[0x7f];
+  if(not_text==0)
+    return BF_CLASS_TEXT;
+  for(i=0; i<256; i++)
+    collisions+=(uint64_t)count[i] * count[i];
+  if(collisions * 256 > 2 * ((uint64_t)blocksize * blocksize + 255 * blocksize))
+    return BF_CLASS_UNKNOWN;
+  for(i=0; i+1<blocksize; i++)
+  {
+    if(buffer[i]==0xff)
+    {
+      if(buffer[i+1]==0x00)
+	stuffed++;
+      else if(buffer[i+1]<0xd0 || buffer[i+1]>0xd7)
+	return BF_CLASS_ENTROPY;
+      i++;
+    }
+  }
+  return (stuffed>0 ? BF_CLASS_JPEG : BF_CLASS_ENTROPY);
+}
+
+/* The class of a block is kept with the block in the cache */
+static bf_class_t bf_class(disk_t *disk, const uint64_t offset)
+{
+  const unsigned int slot=(offset / bf_cache.blocksize) % bf_cache.slots;
+  bf_pread(disk, bf_cache.block, offset);
+  if(bf_cache.offsets[slot]!=offset+1)
+    return bf_classify(bf_cache.block, bf_cache.blocksize);
+  if(bf_cache.classes[slot]==BF_CLASS_NONE)
+    bf_cache.classes[slot]=bf_classify(bf_cache.block, bf_cache.blocksize);
+  return (bf_class_t)bf_cache.classes[slot];
+}
+
+/* Can a block of class next follow a block of class prev in a JPEG file ?
+ * The entropy-coded data never contains a full block of the same byte,
+ * the scan doesn't contain text. Other formats may store zeroes after
+ * compressed data (OLE sectors, mov/mp4 free atoms, zip stored
+ * entries...), they aren't checked. */
+static int bf_class_compatible(const file_recovery_t *file_recovery, const bf_class_t prev, const bf_class_t next)
+{
+  if(file_recovery->file_stat==NULL ||
+      file_recovery->file_stat->file_hint!=&file_hint_jpg)
+    return 1;
+  switch(prev)
+  {
+    case BF_CLASS_JPEG:
+      return (next!=BF_CLASS_ZERO && next!=BF_CLASS_TEXT);
+    case BF_CLASS_ENTROPY:
+      return (next!=BF_CLASS_ZERO);
+    default:
+      return 1;
+  }
+}
+
 static inline void file_recovery_cpy(file_recovery_t *dst, file_recovery_t *src)
 {
   memcpy(dst, src, sizeof(*dst));
@@ -159,6 +673,7 @@ pstatus_t photorec_bf(struct ph_param *params, const struct ph_options *options,
   int phase;
   buffer_size=blocksize+READ_SIZE;
   buffer_start=(unsigned char *)MALLOC(buffer_size);
+  bf_cache_init(blocksize);
   for(phase=0; phase<2; phase++)
   {
     const unsigned int file_nbr_phase_old=params->file_nbr;
@@ -346,6 +861,7 @@ pstatus_t photorec_bf(struct ph_param *params, const struct ph_options *options,
     log_info("phase=%d +%u\n", phase, params->file_nbr - file_nbr_phase_old);
   }
   free(buffer_start);
+  bf_cache_free();
 #ifdef HAVE_NCURSES
   photorec_info(stdscr, params->file_stats);
 #endif
@@ -359,6 +875,10 @@ static bf_status_t photorec_bf_pad(struct ph_param *params, file_recovery_t *fil
     unsigned int nbr;
     uint64_t offset_error_tmp;
     file_recovery->offset_error=file_offset;
+    /* Only PNG and ZIP resume from their checkpoint: file_check_jpg()
+     * decodes each JPEG hypothesis from the start of the file, the
+     * decoder state can only be saved by photorecf (suspend.c). */
+    jpg_stream_reset();
     do
     {
       uint64_t file_size_backup;
@@ -379,7 +899,7 @@ static bf_status_t photorec_bf_pad(struct ph_param *params, file_recovery_t *fil
 	      (*current_search_space)->file_stat==NULL ||
 	      (*current_search_space)->file_stat->file_hint==NULL)
 	  {
-	    params->disk->pread(params->disk, block_buffer, blocksize, *offset);
+	    bf_pread(params->disk, block_buffer, *offset);
 	    if(file_recovery->data_check(buffer, 2*blocksize, file_recovery)!=1)
 	    {
 	      stop=1;
@@ -410,7 +930,7 @@ static bf_status_t photorec_bf_pad(struct ph_param *params, file_recovery_t *fil
 	      (*current_search_space)->file_stat==NULL ||
 	      (*current_search_space)->file_stat->file_hint==NULL)
 	  {
-	    params->disk->pread(params->disk, block_buffer, blocksize, *offset);
+	    bf_pread(params->disk, block_buffer, *offset);
 	    if(fwrite(block_buffer, blocksize, 1, file_recovery->handle)<1)
 	    {
 	      log_critical("Cannot write to file %s: %s\n", file_recovery->filename, strerror(errno));
@@ -430,6 +950,7 @@ static bf_status_t photorec_bf_pad(struct ph_param *params, file_recovery_t *fil
       list_space_used(file_recovery, 512);
 #endif
       file_size_backup=file_recovery->file_size;
+      bf_truncate(file_recovery);
       file_recovery->flags=1;
       file_recovery->offset_error=0;
       file_recovery->offset_ok=0;
@@ -453,11 +974,15 @@ static bf_status_t photorec_bf_pad(struct ph_param *params, file_recovery_t *fil
 #endif
   if(file_recovery->offset_error==0)
   { /* Recover the file */
+#ifdef BF_WORKERS
+    /* The main process evaluates it again and saves the file */
+    if(bf_worker)
+      return BF_OK;
+#endif
 #ifdef DEBUG_BF
     log_info("photorec_bf_aux, call file_finish\n");
 #endif
-    file_finish(file_recovery, params, list_search_space, current_search_space, offset);
-    return BF_OK;
+    return bf_file_finish(file_recovery, params, list_search_space, current_search_space, offset);
   }
   /* FIXME +4096 => +blocksize*/
   /* 21/11/2009: 2 blocksize */
@@ -476,6 +1001,152 @@ static bf_status_t photorec_bf_pad(struct ph_param *params, file_recovery_t *fil
   return BF_ENOENT;
 }
 
+/* Go to the first block of a hypothesis: skip blocs_to_skip blocks after
+ * the end of the file or, if blocs_to_skip<0, go to one of the next headers.
+ * returns -1 if there is no more data */
+static int bf_hypothesis_start(alloc_data_t *list_search_space, alloc_data_t **current_search_space, uint64_t *offset, const int blocs_to_skip, const unsigned int blocksize)
+{
+  int i;
+  if(blocs_to_skip < 0)
+  {
+    for(i=0; i< 2+blocs_to_skip; i++)
+    {
+      get_next_header(list_search_space, current_search_space, offset);
+    }
+    return 0;
+  }
+  for(i=0; i<blocs_to_skip; i++)
+  {
+    get_next_sector(list_search_space, current_search_space, offset, blocksize);
+    if(*current_search_space==list_search_space)
+      return -1;
+  }
+  return 0;
+}
+
+/* returns 1 if the first block of the hypothesis can't continue the file */
+static int bf_hypothesis_reject(struct ph_param *params, const file_recovery_t *file_recovery, alloc_data_t *list_search_space, const alloc_data_t *space, const uint64_t offset, const int phase, const bf_class_t prev_class)
+{
+  if(space!=list_search_space)
+  {
+    /* Same test as photorec_bf_pad() to know if the block at offset
+     * will be added to the file */
+    const int used=(file_recovery->data_check!=NULL ?
+	((space->start!=offset && phase!=1) || space->file_stat==NULL || space->file_stat->file_hint==NULL) :
+	(space->start!=offset || space->file_stat==NULL || space->file_stat->file_hint==NULL));
+    if(used)
+    {
+      /* bf_class() leaves the block in bf_cache.block */
+      const bf_class_t block_class=bf_class(params->disk, offset);
+      if(bf_class_compatible(file_recovery, prev_class, block_class)==0 ||
+	  data_check_jpg_rst(bf_cache.block, bf_cache.blocksize, file_recovery)==0)
+	return 1;
+    }
+  }
+  return 0;
+}
+
+#ifdef BF_WORKERS
+/* Read the blocks that photorec_bf_pad() will probably need */
+static void bf_cache_warm(disk_t *disk, alloc_data_t *list_search_space, alloc_data_t *current_search_space, uint64_t offset, const unsigned int nbr)
+{
+  unsigned int i;
+  for(i=0; i<nbr && current_search_space!=list_search_space; i++)
+  {
+    bf_pread(disk, bf_cache.block, offset);
+    get_next_sector(list_search_space, &current_search_space, &offset, bf_cache.blocksize);
+  }
+}
+
+static void bf_spec_worker(struct ph_param *params, file_recovery_t *file_recovery, const file_recovery_t *file_recovery_backup, alloc_data_t *list_search_space, const int phase, const uint64_t file_offset, const bf_spec_t *spec, const int fd, unsigned char *buffer, unsigned char *block_buffer)
+{
+  alloc_data_t *current_search_space=spec->start_search_space;
+  uint64_t offset=spec->start_offset;
+  bf_result_t result;
+  bf_worker=1;
+  log_set_levels(0);
+  memcpy(file_recovery, file_recovery_backup, sizeof(*file_recovery));
+  file_recovery->offset_error=0;
+  list_truncate(&file_recovery->location, file_offset);
+  result.res=photorec_bf_pad(params, file_recovery, list_search_space, phase, file_offset, &current_search_space, &offset, buffer, block_buffer);
+  result.known=(bf_worker_miss==0);
+  result.offset_error=file_recovery->offset_error;
+  if(write(fd, &result, sizeof(result))!=(ssize_t)sizeof(result))
+    _exit(1);
+  _exit(0);
+}
+
+/* Evaluate the hypotheses starting from blocs_to_skip in worker processes,
+ * one process per hypothesis.
+ * returns the number of hypotheses stored in spec */
+static unsigned int bf_spec_run(struct ph_param *params, file_recovery_t *file_recovery, const file_recovery_t *file_recovery_backup, alloc_data_t *list_search_space, alloc_data_t *extractblock_search_space, const uint64_t extrablock_offset, const int phase, const uint64_t file_offset, const bf_class_t prev_class, const int blocs_to_skip_first, bf_spec_t *spec, unsigned char *buffer, unsigned char *block_buffer)
+{
+  const unsigned int warm_nbr=(file_recovery_backup->data_check!=NULL ? 1000 : 100) + BF_CACHE_READAHEAD;
+  unsigned int spec_nbr=0;
+  unsigned int i;
+  int blocs_to_skip;
+  for(blocs_to_skip=blocs_to_skip_first;
+      blocs_to_skip<5000 && spec_nbr<bf_workers_nbr &&
+      blocs_to_skip < blocs_to_skip_first + 4 * (int)bf_workers_nbr;
+      blocs_to_skip++)
+  {
+    alloc_data_t *current_search_space=extractblock_search_space;
+    uint64_t offset=extrablock_offset;
+    if(bf_hypothesis_start(list_search_space, &current_search_space, &offset, blocs_to_skip, params->blocksize)<0)
+      break;
+    if(bf_hypothesis_reject(params, file_recovery_backup, list_search_space, current_search_space, offset, phase, prev_class))
+      continue;
+    /* The workers can't read the disk */
+    bf_cache_warm(params->disk, list_search_space, current_search_space, offset, warm_nbr);
+    spec[spec_nbr].blocs_to_skip=blocs_to_skip;
+    spec[spec_nbr].start_search_space=current_search_space;
+    spec[spec_nbr].start_offset=offset;
+    spec[spec_nbr].result.known=0;
+    spec[spec_nbr].pid=-1;
+    spec_nbr++;
+  }
+  fflush(file_recovery->handle);
+  log_flush();
+  for(i=0; i<spec_nbr; i++)
+  {
+    int fds[2];
+    if(pipe(fds)<0)
+      continue;
+    spec[i].pid=fork();
+    if(spec[i].pid==0)
+    {
+      close(fds[0]);
+      bf_spec_worker(params, file_recovery, file_recovery_backup, list_search_space, phase, file_offset, &spec[i], fds[1], buffer, block_buffer);
+    }
+    close(fds[1]);
+    spec[i].fd=fds[0];
+    if(spec[i].pid<0)
+      close(spec[i].fd);
+  }
+  for(i=0; i<spec_nbr; i++)
+  {
+    if(spec[i].pid>0)
+    {
+      bf_result_t result;
+      if(read(spec[i].fd, &result, sizeof(result))==(ssize_t)sizeof(result))
+	spec[i].result=result;
+      close(spec[i].fd);
+      waitpid(spec[i].pid, NULL, 0);
+    }
+  }
+  return spec_nbr;
+}
+
+static const bf_spec_t *bf_spec_find(const bf_spec_t *spec, const unsigned int spec_nbr, const int blocs_to_skip)
+{
+  unsigned int i;
+  for(i=0; i<spec_nbr; i++)
+    if(spec[i].blocs_to_skip==blocs_to_skip)
+      return &spec[i];
+  return NULL;
+}
+#endif
+
 static bf_status_t photorec_bf_frag_fast(struct ph_param *params, file_recovery_t *file_recovery, alloc_data_t *list_search_space, alloc_data_t *start_search_space, const int phase, alloc_data_t **current_search_space, uint64_t *offset, unsigned char *buffer, unsigned char *block_buffer, const unsigned int frag)
 {
   const unsigned int blocksize=params->blocksize;
@@ -512,6 +1183,7 @@ static bf_status_t photorec_bf_frag_fast(struct ph_param *params, file_recovery_
     *offset=start_search_space->start;
     file_recovery->checkpoint_status=0;
     file_recovery->checkpoint_offset=original_offset_ok/blocksize*blocksize;
+    file_recovery->checkpoint_resume=0;
     file_recovery->calculated_file_size=0;
     file_recovery->file_size=0;
     file_recovery->file_size_on_disk=0;
@@ -522,7 +1194,7 @@ static bf_status_t photorec_bf_frag_fast(struct ph_param *params, file_recovery_
       /* FIXME: Handle ext2/ext3 */
       if(file_recovery->data_check!=NULL)
       {
-	params->disk->pread(params->disk, block_buffer, blocksize, *offset);
+	bf_pread(params->disk, block_buffer, *offset);
 	file_recovery->data_check(buffer, 2*blocksize, file_recovery);
 	memcpy(buffer, block_buffer, blocksize);
       }
@@ -537,7 +1209,7 @@ static bf_status_t photorec_bf_frag_fast(struct ph_param *params, file_recovery_
     }
     for(k=original_offset_ok/blocksize+1; k<original_offset_error/blocksize; k++)
     {
-      params->disk->pread(params->disk, block_buffer, blocksize, *offset);
+      bf_pread(params->disk, block_buffer, *offset);
       if(file_recovery->data_check(buffer, 2*blocksize, file_recovery)!=1)
       {
 	/* TODO handle this problem */
@@ -618,9 +1290,17 @@ static bf_status_t photorec_bf_frag(struct ph_param *params, file_recovery_t *fi
     alloc_data_t *extractblock_search_space;
     uint64_t extrablock_offset;
     int blocs_to_skip;
+    bf_class_t prev_class=BF_CLASS_NONE;
     file_recovery_t file_recovery_backup;
+#ifdef BF_WORKERS
+    bf_spec_t spec[BF_WORKERS_MAX];
+    unsigned int spec_nbr=0;
+    /* Last hypothesis, rejected by a worker process */
+    const bf_spec_t *spec_last=NULL;
+#endif
     file_recovery->checkpoint_status=0;
     file_recovery->checkpoint_offset = file_offset;
+    file_recovery->checkpoint_resume=0;
     file_recovery->calculated_file_size=0;
     if(file_recovery->data_check!=NULL)
     {
@@ -630,7 +1310,7 @@ static bf_status_t photorec_bf_frag(struct ph_param *params, file_recovery_t *fi
 	  file_recovery->file_size < file_offset;
 	  file_recovery->file_size += blocksize)
       {
-	params->disk->pread(params->disk, block_buffer, blocksize, *offset);
+	bf_pread(params->disk, block_buffer, *offset);
 	/* FIXME: Handle ext2/ext3 */
 	file_recovery->data_check(buffer, 2*blocksize, file_recovery);
 	memcpy(buffer, block_buffer, blocksize);
@@ -655,6 +1335,8 @@ static bf_status_t photorec_bf_frag(struct ph_param *params, file_recovery_t *fi
     {
       const alloc_list_t *element=td_list_entry(file_recovery->location.list.prev, alloc_list_t, list);
       extrablock_offset=element->end/blocksize*blocksize;
+      if(element->data>0 && element->end+1 >= element->start+blocksize)
+	prev_class=bf_class(params->disk, element->end+1-blocksize);
     }
     /* Get the corresponding search_place */
     extractblock_search_space=td_list_entry(list_search_space->list.next, alloc_data_t, list);
@@ -685,6 +1367,9 @@ static bf_status_t photorec_bf_frag(struct ph_param *params, file_recovery_t *fi
 	memcpy(file_recovery, &file_recovery_backup, sizeof(file_recovery_backup));
 	*current_search_space=extractblock_search_space;
 	*offset=extrablock_offset;
+#ifdef BF_WORKERS
+	spec_last=NULL;
+#endif
 #ifdef DEBUG_BF
 	log_info("photorec_bf_aux %s split file at %llu, skip=%u\n",
 	    file_recovery->filename,
@@ -707,7 +1392,7 @@ static bf_status_t photorec_bf_frag(struct ph_param *params, file_recovery_t *fi
 	    if(ind_stop!=PSTATUS_OK)
 	    {
 	      file_recovery->flags=0;
-	      file_finish(file_recovery, params, list_search_space, current_search_space, offset);
+	      bf_file_finish(file_recovery, params, list_search_space, current_search_space, offset);
 	      log_info("photorec_bf_aux, user choose to stop\n");
 	      return BF_STOP;
 	    }
@@ -718,26 +1403,43 @@ static bf_status_t photorec_bf_frag(struct ph_param *params, file_recovery_t *fi
 	log_debug("Skip %u extra blocs\n", blocs_to_skip);
 #endif
 	//	log_info("%s Skip %u extra blocs\n", file_recovery->filename, blocs_to_skip);
-	if(blocs_to_skip < 0)
+	if(bf_hypothesis_start(list_search_space, current_search_space, offset, blocs_to_skip, blocksize)<0)
+	  return BF_ENOENT;
+	if(bf_hypothesis_reject(params, file_recovery, list_search_space, *current_search_space, *offset, phase, prev_class))
 	{
-	  int i;
-	  for(i=0; i< 2+blocs_to_skip; i++)
-	  {
-	    get_next_header(list_search_space, current_search_space, offset);
-	  }
+	  /* This block can't continue the file, same as an error at
+	   * file_offset for this hypothesis */
+	  file_recovery->offset_error=file_offset;
+	  bf_cache.skipped++;
+	  continue;
 	}
-	else
+#ifdef BF_WORKERS
+	if(bf_workers_nbr > 1 && bf_memfile!=NULL && bf_memfile->disk==NULL)
 	{
-	  int i;
-	  for(i=0; i<blocs_to_skip; i++)
+	  /* The hypotheses are still taken in the same order: only the
+	   * rejections come from the workers, any other result is
+	   * evaluated again below before being used */
+	  const bf_spec_t *hypothesis=bf_spec_find(spec, spec_nbr, blocs_to_skip);
+	  if(hypothesis==NULL)
 	  {
-	    get_next_sector(list_search_space, current_search_space, offset, blocksize);
-	    if(*current_search_space==list_search_space)
-	      return BF_ENOENT;
+	    spec_nbr=bf_spec_run(params, file_recovery, &file_recovery_backup, list_search_space, extractblock_search_space, extrablock_offset, phase, file_offset, prev_class, blocs_to_skip, spec, buffer, block_buffer);
+	    hypothesis=bf_spec_find(spec, spec_nbr, blocs_to_skip);
+	  }
+	  if(hypothesis!=NULL && hypothesis->result.known!=0 && hypothesis->result.res==BF_ENOENT)
+	  {
+	    file_recovery->offset_error=hypothesis->result.offset_error;
+	    bf_cache.parallel++;
+	    spec_last=hypothesis;
+	    continue;
 	  }
 	}
-
+#endif
 	res=photorec_bf_pad(params, file_recovery, list_search_space, phase, file_offset, current_search_space, offset, buffer, block_buffer);
+	/* The next hypotheses keep the data before file_offset, file_check
+	 * can resume from the checkpoint it has saved */
+	file_recovery_backup.checkpoint_status=file_recovery->checkpoint_status;
+	file_recovery_backup.checkpoint_resume=file_recovery->checkpoint_resume;
+	file_recovery_backup.checkpoint_tmp=file_recovery->checkpoint_tmp;
 	if(res==BF_FRAG_FOUND)
 	{
 	  if(frag>5)
@@ -769,6 +1471,18 @@ static bf_status_t photorec_bf_frag(struct ph_param *params, file_recovery_t *fi
 	    break;
 	}
       }
+#ifdef BF_WORKERS
+      if(spec_last!=NULL)
+      {
+	/* Leave the file as if the last hypothesis had been evaluated here */
+	memcpy(file_recovery, &file_recovery_backup, sizeof(file_recovery_backup));
+	*current_search_space=spec_last->start_search_space;
+	*offset=spec_last->start_offset;
+	file_recovery->offset_error=0;
+	list_truncate(&file_recovery->location,file_offset);
+	photorec_bf_pad(params, file_recovery, list_search_space, phase, file_offset, current_search_space, offset, buffer, block_buffer);
+      }
+#endif
       if(file_recovery->offset_error > 0 && file_recovery->offset_error < file_offset)
 	return BF_ERANGE;
     }
@@ -790,7 +1504,7 @@ static pstatus_t photorec_bf_aux(struct ph_param *params, file_recovery_t *file_
   alloc_data_t *current_search_space;
   const unsigned int blocksize=params->blocksize;
   //Init. of the brute force
-  file_recovery->handle=fopen(file_recovery->filename, "w+b");
+  file_recovery->handle=bf_fopen(file_recovery);
   if(file_recovery->handle==NULL)
   {
     log_critical("Brute Force : Cannot create file %s: %s\n", file_recovery->filename, strerror(errno));
@@ -815,7 +1529,7 @@ static pstatus_t photorec_bf_aux(struct ph_param *params, file_recovery_t *file_
       file_recovery->file_size + blocksize -1 < file_recovery->offset_error;
       file_recovery->file_size += blocksize)
   {
-    params->disk->pread(params->disk, block_buffer, blocksize, offset);
+    bf_pread(params->disk, block_buffer, offset);
     /* FIXME: Handle ext2/ext3 */
     if(fwrite(block_buffer, blocksize, 1, file_recovery->handle)<1)
     {
@@ -837,7 +1551,11 @@ static pstatus_t photorec_bf_aux(struct ph_param *params, file_recovery_t *file_
 #endif
   ind_stop=photorec_bf_frag(params, file_recovery, list_search_space, start_search_space, phase, &current_search_space, &offset, buffer, block_buffer, 0);
   /* Cleanup */
-  file_finish(file_recovery, params, list_search_space, &current_search_space, &offset);
+  {
+    const bf_status_t res=bf_file_finish(file_recovery, params, list_search_space, &current_search_space, &offset);
+    if(ind_stop!=BF_STOP && res!=BF_OK)
+      ind_stop=res;
+  }
   free(buffer);
   switch(ind_stop)
   {
@@ -77,6 +77,7 @@
 #include "ntfs_dir.h"
 #include "pdisksel.h"
 #include "dfxml.h"
+#include "sessionp.h"
 
 extern file_enable_t list_file_enable[];
 
@@ -108,6 +109,7 @@ int main( int argc, char **argv )
   list_disk_t *list_disk=NULL;
   list_disk_t *element_disk;
   const char *logfile="photorec.log";
+  const char *merge_file=NULL;
   FILE *log_handle=NULL;
   int log_errno=0;
   struct ph_options options={
@@ -116,6 +118,7 @@ int main( int argc, char **argv )
     .mode_ext2=0,
     .expert=0,
     .lowmem=0,
+    .header_index=0,
     .verbose=0,
     .list_file_format=list_file_enable
   };
@@ -124,6 +127,10 @@ int main( int argc, char **argv )
   params.cmd_device=NULL;
   params.cmd_run=NULL;
   params.carve_free_space_only=0;
+  params.range_file=NULL;
+  params.range_nbr=0;
+  params.range_start=0;
+  params.range_end=0;
   /* random (weak is ok) is need fot GPT */
   srand(time(NULL));
 #ifdef HAVE_SIGACTION
@@ -178,6 +185,10 @@ int main( int argc, char **argv )
         params.recup_dir=strdup(argv[i+1]);
       i++;
     }
+    else if(((strcmp(argv[i],"/merge")==0)||(strcmp(argv[i],"-merge")==0)) &&(i+1<argc))
+    {
+      merge_file=argv[++i];
+    }
     else if((strcmp(argv[i],"/all")==0) || (strcmp(argv[i],"-all")==0))
       testdisk_mode|=TESTDISK_O_ALL;
     else if((strcmp(argv[i],"/direct")==0) || (strcmp(argv[i],"-direct")==0))
@@ -238,10 +249,13 @@ int main( int argc, char **argv )
   if(help!=0)
   {
     printf("\nUsage: photorec [/log] [/debug] [/d recup_dir] [file.dd|file.e01|device]\n"\
+	"       photorec /merge range_file\n" \
 	"       photorec /version\n" \
         "\n" \
         "/log          : create a photorec.log file\n" \
         "/debug        : add debug information\n" \
+        "/merge        : report the files recovered by the processes sharing range_file,\n" \
+        "               list the duplicates found at the beginning of the ranges\n" \
         "\n" \
         "PhotoRec searches various file formats (JPEG, Office...), it stores them\n" \
         "in recup_dir directory.\n" \
@@ -270,6 +284,14 @@ int main( int argc, char **argv )
 #endif
   if(create_log!=TD_LOG_NONE && log_handle==NULL)
     log_handle=log_open_default(logfile, create_log, &log_errno);
+  if(merge_file!=NULL)
+  {
+    const int res=session_range_merge(merge_file);
+    log_close();
+    delete_list_disk(list_disk);
+    free(params.recup_dir);
+    return (res<0 ? 1 : 0);
+  }
 #ifdef HAVE_NCURSES
   /* ncurses need locale for correct unicode support */
   if(start_ncurses("PhotoRec", argv[0]))
@@ -389,6 +411,7 @@ int main( int argc, char **argv )
 #endif
   delete_list_disk(list_disk);
   free(params.recup_dir);
+  free(params.range_file);
 #ifdef ENABLE_DFXML
   xml_clear_command_line();
 #endif
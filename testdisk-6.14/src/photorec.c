@@ -54,6 +54,7 @@
 #include "log.h"
 #include "setdate.h"
 #include "dfxml.h"
+#include "sessionp.h"
 
 /* #define DEBUG_FILE_FINISH */
 /* #define DEBUG_UPDATE_SEARCH_SPACE */
@@ -152,6 +153,7 @@ static void update_search_space(const file_recovery_t *file_recovery, alloc_data
       {
 	const alloc_list_t *element=td_list_entry(tmp, alloc_list_t, list);
         uint64_t end=(element->end-(element->start%blocksize)+blocksize-1+1)/blocksize*blocksize+(element->start%blocksize)-1;
+        session_journal_del(element->start, end);
         update_search_space_aux(list_search_space, element->start, end, new_current_search_space, offset);
       }
       return ;
@@ -161,6 +163,7 @@ static void update_search_space(const file_recovery_t *file_recovery, alloc_data
 
 void del_search_space(alloc_data_t *list_search_space, const uint64_t start, const uint64_t end)
 {
+  session_journal_del(start, end);
   update_search_space_aux(list_search_space, start, end, NULL, NULL);
 }
 
@@ -393,6 +396,7 @@ void forget(alloc_data_t *list_search_space, alloc_data_t *current_search_space)
     {
       alloc_data_t *tmp;
       tmp=td_list_entry(search_walker, alloc_data_t, list);
+      session_journal_del(tmp->start, tmp->end);
       td_list_del(&tmp->list);
       free(tmp);
     }
@@ -540,9 +544,12 @@ void update_blocksize(unsigned int blocksize, alloc_data_t *list_search_space, c
       current_search_space->file_stat=NULL;
     if(current_search_space->start>=current_search_space->end)
     {
+      session_journal_del(old_start, current_search_space->end);
       td_list_del(search_walker);
       free(current_search_space);
     }
+    else if(current_search_space->start!=old_start)
+      session_journal_del(old_start, current_search_space->start-1);
   }
 }
 
@@ -612,6 +619,8 @@ static void file_finish_aux(file_recovery_t *file_recovery, struct ph_param *par
       set_date(file_recovery->filename, file_recovery->time, file_recovery->time);
     if(file_recovery->file_rename!=NULL)
       file_recovery->file_rename(file_recovery->filename);
+    session_journal_file(file_recovery);
+    session_range_file(file_recovery);
     if((++params->file_nbr)%MAX_FILES_PER_DIR==0)
     {
       params->dir_num=photorec_mkdir(params->recup_dir, params->dir_num+1);
@@ -795,6 +804,7 @@ static alloc_data_t *file_truncate_aux(alloc_data_t *space, alloc_data_t *file,
       {
 	size+=len;
 	log_info(" %lu-%lu", (unsigned long)(element->start/sector_size), (unsigned long)(element->end/sector_size));
+	session_journal_del(element->start, element->end);
 	td_list_del(tmp);
 	free(element);
       }
@@ -803,6 +813,7 @@ static alloc_data_t *file_truncate_aux(alloc_data_t *space, alloc_data_t *file,
 	log_info(" %lu-%lu",
 	    (unsigned long)(element->start/sector_size),
 	    (unsigned long)((element->start + file_size_on_disk - size - 1)/sector_size));
+	session_journal_del(element->start, element->start + file_size_on_disk - size - 1);
 	element->start+=file_size_on_disk - size;
 	element->file_stat=NULL;
 	element->data=1;
@@ -812,6 +823,7 @@ static alloc_data_t *file_truncate_aux(alloc_data_t *space, alloc_data_t *file,
     else
     {
       log_info(" (%lu-%lu)", (unsigned long)(element->start/sector_size), (unsigned long)(element->end/sector_size));
+      session_journal_del(element->start, element->end);
       td_list_del(tmp);
       free(element);
     }
@@ -40,6 +40,7 @@ struct ph_options
   unsigned int mode_ext2;
   unsigned int expert;
   unsigned int lowmem;
+  unsigned int header_index;
   int verbose;
   file_enable_t *list_file_format;
 };
@@ -61,6 +62,11 @@ struct ph_param
   unsigned int file_nbr;
   file_stat_t *file_stats;
   uint64_t offset;
+  /* Range of the search space shared between several processes */
+  char *range_file;
+  unsigned int range_nbr;
+  uint64_t range_start;
+  uint64_t range_end;
 };
 
 int get_prev_file_header(alloc_data_t *list_search_space, alloc_data_t **current_search_space, uint64_t *offset);
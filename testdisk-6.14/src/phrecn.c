@@ -67,6 +67,7 @@
 #include "log.h"
 #include "log_part.h"
 #include "file_tar.h"
+#include "file_jpg.h"
 #include "phcfg.h"
 #include "pblocksize.h"
 #include "askloc.h"
@@ -335,7 +336,9 @@ int photorec(struct ph_param *params, const struct ph_options *options, alloc_da
 {
   pstatus_t ind_stop=PSTATUS_OK;
   const unsigned int blocksize_is_known=params->blocksize;
+  unsigned int first_dir_num;
   params_reset(params, options);
+  jpg_stream_enable(options->paranoid>0);
   if(params->cmd_run!=NULL && params->cmd_run[0]!='\0')
   {
     while(params->cmd_run[0]==',')
@@ -396,6 +399,7 @@ int photorec(struct ph_param *params, const struct ph_options *options, alloc_da
 
   /* make the first recup_dir */
   params->dir_num=photorec_mkdir(params->recup_dir, params->dir_num);
+  first_dir_num=params->dir_num;
 
 #ifdef ENABLE_DFXML
   /* Open the XML output file */
@@ -455,6 +459,9 @@ int photorec(struct ph_param *params, const struct ph_options *options, alloc_da
 	break;
       default:
 	ind_stop=photorec_aux(params, options, list_search_space);
+	/* The files beginning after the range are left to the process recovering the next range */
+	if(params->range_end > 0)
+	  del_search_space(list_search_space, params->range_end, params->disk->disk_size-1);
 	break;
     }
     session_save(list_search_space, params, options);
@@ -517,7 +524,7 @@ int photorec(struct ph_param *params, const struct ph_options *options, alloc_da
       case PSTATUS_OK:
 	status_inc(params, options);
 	if(params->status==STATUS_QUIT)
-	  unlink("photorec.ses");
+	  session_remove();
 	break;
     }
     {
@@ -580,9 +587,20 @@ int photorec(struct ph_param *params, const struct ph_options *options, alloc_da
   if(params->cmd_run==NULL)
     recovery_finished(params->disk, params->partition, params->file_nbr, params->recup_dir, ind_stop);
 #endif
+  if(params->range_file!=NULL)
+  {
+    if(ind_stop==PSTATUS_OK)
+      session_range_done(params, first_dir_num);
+    else
+    { /* Interrupted, the range stays marked as running, don't take another one */
+      free(params->range_file);
+      params->range_file=NULL;
+    }
+  }
   free(params->file_stats);
   params->file_stats=NULL;
   free_header_check();
+  header_index_free();
 #ifdef ENABLE_DFXML
   xml_shutdown();
   xml_close();
@@ -593,7 +611,7 @@ int photorec(struct ph_param *params, const struct ph_options *options, alloc_da
 #ifdef HAVE_NCURSES
 void interface_options_photorec_ncurses(struct ph_options *options)
 {
-  unsigned int menu = 5;
+  unsigned int menu = 6;
   struct MenuItem menuOptions[]=
   {
     { 'P', NULL, "Check JPG files" },
@@ -601,6 +619,7 @@ void interface_options_photorec_ncurses(struct ph_options *options)
     { 'S',NULL,"Try to skip indirect block"},
     { 'E',NULL,"Provide additional controls"},
     { 'L',NULL,"Low memory"},
+    { 'I',NULL,"Index the headers before carving"},
     { 'Q',"Quit","Return to main menu"},
     { 0, NULL, NULL }
   };
@@ -624,8 +643,9 @@ void interface_options_photorec_ncurses(struct ph_options *options)
     menuOptions[2].name=options->mode_ext2?"ext2/ext3 mode: Yes":"ext2/ext3 mode : No";
     menuOptions[3].name=options->expert?"Expert mode : Yes":"Expert mode : No";
     menuOptions[4].name=options->lowmem?"Low memory: Yes":"Low memory: No";
+    menuOptions[5].name=options->header_index?"Header index: Yes":"Header index: No";
     aff_copy(stdscr);
-    car=wmenuSelect_ext(stdscr, 23, INTER_OPTION_Y, INTER_OPTION_X, menuOptions, 0, "PKELQ", MENU_VERT|MENU_VERT_ARROW2VALID, &menu,&real_key);
+    car=wmenuSelect_ext(stdscr, 23, INTER_OPTION_Y, INTER_OPTION_X, menuOptions, 0, "PKELIQ", MENU_VERT|MENU_VERT_ARROW2VALID, &menu,&real_key);
     switch(car)
     {
       case 'p':
@@ -651,6 +671,10 @@ void interface_options_photorec_ncurses(struct ph_options *options)
       case 'L':
 	options->lowmem=!options->lowmem;
 	break;
+      case 'i':
+      case 'I':
+	options->header_index=!options->header_index;
+	break;
       case key_ESC:
       case 'q':
       case 'Q':
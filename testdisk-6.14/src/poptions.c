@@ -87,6 +87,12 @@ void interface_options_photorec_cli(struct ph_options *options, char **current_c
       (*current_cmd)+=6;
       options->lowmem=1;
     }
+    /* header_index */
+    else if(strncmp(*current_cmd,"header_index",12)==0)
+    {
+      (*current_cmd)+=12;
+      options->header_index=1;
+    }
     else
     {
       interface_options_photorec_log(options);
@@ -100,9 +106,10 @@ void interface_options_photorec_log(const struct ph_options *options)
   /* write new options to log file */
   log_info("New options :\n Paranoid : %s\n", options->paranoid?"Yes":"No");
   log_info(" Brute force : %s\n", ((options->paranoid)>1?"Yes":"No"));
-  log_info(" Keep corrupted files : %s\n ext2/ext3 mode : %s\n Expert mode : %s\n Low memory : %s\n",
+  log_info(" Keep corrupted files : %s\n ext2/ext3 mode : %s\n Expert mode : %s\n Low memory : %s\n Header index : %s\n",
       options->keep_corrupted_file?"Yes":"No",
       options->mode_ext2?"Yes":"No",
       options->expert?"Yes":"No",
-      options->lowmem?"Yes":"No");
+      options->lowmem?"Yes":"No",
+      options->header_index?"Yes":"No");
 }
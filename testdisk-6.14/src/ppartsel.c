@@ -54,6 +54,7 @@
 #include "addpartn.h"
 #include "intrfn.h"
 #include "poptions.h"
+#include "sessionp.h"
 
 extern const arch_fnct_t arch_none;
 
@@ -159,17 +160,47 @@ void menu_photorec(struct ph_param *params, struct ph_options *options, alloc_da
 	    if(params->blocksize==0)
 	      display_message("Not a valid ext2/ext3/ext4 filesystem");
 	  }
-	  if(td_list_empty(&list_search_space->list))
 	  {
-	    init_search_space(list_search_space, params->disk, params->partition);
-	  }
-	  if(params->carve_free_space_only>0)
-	  {
-	    params->blocksize=remove_used_space(params->disk, params->partition, list_search_space);
+	    const unsigned int blocksize=params->blocksize;
+	    do
+	    {
+	      char *resume_cmd=NULL;
+	      /* Don't reuse the block size found for the previous range */
+	      params->blocksize=blocksize;
+	      if(td_list_empty(&list_search_space->list))
+	      {
+		init_search_space(list_search_space, params->disk, params->partition);
+	      }
+	      if(params->carve_free_space_only>0)
+	      {
+		params->blocksize=remove_used_space(params->disk, params->partition, list_search_space);
+	      }
+	      if(params->range_file!=NULL)
+	      {
+		/* Only recover the files beginning in the range */
+		if(session_range_claim(params, list_search_space, &resume_cmd) < 0)
+		{
+		  free_search_space(list_search_space);
+		  break;
+		}
+		if(params->range_start > 0)
+		  del_search_space(list_search_space, 0, params->range_start-1);
+	      }
+	      if(user_blocksize > 0)
+		params->blocksize=user_blocksize;
+	      if(resume_cmd!=NULL)
+	      {
+		/* Continue the interrupted recovery of the range */
+		char *cmd_run=params->cmd_run;
+		params->cmd_run=resume_cmd;
+		photorec(params, options, list_search_space);
+		params->cmd_run=cmd_run;
+		free(resume_cmd);
+	      }
+	      else
+		photorec(params, options, list_search_space);
+	    } while(params->range_file!=NULL);
 	  }
-	  if(user_blocksize > 0)
-	    params->blocksize=user_blocksize;
-	  photorec(params, options, list_search_space);
 	}
       }
       else if(strncmp(params->cmd_run,"options",7)==0)
@@ -208,6 +239,24 @@ void menu_photorec(struct ph_param *params, struct ph_options *options, alloc_da
 	params->cmd_run+=9;
 	params->carve_free_space_only=1;
       }
+      else if(strncmp(params->cmd_run,"ranges,",7)==0)
+      {
+	/* ranges,nbr,range_file */
+	const char *range_file;
+	params->cmd_run+=7;
+	params->range_nbr=atoi(params->cmd_run);
+	while(params->cmd_run[0]!=',' && params->cmd_run[0]!='\0')
+	  params->cmd_run++;
+	if(params->cmd_run[0]==',')
+	  params->cmd_run++;
+	range_file=params->cmd_run;
+	while(params->cmd_run[0]!=',' && params->cmd_run[0]!='\0')
+	  params->cmd_run++;
+	free(params->range_file);
+	params->range_file=(char *)MALLOC(params->cmd_run - range_file + 1);
+	memcpy(params->range_file, range_file, params->cmd_run - range_file);
+	params->range_file[params->cmd_run - range_file]='\0';
+      }
       else if(strncmp(params->cmd_run,"ext2_group,",11)==0)
       {
 	unsigned int groupnr;
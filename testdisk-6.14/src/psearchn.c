@@ -47,6 +47,9 @@
 #include <stdarg.h>
 #include <winbase.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include "types.h"
 #include "common.h"
 #include "intrf.h"
@@ -107,6 +110,510 @@ static FILE *fopen_with_retry(const char *path, const char *mode)
 }
 #endif
 
+/* Entry of the header index built by the first phase, sorted by offset */
+typedef struct
+{
+  uint64_t offset;
+  file_stat_t *file_stat;
+  uint64_t size_hint;	/* file size given by the header (data_check_size), 0 if unknown */
+} header_index_entry_t;
+
+typedef struct
+{
+  header_index_entry_t *entries;
+  unsigned int nbr;
+  unsigned int max;
+} header_index_t;
+
+/* The index is built once per recovery and used by all the passes: the
+ * files recovered by a pass only remove blocks from the search space */
+static header_index_t run_header_index={ NULL, 0, 0 };
+static unsigned int header_index_blocksize=0;
+
+static file_stat_t *header_check_all(const unsigned char *buffer, const unsigned int read_size, const file_recovery_t *file_recovery, file_recovery_t *file_recovery_new)
+{
+  struct td_list_head *tmpl;
+  td_list_for_each(tmpl, &file_check_list.list)
+  {
+    struct td_list_head *tmp;
+    const file_check_list_t *pos=td_list_entry(tmpl, file_check_list_t, list);
+    td_list_for_each(tmp, &pos->file_checks[buffer[pos->offset]].list)
+    {
+      const file_check_t *file_check=td_list_entry(tmp, file_check_t, list);
+      if((file_check->length==0 || memcmp(buffer + file_check->offset, file_check->value, file_check->length)==0) &&
+	  file_check->header_check(buffer, read_size, 0, file_recovery, file_recovery_new)!=0)
+	return file_check->file_stat;
+    }
+  }
+  return NULL;
+}
+
+static void header_index_add(header_index_t *header_index, const uint64_t offset, file_stat_t *file_stat, const uint64_t size_hint)
+{
+  header_index_entry_t *entry;
+  if(header_index->nbr==header_index->max)
+  {
+    header_index->max=(header_index->max==0 ? 4096 : header_index->max*2);
+    header_index->entries=(header_index_entry_t *)realloc(header_index->entries, header_index->max * sizeof(header_index_entry_t));
+    if(header_index->entries==NULL)
+    {
+      log_critical("psearchn.c: memory allocation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  entry=&header_index->entries[header_index->nbr++];
+  entry->offset=offset;
+  entry->file_stat=file_stat;
+  entry->size_hint=size_hint;
+}
+
+/* The carving of a file using data_check_size() stops at this size */
+static uint64_t header_index_size_hint(const file_recovery_t *file_recovery_new)
+{
+  if(file_recovery_new->data_check==&data_check_size)
+    return file_recovery_new->calculated_file_size;
+  return 0;
+}
+
+/* Returns the first entry at or after offset */
+static header_index_entry_t *header_index_next(const header_index_t *header_index, const uint64_t offset)
+{
+  unsigned int low=0;
+  unsigned int high=header_index->nbr;
+  while(low < high)
+  {
+    const unsigned int mid=low+(high-low)/2;
+    if(header_index->entries[mid].offset < offset)
+      low=mid+1;
+    else
+      high=mid;
+  }
+  if(low < header_index->nbr)
+    return &header_index->entries[low];
+  return NULL;
+}
+
+static header_index_entry_t *header_index_find(const header_index_t *header_index, const uint64_t offset)
+{
+  header_index_entry_t *entry=header_index_next(header_index, offset);
+  if(entry!=NULL && entry->offset==offset)
+    return entry;
+  return NULL;
+}
+
+/* During the first phase, the main thread reads the search space
+ * sequentially in chunks and displays the progress. The filled chunks are
+ * checked by a pool of threads, each chunk has its own index; the indexes
+ * are concatenated in order once all chunks have been checked. A chunk is
+ * read with the data following it, so a header near the end of a chunk is
+ * checked like anywhere else and the result doesn't depend on the chunk
+ * size. */
+#define HEADER_INDEX_CHUNK_SIZE (4*1024*1024)
+#define HEADER_INDEX_MAX_THREADS 16
+
+typedef struct
+{
+  uint64_t start;
+  uint64_t end;
+  header_index_t header_index;
+} header_index_chunk_t;
+
+typedef struct
+{
+  unsigned char *buffer;
+  header_index_chunk_t *chunk;	/* NULL if the buffer is free */
+  int checking;
+} header_index_slot_t;
+
+typedef struct
+{
+  header_index_chunk_t *chunks;
+  unsigned int chunks_nbr;
+  header_index_slot_t *slots;
+  unsigned int slots_nbr;
+  unsigned int threads_nbr;	/* 0 if the chunks are checked by the main thread */
+  unsigned int blocksize;
+  unsigned int read_size;
+  int reading_done;
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+} header_index_work_t;
+
+/* Only record the blocks where a known header is found */
+static void header_index_check_chunk(const header_index_work_t *work, header_index_chunk_t *chunk, const unsigned char *buffer)
+{
+  const unsigned int blocksize=work->blocksize;
+  uint64_t offset;
+  file_recovery_t file_recovery;
+  memset(&file_recovery, 0, sizeof(file_recovery));
+  reset_file_recovery(&file_recovery);
+  file_recovery.blocksize=blocksize;
+  for(offset=chunk->start; offset<=chunk->end; offset+=blocksize)
+  {
+    file_recovery_t file_recovery_new;
+    file_stat_t *file_stat;
+    file_recovery_new.blocksize=blocksize;
+    file_stat=header_check_all(&buffer[offset-chunk->start], work->read_size, &file_recovery, &file_recovery_new);
+    if(file_stat!=NULL && file_stat->file_hint!=NULL)
+      header_index_add(&chunk->header_index, offset, file_stat, header_index_size_hint(&file_recovery_new));
+    if(offset + blocksize > chunk->end)
+      break;
+  }
+}
+
+#ifdef HAVE_PTHREAD
+static void *header_index_worker(void *arg)
+{
+  header_index_work_t *work=(header_index_work_t *)arg;
+  pthread_mutex_lock(&work->mutex);
+  while(1)
+  {
+    header_index_slot_t *slot=NULL;
+    unsigned int i;
+    for(i=0; i<work->slots_nbr && slot==NULL; i++)
+      if(work->slots[i].chunk!=NULL && work->slots[i].checking==0)
+	slot=&work->slots[i];
+    if(slot!=NULL)
+    {
+      slot->checking=1;
+      pthread_mutex_unlock(&work->mutex);
+      header_index_check_chunk(work, slot->chunk, slot->buffer);
+      pthread_mutex_lock(&work->mutex);
+      slot->chunk=NULL;
+      slot->checking=0;
+      pthread_cond_broadcast(&work->cond);
+    }
+    else if(work->reading_done>0)
+      break;
+    else
+      pthread_cond_wait(&work->cond, &work->mutex);
+  }
+  pthread_mutex_unlock(&work->mutex);
+  return NULL;
+}
+
+static header_index_slot_t *header_index_free_slot(header_index_work_t *work)
+{
+  header_index_slot_t *slot=NULL;
+  pthread_mutex_lock(&work->mutex);
+  while(slot==NULL)
+  {
+    unsigned int i;
+    for(i=0; i<work->slots_nbr && slot==NULL; i++)
+      if(work->slots[i].chunk==NULL)
+	slot=&work->slots[i];
+    if(slot==NULL)
+      pthread_cond_wait(&work->cond, &work->mutex);
+  }
+  pthread_mutex_unlock(&work->mutex);
+  return slot;
+}
+#endif
+
+#ifdef HAVE_NCURSES
+static pstatus_t header_index_progressbar(const struct ph_param *params, const uint64_t offset, const time_t current_time)
+{
+  const partition_t *partition=params->partition;
+  const unsigned int sector_size=params->disk->sector_size;
+  wmove(stdscr,9,0);
+  wclrtoeol(stdscr);
+  wprintw(stdscr,"Header index - Reading sector %10llu/%llu\n",
+      (unsigned long long)((offset-partition->part_offset)/sector_size),
+      (unsigned long long)(partition->part_size/sector_size));
+  wmove(stdscr,10,0);
+  wclrtoeol(stdscr);
+  if(current_time > params->real_start_time)
+  {
+    const time_t elapsed_time=current_time - params->real_start_time;
+    wprintw(stdscr,"Elapsed time %uh%02um%02us",
+	(unsigned)(elapsed_time/60/60),
+	(unsigned)(elapsed_time/60%60),
+	(unsigned)(elapsed_time%60));
+  }
+  wrefresh(stdscr);
+  return(check_enter_key_or_s(stdscr)==0?PSTATUS_OK:PSTATUS_STOP);
+}
+#endif
+
+/* Read the chunks in order. Without checking thread, each chunk is checked
+ * as soon as it has been read. */
+static pstatus_t header_index_read(header_index_work_t *work, const struct ph_param *params)
+{
+  disk_t *disk=params->disk;
+  time_t previous_time=time(NULL);
+  pstatus_t ind_stop=PSTATUS_OK;
+  unsigned int i;
+  for(i=0; i<work->chunks_nbr && ind_stop==PSTATUS_OK; i++)
+  {
+    header_index_chunk_t *chunk=&work->chunks[i];
+    header_index_slot_t *slot=&work->slots[0];
+    const time_t current_time=time(NULL);
+#ifdef HAVE_PTHREAD
+    if(work->threads_nbr > 0)
+      slot=header_index_free_slot(work);
+#endif
+    {
+      /* Keep the reads small enough for the disk cache read-ahead */
+      const uint64_t size=chunk->end - chunk->start + work->read_size;
+      uint64_t pos;
+      for(pos=0; pos < size; pos+=READ_SIZE)
+	disk->pread(disk, slot->buffer + pos, (size - pos < READ_SIZE ? size - pos : READ_SIZE), chunk->start + pos);
+    }
+#ifdef HAVE_PTHREAD
+    if(work->threads_nbr > 0)
+    {
+      pthread_mutex_lock(&work->mutex);
+      slot->chunk=chunk;
+      pthread_cond_broadcast(&work->cond);
+      pthread_mutex_unlock(&work->mutex);
+    }
+    else
+#endif
+      header_index_check_chunk(work, chunk, slot->buffer);
+    if(current_time > previous_time)
+    {
+      previous_time=current_time;
+#ifdef HAVE_NCURSES
+      ind_stop=header_index_progressbar(params, chunk->end, current_time);
+#endif
+    }
+  }
+#ifdef HAVE_PTHREAD
+  if(work->threads_nbr > 0)
+  {
+    pthread_mutex_lock(&work->mutex);
+    work->reading_done=1;
+    pthread_cond_broadcast(&work->cond);
+    pthread_mutex_unlock(&work->mutex);
+  }
+#endif
+  return ind_stop;
+}
+
+/* Returns the number of checking threads, 0 if the chunks are checked by
+ * the main thread */
+static unsigned int header_index_threads(const unsigned int chunks_nbr)
+{
+  unsigned int threads_nbr=0;
+#if defined(HAVE_PTHREAD) && defined(_SC_NPROCESSORS_ONLN)
+  {
+    const long cpu_nbr=sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpu_nbr > 1 && chunks_nbr > 1)
+      threads_nbr=(cpu_nbr < HEADER_INDEX_MAX_THREADS ? cpu_nbr : HEADER_INDEX_MAX_THREADS);
+  }
+#endif
+  return (threads_nbr < chunks_nbr ? threads_nbr : chunks_nbr);
+}
+
+static uint64_t header_index_end(const struct ph_param *params, const alloc_data_t *current_search_space)
+{
+  if(params->range_end > 0 && current_search_space->end >= params->range_end)
+  {
+    /* returns a value lower than start if the whole space is after the range */
+    if(current_search_space->start >= params->range_end)
+      return 0;
+    return params->range_end - 1;
+  }
+  return current_search_space->end;
+}
+
+/* Returns PSTATUS_STOP if the user has stopped the first phase, the index
+ * is then left empty */
+static pstatus_t header_index_build(header_index_t *header_index, struct ph_param *params, const struct ph_options *options, alloc_data_t *list_search_space, const unsigned int read_size)
+{
+  struct td_list_head *search_walker;
+  const time_t start_time=time(NULL);
+  const uint64_t chunk_size=(HEADER_INDEX_CHUNK_SIZE > params->blocksize ?
+      HEADER_INDEX_CHUNK_SIZE / params->blocksize * params->blocksize : params->blocksize);
+  unsigned int threads_nbr;
+  unsigned int i;
+  pstatus_t ind_stop;
+  header_index_work_t work;
+  work.chunks=NULL;
+  work.chunks_nbr=0;
+  work.blocksize=params->blocksize;
+  work.read_size=read_size;
+  work.reading_done=0;
+  /* Split the search space, keep the chunks aligned on the blocks.
+   * Blocks after the range aren't indexed, their headers are always checked */
+  td_list_for_each(search_walker, &list_search_space->list)
+  {
+    const alloc_data_t *current_search_space=td_list_entry(search_walker, alloc_data_t, list);
+    const uint64_t end=header_index_end(params, current_search_space);
+    if(current_search_space->start <= end)
+      work.chunks_nbr+=(end - current_search_space->start) / chunk_size + 1;
+  }
+  if(work.chunks_nbr==0)
+    return PSTATUS_OK;
+  work.chunks=(header_index_chunk_t *)MALLOC(work.chunks_nbr * sizeof(header_index_chunk_t));
+  i=0;
+  td_list_for_each(search_walker, &list_search_space->list)
+  {
+    const alloc_data_t *current_search_space=td_list_entry(search_walker, alloc_data_t, list);
+    const uint64_t end=header_index_end(params, current_search_space);
+    uint64_t start;
+    for(start=current_search_space->start; start <= end; start+=chunk_size)
+    {
+      header_index_chunk_t *chunk=&work.chunks[i++];
+      chunk->start=start;
+      chunk->end=(end - start >= chunk_size ? start + chunk_size - 1 : end);
+      chunk->header_index.entries=NULL;
+      chunk->header_index.nbr=0;
+      chunk->header_index.max=0;
+      if(end - start < chunk_size)
+	break;
+    }
+  }
+  threads_nbr=header_index_threads(work.chunks_nbr);
+  /* Two buffers per thread: one is checked while the next one is read */
+  work.slots_nbr=(threads_nbr > 0 ? 2 * threads_nbr : 1);
+  work.slots=(header_index_slot_t *)MALLOC(work.slots_nbr * sizeof(header_index_slot_t));
+  for(i=0; i<work.slots_nbr; i++)
+  {
+    work.slots[i].buffer=(unsigned char *)MALLOC(chunk_size + read_size);
+    work.slots[i].chunk=NULL;
+    work.slots[i].checking=0;
+  }
+#ifdef HAVE_PTHREAD
+  if(threads_nbr > 0)
+  {
+    pthread_t threads[HEADER_INDEX_MAX_THREADS];
+    unsigned int threads_ok;
+    pthread_mutex_init(&work.mutex, NULL);
+    pthread_cond_init(&work.cond, NULL);
+    for(threads_ok=0; threads_ok<threads_nbr; threads_ok++)
+      if(pthread_create(&threads[threads_ok], NULL, &header_index_worker, &work)!=0)
+	break;
+    threads_nbr=threads_ok;
+    work.threads_nbr=threads_nbr;
+    ind_stop=header_index_read(&work, params);
+    for(i=0; i<threads_nbr; i++)
+      pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&work.cond);
+    pthread_mutex_destroy(&work.mutex);
+  }
+  else
+#endif
+  {
+    work.threads_nbr=0;
+    ind_stop=header_index_read(&work, params);
+  }
+  for(i=0; i<work.slots_nbr; i++)
+    free(work.slots[i].buffer);
+  free(work.slots);
+  /* Merge the indexes of the chunks */
+  for(i=0; i<work.chunks_nbr; i++)
+  {
+    const header_index_t *chunk_index=&work.chunks[i].header_index;
+    unsigned int j;
+    for(j=0; j<chunk_index->nbr; j++)
+      header_index_add(header_index, chunk_index->entries[j].offset,
+	  chunk_index->entries[j].file_stat, chunk_index->entries[j].size_hint);
+    free(chunk_index->entries);
+  }
+  free(work.chunks);
+  if(ind_stop!=PSTATUS_OK)
+  {
+    log_info("Header index: stopped\n");
+    free(header_index->entries);
+    header_index->entries=NULL;
+    header_index->nbr=0;
+    header_index->max=0;
+    return ind_stop;
+  }
+  log_info("Header index: %u headers found in %lu sec (%u chunks, %u checking threads)\n",
+      header_index->nbr, (unsigned long)(time(NULL) - start_time),
+      work.chunks_nbr, threads_nbr);
+  if(options->verbose > 1)
+  {
+    for(i=0; i<header_index->nbr; i++)
+    {
+      const header_index_entry_t *entry=&header_index->entries[i];
+      log_verbose("%s header at sector %llu, size %llu\n",
+	  entry->file_stat->file_hint->extension,
+	  (unsigned long long)((entry->offset-params->partition->part_offset)/params->disk->sector_size),
+	  (unsigned long long)entry->size_hint);
+    }
+  }
+  return PSTATUS_OK;
+}
+
+void header_index_free(void)
+{
+  free(run_header_index.entries);
+  run_header_index.entries=NULL;
+  run_header_index.nbr=0;
+  run_header_index.max=0;
+  header_index_blocksize=0;
+}
+
+/* No file is being recovered: go to the next block where a header has
+ * been found during the first phase, the blocks before it would only be
+ * read to be skipped */
+static void header_index_skip(const header_index_t *header_index, const struct ph_param *params, alloc_data_t *list_search_space, alloc_data_t **current_search_space, uint64_t *offset)
+{
+  while(*current_search_space!=list_search_space)
+  {
+    const header_index_entry_t *entry;
+    uint64_t next;
+    /* Blocks after the range aren't indexed */
+    if(params->range_end > 0 && *offset >= params->range_end)
+      return ;
+    entry=header_index_next(header_index, *offset);
+    if(entry!=NULL)
+      next=entry->offset;
+    else if(params->range_end > 0)
+      next=params->range_end;
+    else
+    {
+      *current_search_space=list_search_space;
+      return ;
+    }
+    if(params->range_end > 0 && next > params->range_end)
+      next=params->range_end;
+    if(next <= (*current_search_space)->end)
+    {
+      *offset=next;
+      return ;
+    }
+    *current_search_space=td_list_entry((*current_search_space)->list.next, alloc_data_t, list);
+    *offset=(*current_search_space)->start;
+  }
+}
+
+/* get_prev_file_header() has found the header of a file that hasn't been
+ * recovered at prev_offset. If the header gives the file size and the
+ * blocks of the file end before the first block of the file just
+ * recovered, nothing has changed for this file: reading it again would give
+ * the same result.
+ * The blocks are counted along the search space like get_next_sector():
+ * the files already recovered after prev_offset have left holes. When ext2
+ * indirect blocks are skipped, the number of blocks isn't known. */
+static int header_index_need_back(const header_index_t *header_index, const struct ph_param *params, const alloc_data_t *list_search_space, const alloc_data_t *prev_search_space, const uint64_t prev_offset, const uint64_t recovered_start)
+{
+  const unsigned int blocksize=params->blocksize;
+  const header_index_entry_t *entry=header_index_find(header_index, prev_offset);
+  const alloc_data_t *current_search_space=prev_search_space;
+  uint64_t offset=prev_offset;
+  uint64_t blocks;
+  if(entry==NULL || entry->size_hint==0 ||
+      params->status==STATUS_EXT2_ON || params->status==STATUS_EXT2_ON_SAVE_EVERYTHING)
+    return 1;
+  blocks=(entry->size_hint + blocksize - 1) / blocksize;
+  while(current_search_space!=list_search_space && offset < recovered_start)
+  {
+    const uint64_t available=(current_search_space->end - offset) / blocksize + 1;
+    if(blocks <= available)
+      return (offset + (blocks - 1) * blocksize >= recovered_start);
+    blocks-=available;
+    current_search_space=td_list_entry_const(current_search_space->list.next, const alloc_data_t, list);
+    offset=current_search_space->start;
+  }
+  return 1;
+}
+
 pstatus_t photorec_aux(struct ph_param *params, const struct ph_options *options, alloc_data_t *list_search_space)
 {
   uint64_t offset;
@@ -121,7 +628,10 @@ pstatus_t photorec_aux(struct ph_param *params, const struct ph_options *options
   const unsigned int blocksize=params->blocksize; 
   const unsigned int read_size=(blocksize>65536?blocksize:65536);
   uint64_t offset_before_back=0;
+  uint64_t recovered_start=0;
   unsigned int back=0;
+  int range_done=0;
+  int range_crossed=0;
   alloc_data_t *current_search_space;
   file_recovery_t file_recovery;
   memset(&file_recovery, 0, sizeof(file_recovery));
@@ -137,6 +647,19 @@ pstatus_t photorec_aux(struct ph_param *params, const struct ph_options *options
   memset(buffer_olddata,0,blocksize);
   current_search_space=td_list_entry(list_search_space->list.next, alloc_data_t, list);
   offset=set_search_start(params, &current_search_space, list_search_space);
+  if(options->header_index>0 && header_index_blocksize!=blocksize)
+  {
+    header_index_free();
+    ind_stop=header_index_build(&run_header_index, params, options, list_search_space, read_size);
+    if(ind_stop==PSTATUS_OK)
+      header_index_blocksize=blocksize;
+    else
+    {
+      /* Resume at the same place */
+      params->offset=offset;
+      current_search_space=list_search_space;
+    }
+  }
   if(options->verbose > 0)
     info_list_search_space(list_search_space, current_search_space, params->disk->sector_size, 0, options->verbose);
   if(options->verbose > 1)
@@ -163,6 +686,12 @@ pstatus_t photorec_aux(struct ph_param *params, const struct ph_options *options
       exit(1);
     }
 #endif
+    if(range_done>0 && file_recovery.file_stat==NULL)
+    { /* The next files are recovered by the process working on the next range */
+      break;
+    }
+    if(params->range_end > 0 && offset >= params->range_end)
+      range_crossed=1;
     {
       file_recovery_t file_recovery_new;
       file_recovery_new.blocksize=blocksize;
@@ -180,41 +709,43 @@ pstatus_t photorec_aux(struct ph_param *params, const struct ph_options *options
               (unsigned long)((offset-params->partition->part_offset)/params->disk->sector_size));
         }
       }
+      else if(options->header_index>0 &&
+	  (params->range_end==0 || offset < params->range_end) &&
+	  header_index_find(&run_header_index, offset)==NULL)
+      { /* No header has been found here during the first phase */
+      }
       else
       {
-	struct td_list_head *tmpl;
-        file_recovery_new.file_stat=NULL;
-	td_list_for_each(tmpl, &file_check_list.list)
-	{
-	  struct td_list_head *tmp;
-	  const file_check_list_t *pos=td_list_entry(tmpl, file_check_list_t, list);
-	  td_list_for_each(tmp, &pos->file_checks[buffer[pos->offset]].list)
-	  {
-	    const file_check_t *file_check=td_list_entry(tmp, file_check_t, list);
-	    if((file_check->length==0 || memcmp(buffer + file_check->offset, file_check->value, file_check->length)==0) &&
-		file_check->header_check(buffer, read_size, 0, &file_recovery, &file_recovery_new)!=0)
-	    {
-	      file_recovery_new.file_stat=file_check->file_stat;
-	      break;
-	    }
-	  }
-	  if(file_recovery_new.file_stat!=NULL)
-	    break;
-	}
+	file_recovery_new.file_stat=header_check_all(buffer, read_size, &file_recovery, &file_recovery_new);
         if(file_recovery_new.file_stat!=NULL && file_recovery_new.file_stat->file_hint!=NULL)
         {
+	  if(options->header_index>0)
+	  {
+	    /* The header check may depend on the file being recovered */
+	    header_index_entry_t *entry=header_index_find(&run_header_index, offset);
+	    if(entry!=NULL)
+	      entry->size_hint=header_index_size_hint(&file_recovery_new);
+	  }
 	  current_search_space=file_found(current_search_space, offset, file_recovery_new.file_stat);
 	  file_recovery_new.loc=current_search_space;
 	  file_recovery_new.location.start=offset;
           if(options->verbose > 1)
             log_trace("A known header has been found, recovery of the previous file is finished\n");
 	  {
+	    recovered_start=file_recovery.location.start;
 	    file_recovered=file_finish2(&file_recovery, params, options, list_search_space, &current_search_space, &offset);
 	  }
           reset_file_recovery(&file_recovery);
           if(options->lowmem > 0)
             forget(list_search_space,current_search_space);
-          if(file_recovered==0)
+          if(file_recovered==0 && params->range_end > 0 && offset >= params->range_end)
+	  {
+	    /* First header after the range, the data before it may still be
+	     * used by this process (brute force) */
+	    params->range_end=offset;
+	    range_done=1;
+	  }
+          else if(file_recovered==0)
           {
 	    file_recovery_cpy(&file_recovery, &file_recovery_new);
             if(options->verbose > 1)
@@ -330,6 +861,7 @@ pstatus_t photorec_aux(struct ph_param *params, const struct ph_options *options
       }
       if(res==2)
       {
+	recovered_start=file_recovery.location.start;
 	file_recovered=file_finish2(&file_recovery, params, options, list_search_space, &current_search_space, &offset);
 	reset_file_recovery(&file_recovery);
 	if(options->lowmem > 0)
@@ -346,16 +878,30 @@ pstatus_t photorec_aux(struct ph_param *params, const struct ph_options *options
       get_next_sector(list_search_space, &current_search_space,&offset,blocksize);
       if(offset > offset_before_back)
 	back=0;
+      if(options->header_index>0 && file_recovery.file_stat==NULL)
+	header_index_skip(&run_header_index, params, list_search_space, &current_search_space, &offset);
     }
     else if(file_recovered>0)
     {
       /* try to recover the previous file, otherwise stay at the current location */
+      alloc_data_t *prev_search_space=current_search_space;
+      uint64_t prev_offset=offset;
       offset_before_back=offset;
       if(back < 10 &&
-	  get_prev_file_header(list_search_space, &current_search_space, &offset)==0)
+	  get_prev_file_header(list_search_space, &prev_search_space, &prev_offset)==0 &&
+	  (options->header_index==0 ||
+	   header_index_need_back(&run_header_index, params, list_search_space, prev_search_space, prev_offset, recovered_start)>0))
+      {
+	current_search_space=prev_search_space;
+	offset=prev_offset;
 	back++;
+      }
       else
+      {
 	back=0;
+	if(options->header_index>0)
+	  header_index_skip(&run_header_index, params, list_search_space, &current_search_space, &offset);
+      }
     }
     if(current_search_space==list_search_space)
     {
@@ -413,13 +959,19 @@ pstatus_t photorec_aux(struct ph_param *params, const struct ph_options *options
 	  if(current_time >= next_checkpoint)
 	  {
 	    /* Save current progress */
-	    session_save(list_search_space, params, options);
+	    session_sync(list_search_space, params, options);
 	    next_checkpoint=current_time+5*60;
 	  }
         }
       }
     }
   } /* end while(current_search_space!=list_search_space) */
+  if(ind_stop==PSTATUS_OK && range_done==0 && range_crossed>0)
+  {
+    /* No file begins after the range, the end of the disk has been used
+     * by the files of this range */
+    params->range_end=params->disk->disk_size;
+  }
   free(buffer_start);
 #ifdef HAVE_NCURSES
   photorec_info(stdscr, params->file_stats);
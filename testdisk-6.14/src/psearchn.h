@@ -24,6 +24,7 @@ extern "C" {
 #endif
 
 pstatus_t photorec_aux(struct ph_param *params, const struct ph_options *options, alloc_data_t *list_search_space);
+void header_index_free(void);
 
 #ifdef __cplusplus
 } /* closing brace for extern "C" */
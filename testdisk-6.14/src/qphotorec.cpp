@@ -83,6 +83,10 @@ QPhotorec::QPhotorec(QWidget *my_parent) : QWidget(my_parent)
   params->cmd_device=NULL;
   params->cmd_run=NULL;
   params->carve_free_space_only=1;
+  params->range_file=NULL;
+  params->range_nbr=0;
+  params->range_start=0;
+  params->range_end=0;
   params->disk=NULL;
   params->partition=NULL;
 
@@ -92,6 +96,7 @@ QPhotorec::QPhotorec(QWidget *my_parent) : QWidget(my_parent)
   options->mode_ext2=0;
   options->expert=0;
   options->lowmem=0;
+  options->header_index=0;
   options->verbose=0;
   options->list_file_format=list_file_enable;
   reset_list_file_enable(options->list_file_format);
@@ -403,7 +403,7 @@ pstatus_t QPhotorec::photorec_aux(alloc_data_t *list_search_space)
 	  if(current_time >= next_checkpoint)
 	  {
 	    /* Save current progress */
-	    session_save(list_search_space, params, options);
+	    session_sync(list_search_space, params, options);
 	    next_checkpoint=current_time+5*60;
 	  }
         }
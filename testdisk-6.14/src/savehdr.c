@@ -35,6 +35,9 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>	/* unlink */
+#endif
 #include <stdio.h>
 #include <errno.h>
 #include "types.h"
@@ -43,6 +46,10 @@
 #include "savehdr.h"
 #include "log.h"
 #define BACKUP_MAXSIZE 5120
+#define SEARCH_CHECKPOINT_FILENAME "testdisk.ses"
+
+static partition_t *partition_load_line(const disk_t *disk_car, const char *pos);
+static void partition_save_line(FILE *f_backup, disk_t *disk_car, const partition_t *partition);
 
 int save_header(disk_t *disk_car,partition_t *partition, const int verbose)
 {
@@ -149,41 +156,22 @@ backup_disk_t *partition_load(const disk_t *disk_car, const int verbose)
     }
     else if(new_backup!=NULL)
     {
-      partition_t *new_partition=partition_new(disk_car->arch);
-      char status;
-      unsigned int part_type;
-      unsigned long part_size;
-      unsigned long part_offset;
+      partition_t *new_partition;
       if(verbose>1)
       {
         log_verbose("new partition\n");
       }
-      if(sscanf(pos,"%2u : start=%10lu, size=%10lu, Id=%02X, %c\n",
-            &new_partition->order, &part_offset,
-            &part_size,&part_type,&status)==5)
+      new_partition=partition_load_line(disk_car, pos);
+      if(new_partition!=NULL)
       {
-        new_partition->part_offset=(uint64_t)part_offset*disk_car->sector_size;
-        new_partition->part_size=(uint64_t)part_size*disk_car->sector_size;
-        if(disk_car->arch->set_part_type!=NULL)
-          disk_car->arch->set_part_type(new_partition,part_type);
-        switch(status)
-        {
-          case 'P':	new_partition->status=STATUS_PRIM; break;
-          case '*':	new_partition->status=STATUS_PRIM_BOOT; break;
-          case 'L':	new_partition->status=STATUS_LOG; break;
-          default:	new_partition->status=STATUS_DELETED; break;
-        }
-        {
-          int insert_error=0;
-          new_backup->list_part=insert_new_partition(new_backup->list_part, new_partition, 0, &insert_error);
-          if(insert_error>0)
-            free(new_partition);
-        }
+        int insert_error=0;
+        new_backup->list_part=insert_new_partition(new_backup->list_part, new_partition, 0, &insert_error);
+        if(insert_error>0)
+          free(new_partition);
       }
       else
       {
         log_critical("partition_load: sscanf failed\n");
-        free(new_partition);
         pos=NULL;
       }
     }
@@ -217,25 +205,221 @@ int partition_save(disk_t *disk_car, list_part_t *list_part, const int verbose)
   }
   fprintf(f_backup,"#%u %s\n",(unsigned int)time(NULL), disk_car->description(disk_car));
   for(parts=list_part;parts!=NULL;parts=parts->next)
+    partition_save_line(f_backup, disk_car, parts->part);
+  fclose(f_backup);
+  return 0;
+}
+
+static partition_t *partition_load_line(const disk_t *disk_car, const char *pos)
+{
+  partition_t *new_partition=partition_new(disk_car->arch);
+  char status;
+  unsigned int part_type;
+  long long unsigned part_size;
+  long long unsigned part_offset;
+  if(sscanf(pos,"%2u : start=%llu, size=%llu, Id=%02X, %c\n",
+	&new_partition->order, &part_offset,
+	&part_size,&part_type,&status)!=5)
   {
-    char status='D';
-    switch(parts->part->status)
+    free(new_partition);
+    return NULL;
+  }
+  new_partition->part_offset=(uint64_t)part_offset*disk_car->sector_size;
+  new_partition->part_size=(uint64_t)part_size*disk_car->sector_size;
+  if(disk_car->arch->set_part_type!=NULL)
+    disk_car->arch->set_part_type(new_partition,part_type);
+  switch(status)
+  {
+    case 'P':	new_partition->status=STATUS_PRIM; break;
+    case '*':	new_partition->status=STATUS_PRIM_BOOT; break;
+    case 'L':	new_partition->status=STATUS_LOG; break;
+    default:	new_partition->status=STATUS_DELETED; break;
+  }
+  return new_partition;
+}
+
+static void partition_save_line(FILE *f_backup, disk_t *disk_car, const partition_t *partition)
+{
+  char status='D';
+  switch(partition->status)
+  {
+    case STATUS_PRIM:           status='P'; break;
+    case STATUS_PRIM_BOOT:      status='*'; break;
+    case STATUS_EXT:            status='E'; break;
+    case STATUS_EXT_IN_EXT:     status='X'; break;
+    case STATUS_LOG:            status='L'; break;
+    case STATUS_DELETED:        status='D'; break;
+  }
+  fprintf(f_backup,"%2d : start=%9llu, size=%9llu, Id=%02X, %c\n",
+      (partition->order < 100 ? partition->order : 0),
+      (long long unsigned)(partition->part_offset/disk_car->sector_size),
+      (long long unsigned)(partition->part_size/disk_car->sector_size),
+      (disk_car->arch->get_part_type!=NULL ?  disk_car->arch->get_part_type(partition) : 0),
+      status);
+}
+
+/*
+ * testdisk.ses keeps the state of an interrupted deeper search:
+ * #time disk description
+ * arch=partition table type
+ * fast_mode=1
+ * location=search_location (bytes)
+ * hint=offset (bytes, one line per pending try_offset hint)
+ * raid=offset (bytes, one line per pending try_offset_raid hint)
+ * followed by the partitions already found, in the backup.log format
+ */
+int search_checkpoint_save(disk_t *disk_car, const search_checkpoint_t *checkpoint)
+{
+  const list_part_t *parts;
+  const char *tmp_filename=SEARCH_CHECKPOINT_FILENAME ".tmp";
+  FILE *f_ses;
+  unsigned int i;
+  int res=0;
+  f_ses=fopen(tmp_filename,"w");
+  if(!f_ses)
+  {
+    log_critical("Can't create %s file: %s\n", SEARCH_CHECKPOINT_FILENAME, strerror(errno));
+    return -1;
+  }
+  fprintf(f_ses,"#%u %s\n",(unsigned int)time(NULL), disk_car->description(disk_car));
+  fprintf(f_ses,"arch=%s\n", disk_car->arch->part_name);
+  fprintf(f_ses,"fast_mode=%d\n", checkpoint->fast_mode);
+  fprintf(f_ses,"location=%llu\n", (long long unsigned)checkpoint->search_location);
+  for(i=0; i<checkpoint->try_offset_nbr; i++)
+    fprintf(f_ses,"hint=%llu\n", (long long unsigned)checkpoint->try_offset[i]);
+  for(i=0; i<checkpoint->try_offset_raid_nbr; i++)
+    fprintf(f_ses,"raid=%llu\n", (long long unsigned)checkpoint->try_offset_raid[i]);
+  for(parts=checkpoint->list_part;parts!=NULL;parts=parts->next)
+    partition_save_line(f_ses, disk_car, parts->part);
+  if(fflush(f_ses)!=0)
+    res=-1;
+  fclose(f_ses);
+#ifdef __MINGW32__
+  if(res==0)
+    unlink(SEARCH_CHECKPOINT_FILENAME);
+#endif
+  if(res==0 && rename(tmp_filename, SEARCH_CHECKPOINT_FILENAME)<0)
+    res=-1;
+  if(res<0)
+  {
+    log_critical("Can't write %s file: %s\n", SEARCH_CHECKPOINT_FILENAME, strerror(errno));
+    unlink(tmp_filename);
+  }
+  return res;
+}
+
+static void search_checkpoint_add(uint64_t **tab, unsigned int *tab_nbr, unsigned int *tab_max, const uint64_t offset)
+{
+  if(*tab_nbr==*tab_max)
+  {
+    *tab_max=(*tab_max==0 ? 256 : *tab_max*2);
+    *tab=(uint64_t *)realloc(*tab, *tab_max * sizeof(uint64_t));
+    if(*tab==NULL)
     {
-      case STATUS_PRIM:           status='P'; break;
-      case STATUS_PRIM_BOOT:      status='*'; break;
-      case STATUS_EXT:            status='E'; break;
-      case STATUS_EXT_IN_EXT:     status='X'; break;
-      case STATUS_LOG:            status='L'; break;
-      case STATUS_DELETED:        status='D'; break;
+      log_critical("savehdr.c: memory allocation failed\n");
+      exit(EXIT_FAILURE);
     }
-    fprintf(f_backup,"%2d : start=%9lu, size=%9lu, Id=%02X, %c\n",
-	(parts->part->order < 100 ? parts->part->order : 0),
-	(unsigned long)(parts->part->part_offset/disk_car->sector_size),
-	(unsigned long)(parts->part->part_size/disk_car->sector_size),
-	(disk_car->arch->get_part_type!=NULL ?  disk_car->arch->get_part_type(parts->part) : 0),
-	status);
   }
-  fclose(f_backup);
-  return 0;
+  (*tab)[(*tab_nbr)++]=offset;
+}
+
+search_checkpoint_t *search_checkpoint_load(disk_t *disk_car, const int fast_mode, const int verbose)
+{
+  FILE *f_ses;
+  char line[256];
+  char *pos;
+  search_checkpoint_t *checkpoint;
+  unsigned int try_offset_max=0;
+  unsigned int try_offset_raid_max=0;
+  int location_ok=0;
+  int arch_ok=0;
+  f_ses=fopen(SEARCH_CHECKPOINT_FILENAME,"r");
+  if(!f_ses)
+    return NULL;
+  /* The checkpoint must be for the same disk, with the same geometry */
+  if(fgets(line, sizeof(line), f_ses)==NULL || line[0]!='#' ||
+      (pos=strchr(line, ' '))==NULL)
+  {
+    fclose(f_ses);
+    return NULL;
+  }
+  pos[strcspn(pos, "\n")]='\0';
+  if(strcmp(pos+1, disk_car->description(disk_car))!=0)
+  {
+    if(verbose>0)
+      log_verbose("%s is for another disk: %s\n", SEARCH_CHECKPOINT_FILENAME, pos+1);
+    fclose(f_ses);
+    return NULL;
+  }
+  checkpoint=(search_checkpoint_t *)MALLOC(sizeof(*checkpoint));
+  checkpoint->fast_mode=-1;
+  checkpoint->search_location=0;
+  checkpoint->try_offset=NULL;
+  checkpoint->try_offset_nbr=0;
+  checkpoint->try_offset_raid=NULL;
+  checkpoint->try_offset_raid_nbr=0;
+  checkpoint->list_part=NULL;
+  while(fgets(line, sizeof(line), f_ses)!=NULL)
+  {
+    long long unsigned value;
+    int mode;
+    partition_t *new_partition;
+    if(strncmp(line, "arch=", 5)==0)
+    {
+      /* The partitions are stored with the type of this partition table */
+      line[strcspn(line, "\n")]='\0';
+      if(strcmp(&line[5], disk_car->arch->part_name)!=0)
+      {
+	if(verbose>0)
+	  log_verbose("%s is for another partition table type: %s\n", SEARCH_CHECKPOINT_FILENAME, &line[5]);
+	break;
+      }
+      arch_ok=1;
+    }
+    else if(sscanf(line, "fast_mode=%d", &mode)==1)
+      checkpoint->fast_mode=mode;
+    else if(sscanf(line, "location=%llu", &value)==1)
+    {
+      checkpoint->search_location=value;
+      location_ok=1;
+    }
+    else if(sscanf(line, "hint=%llu", &value)==1)
+      search_checkpoint_add(&checkpoint->try_offset, &checkpoint->try_offset_nbr, &try_offset_max, value);
+    else if(sscanf(line, "raid=%llu", &value)==1)
+      search_checkpoint_add(&checkpoint->try_offset_raid, &checkpoint->try_offset_raid_nbr, &try_offset_raid_max, value);
+    else if((new_partition=partition_load_line(disk_car, line))!=NULL)
+    {
+      int insert_error=0;
+      checkpoint->list_part=insert_new_partition(checkpoint->list_part, new_partition, 0, &insert_error);
+      if(insert_error>0)
+	free(new_partition);
+    }
+    else
+    {
+      log_critical("search_checkpoint_load: invalid line %s", line);
+      location_ok=0;
+      break;
+    }
+  }
+  fclose(f_ses);
+  if(location_ok==0 || arch_ok==0 || checkpoint->fast_mode!=fast_mode)
+  {
+    search_checkpoint_free(checkpoint);
+    return NULL;
+  }
+  return checkpoint;
+}
+
+void search_checkpoint_free(search_checkpoint_t *checkpoint)
+{
+  part_free_list(checkpoint->list_part);
+  free(checkpoint->try_offset);
+  free(checkpoint->try_offset_raid);
+  free(checkpoint);
+}
+
+void search_checkpoint_delete(void)
+{
+  unlink(SEARCH_CHECKPOINT_FILENAME);
 }
 
@@ -32,9 +32,27 @@ typedef struct
   list_part_t *list_part;
 } backup_disk_t;
 
+typedef struct
+{
+  int fast_mode;
+  uint64_t search_location;
+  uint64_t *try_offset;
+  unsigned int try_offset_nbr;
+  uint64_t *try_offset_raid;
+  unsigned int try_offset_raid_nbr;
+  list_part_t *list_part;
+} search_checkpoint_t;
+
 int save_header(disk_t *disk_car,partition_t *partition, const int verbose);
 int partition_save(disk_t *disk_car, list_part_t *list_part, const int verbose);
 backup_disk_t *partition_load(const disk_t *disk_car, const int verbose);
+/* Save/load the state of the partition search to resume it later,
+ * search_checkpoint_load() returns NULL if there is no checkpoint
+ * for this disk and search mode */
+int search_checkpoint_save(disk_t *disk_car, const search_checkpoint_t *checkpoint);
+search_checkpoint_t *search_checkpoint_load(disk_t *disk_car, const int fast_mode, const int verbose);
+void search_checkpoint_free(search_checkpoint_t *checkpoint);
+void search_checkpoint_delete(void);
 
 #ifdef __cplusplus
 } /* closing brace for extern "C" */
@@ -41,7 +41,27 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>	/* kill */
+#endif
+#ifdef HAVE_SYS_UTSNAME_H
+#include <sys/utsname.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_WINDEF_H
+#include <windef.h>
+#endif
+#ifdef HAVE_WINBASE_H
+#include <stdarg.h>
+#include <winbase.h>
+#endif
 #include <errno.h>
+#include <stdarg.h>
 #include "types.h"
 #include "common.h"
 #include "intrf.h"
@@ -49,64 +69,203 @@
 #include "photorec.h"
 #include "sessionp.h"
 #include "log.h"
+#include "crc.h"
 
 #define SESSION_MAXSIZE 40960
 #define SESSION_FILENAME "photorec.ses"
+#define SESSION_MAGIC "PhRecSes"
+#define SESSION_VERSION 1
+/* Above this size, the journal is merged in a new snapshot */
+#define SESSION_JOURNAL_MAXSIZE (4*1024*1024)
+#define RANGE_LOCK_TIMEOUT 60
+#define RANGE_LINE_MAXSIZE 4096
+#define RANGE_OWNER_MAXSIZE 300
 
-int session_load(char **cmd_device, char **current_cmd, alloc_data_t *list_free_space)
+#if defined(__CYGWIN__) || defined(__MINGW32__)
+#ifndef HAVE_SLEEP
+#define sleep(x) Sleep((x)*1000)
+#endif
+#endif
+
+/* The session is made of two files:
+ * - photorec.ses, a snapshot of the search space written by session_save():
+ *   session_header_t, device, cmd, extent_nbr session_extent_t,
+ *   crc32 of all the previous bytes.
+ *   It's written in a temporary file and renamed, it can't be torn.
+ * - photorec.ses.jnl, the journal of the changes made since the snapshot:
+ *   a sequence of session_record_t followed by their data. It begins with a
+ *   SESSION_RECORD_HEADER record with the generation of the snapshot.
+ *   Only the records before the first damaged one are replayed.
+ * When the journal becomes too large, a new snapshot is written by a
+ * background thread. The journal is renamed photorec.ses.jnl.old and a new
+ * journal is started for the new snapshot. Until the new snapshot has been
+ * renamed, photorec.ses.jnl continues photorec.ses.jnl.old: both are
+ * replayed after the previous snapshot.
+ * Extents are stored in sectors. */
+typedef struct
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t generation;
+  uint64_t time;
+  uint32_t device_size;
+  uint32_t cmd_size;
+  uint64_t extent_nbr;
+} __attribute__ ((gcc_struct, __packed__)) session_header_t;
+
+typedef struct
+{
+  uint64_t start;
+  uint64_t end;
+} __attribute__ ((gcc_struct, __packed__)) session_extent_t;
+
+enum { SESSION_RECORD_HEADER=1, SESSION_RECORD_DEL=2, SESSION_RECORD_FILE=3, SESSION_RECORD_CMD=4 };
+
+typedef struct
+{
+  uint32_t type;
+  uint32_t size;	/* size of the data following the record */
+  uint32_t crc;		/* crc32 of type, size and data */
+} __attribute__ ((gcc_struct, __packed__)) session_record_t;
+
+/* SESSION_RECORD_HEADER */
+typedef struct
+{
+  uint32_t generation;
+  uint32_t sector_size;
+} __attribute__ ((gcc_struct, __packed__)) session_record_header_t;
+
+/* SESSION_RECORD_FILE, followed by the filename */
+typedef struct
+{
+  uint64_t start;
+  uint64_t size;
+} __attribute__ ((gcc_struct, __packed__)) session_record_file_t;
+
+typedef struct
 {
-  FILE *f_session;
   char *buffer;
-  char *pos;
-  int taille;
-  struct stat stat_rec;
-  unsigned int buffer_size;
-//  time_t my_time;
-  char *info=NULL;
-  f_session=fopen(SESSION_FILENAME,"rb");
-  if(!f_session)
-  {
-    log_info("Can't open photorec.ses file: %s\n",strerror(errno));
-    session_save(NULL, NULL, NULL);
+  unsigned int size;
+  unsigned int len;
+} session_cmd_t;
+
+/* Each process working on a range has its own session file */
+static char session_range_filename[64];
+static const char *session_filename=SESSION_FILENAME;
+static char session_journal_filename[80];
+static char session_journal_old_filename[84];
+/* Set while photorec.ses.jnl continues photorec.ses.jnl.old */
+static int session_journal_chained=0;
+static FILE *session_journal=NULL;
+static uint32_t session_generation=0;
+static unsigned int session_sector_size=DEFAULT_SECTOR_SIZE;
+
+static void session_cmd_add(session_cmd_t *cmd, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+static void session_journal_close(void)
+{
+  if(session_journal==NULL)
+    return ;
+  fclose(session_journal);
+  session_journal=NULL;
+}
+
+static int session_journal_sync(void)
+{
+  if(session_journal==NULL)
     return -1;
+  if(fflush(session_journal)!=0)
+    return -1;
+#if defined(HAVE_FDATASYNC)
+  if(fdatasync(fileno(session_journal))<0)
+    return -1;
+#elif defined(HAVE_FSYNC)
+  if(fsync(fileno(session_journal))<0)
+    return -1;
+#endif
+  return 0;
+}
+
+static void session_journal_write(const unsigned int type, const void *data, const unsigned int size)
+{
+  session_record_t record;
+  if(session_journal==NULL)
+    return ;
+  record.type=le32(type);
+  record.size=le32(size);
+  record.crc=le32(get_crc32(data, size, get_crc32(&record, 8, 0xFFFFFFFF)) ^ 0xFFFFFFFF);
+  if(fwrite(&record, sizeof(record), 1, session_journal)!=1 ||
+      (size > 0 && fwrite(data, size, 1, session_journal)!=1))
+  {
+    /* The next session_save() will write a full snapshot */
+    log_critical("Can't write to %s: %s\n", session_journal_filename, strerror(errno));
+    session_journal_close();
   }
-  if(fstat(fileno(f_session), &stat_rec)<0)
-    buffer_size=SESSION_MAXSIZE;
-  else
-    buffer_size=stat_rec.st_size;
-  buffer=(char *)MALLOC(buffer_size+1);
-  taille=fread(buffer,1,buffer_size,f_session);
-  buffer[taille]='\0';
-  fclose(f_session);
-  pos=buffer;
-  if(*pos!='#')
+}
+
+static void session_journal_open(const unsigned int sector_size)
+{
+  session_record_header_t header;
+  session_journal_close();
+  snprintf(session_journal_filename, sizeof(session_journal_filename), "%s.jnl", session_filename);
+  session_journal=fopen(session_journal_filename, "wb");
+  if(session_journal==NULL)
   {
-    free(buffer);
-    return -1;
+    log_critical("Can't create %s file: %s\n", session_journal_filename, strerror(errno));
+    return ;
   }
+  session_sector_size=sector_size;
+  header.generation=le32(session_generation);
+  header.sector_size=le32(sector_size);
+  session_journal_write(SESSION_RECORD_HEADER, &header, sizeof(header));
+  session_journal_sync();
+}
+
+void session_journal_del(const uint64_t start, const uint64_t end)
+{
+  session_extent_t extent;
+  if(session_journal==NULL || start > end)
+    return ;
+  extent.start=le64(start/session_sector_size);
+  extent.end=le64(end/session_sector_size);
+  session_journal_write(SESSION_RECORD_DEL, &extent, sizeof(extent));
+}
+
+void session_journal_file(const file_recovery_t *file_recovery)
+{
+  const unsigned int name_size=strlen(file_recovery->filename);
+  unsigned char *data;
+  session_record_file_t *file;
+  if(session_journal==NULL)
+    return ;
+  data=(unsigned char *)MALLOC(sizeof(session_record_file_t) + name_size);
+  file=(session_record_file_t *)data;
+  file->start=le64(file_recovery->location.start/session_sector_size);
+  file->size=le64(file_recovery->file_size);
+  memcpy(&data[sizeof(session_record_file_t)], file_recovery->filename, name_size);
+  session_journal_write(SESSION_RECORD_FILE, data, sizeof(session_record_file_t) + name_size);
+  free(data);
+}
+
+static int session_load_text(char *buffer, char **cmd_device, char **current_cmd, alloc_data_t *list_free_space)
+{
+  char *pos;
+  char *info=NULL;
+  pos=buffer;
   pos++;
   /* load time */
   strtol(pos,&pos,10); 	// my_time=strtol(pos,&pos,10);
   if(pos==NULL)
-  {
-    free(buffer);
     return 0;
-  }
   pos=strstr(pos,"\n");
   if(pos==NULL)
-  {
-    free(buffer);
     return 0;
-  }
   pos++;
   /* get current disk */
   info=pos;
   pos=strstr(info," ");
   if(pos==NULL)
-  {
-    free(buffer);
     return 0;
-  }
   *pos='\0';
   pos++;
   *cmd_device=strdup(info);
@@ -114,10 +273,7 @@ int session_load(char **cmd_device, char **current_cmd, alloc_data_t *list_free_
   info=pos;
   pos=strstr(pos,"\n");
   if(pos==NULL)
-  {
-    free(buffer);
     return 0;
-  }
   *pos='\0';
   pos++;
   *current_cmd=strdup(info);
@@ -131,10 +287,7 @@ int session_load(char **cmd_device, char **current_cmd, alloc_data_t *list_free_
       pos++;
     }
     if(*pos++ != '-')
-    {
-      free(buffer);
       return 0;
-    }
     while(*pos >= '0' && *pos <= '9')
     {
       end=end*10+(*pos -'0');
@@ -159,161 +312,1435 @@ int session_load(char **cmd_device, char **current_cmd, alloc_data_t *list_free_
   }
 }
 
-int session_save(alloc_data_t *list_free_space, struct ph_param *params,  const struct ph_options *options)
+static char *session_strndup(const char *src, const unsigned int size)
 {
-  FILE *f_session;
-  if(params!=NULL && params->status==STATUS_QUIT)
+  char *dst=(char *)MALLOC(size+1);
+  memcpy(dst, src, size);
+  dst[size]='\0';
+  return dst;
+}
+
+/* Replay a journal written after the snapshot, any_generation is set when
+ * it continues another journal that has been replayed.
+ * Returns 1 if the journal belongs to the snapshot */
+static int session_journal_replay_file(const char *filename, const uint32_t generation, const int any_generation, char **current_cmd, alloc_data_t *list_free_space)
+{
+  FILE *handle;
+  struct stat stat_rec;
+  unsigned char *buffer;
+  unsigned int buffer_size;
+  unsigned int pos;
+  unsigned int changes=0;
+  unsigned int files=0;
+  int found=0;
+  handle=fopen(filename, "rb");
+  if(handle==NULL)
     return 0;
-  f_session=fopen(SESSION_FILENAME,"wb");
+  if(fstat(fileno(handle), &stat_rec)<0 || stat_rec.st_size < (off_t)sizeof(session_record_t))
+  {
+    fclose(handle);
+    return 0;
+  }
+  buffer_size=stat_rec.st_size;
+  buffer=(unsigned char *)MALLOC(buffer_size);
+  buffer_size=fread(buffer, 1, buffer_size, handle);
+  fclose(handle);
+  for(pos=0; pos + sizeof(session_record_t) <= buffer_size; )
+  {
+    const session_record_t *record=(const session_record_t *)&buffer[pos];
+    const unsigned int type=le32(record->type);
+    const unsigned int size=le32(record->size);
+    const unsigned char *data=&buffer[pos + sizeof(session_record_t)];
+    if(size > buffer_size - pos - sizeof(session_record_t) ||
+	(get_crc32(data, size, get_crc32(record, 8, 0xFFFFFFFF)) ^ 0xFFFFFFFF) != le32(record->crc))
+      break;
+    if(pos==0)
+    {
+      const session_record_header_t *header=(const session_record_header_t *)data;
+      /* The journal of an older snapshot has already been merged */
+      if(type!=SESSION_RECORD_HEADER || size < sizeof(*header) ||
+	  (any_generation==0 && le32(header->generation)!=generation))
+	break;
+      found=1;
+    }
+    else if(type==SESSION_RECORD_DEL && size >= sizeof(session_extent_t))
+    {
+      const session_extent_t *extent=(const session_extent_t *)data;
+      del_search_space(list_free_space, le64(extent->start), le64(extent->end));
+      changes++;
+    }
+    else if(type==SESSION_RECORD_CMD)
+    {
+      free(*current_cmd);
+      *current_cmd=session_strndup((const char *)data, size);
+      changes++;
+    }
+    else if(type==SESSION_RECORD_FILE)
+      files++;
+    pos+=sizeof(session_record_t) + size;
+  }
+  free(buffer);
+  if(changes>0 || files>0)
+    log_info("%s: %u changes replayed, %u files recovered since the last snapshot\n",
+	filename, changes, files);
+  return found;
+}
+
+static void session_journal_replay(const uint32_t generation, char **current_cmd, alloc_data_t *list_free_space)
+{
+  int old_found;
+  snprintf(session_journal_old_filename, sizeof(session_journal_old_filename), "%s.jnl.old", session_filename);
+  snprintf(session_journal_filename, sizeof(session_journal_filename), "%s.jnl", session_filename);
+  /* The snapshot written in the background may not have been renamed */
+  old_found=session_journal_replay_file(session_journal_old_filename, generation, 0, current_cmd, list_free_space);
+  session_journal_replay_file(session_journal_filename, generation, old_found, current_cmd, list_free_space);
+}
+
+
+static int session_load_binary(const unsigned char *buffer, const unsigned int buffer_size, char **cmd_device, char **current_cmd, alloc_data_t *list_free_space)
+{
+  const session_header_t *header=(const session_header_t *)buffer;
+  const session_extent_t *extents;
+  uint64_t extent_nbr;
+  uint64_t i;
+  unsigned int device_size;
+  unsigned int cmd_size;
+  if(buffer_size < sizeof(session_header_t) + 4 ||
+      memcmp(header->magic, SESSION_MAGIC, sizeof(header->magic))!=0 ||
+      le32(header->version)!=SESSION_VERSION)
+    return -1;
+  if((get_crc32(buffer, buffer_size - 4, 0xFFFFFFFF) ^ 0xFFFFFFFF) !=
+      ((uint32_t)buffer[buffer_size-4] | ((uint32_t)buffer[buffer_size-3]<<8) |
+       ((uint32_t)buffer[buffer_size-2]<<16) | ((uint32_t)buffer[buffer_size-1]<<24)))
+  {
+    log_critical("%s is damaged\n", session_filename);
+    return -1;
+  }
+  device_size=le32(header->device_size);
+  cmd_size=le32(header->cmd_size);
+  extent_nbr=le64(header->extent_nbr);
+  if(device_size==0 ||
+      (uint64_t)device_size + cmd_size + extent_nbr * sizeof(session_extent_t) !=
+      buffer_size - sizeof(session_header_t) - 4)
+    return 0;
+  *cmd_device=session_strndup((const char *)&buffer[sizeof(session_header_t)], device_size);
+  *current_cmd=session_strndup((const char *)&buffer[sizeof(session_header_t) + device_size], cmd_size);
+  extents=(const session_extent_t *)&buffer[sizeof(session_header_t) + device_size + cmd_size];
+  for(i=0; i<extent_nbr; i++)
+  {
+    alloc_data_t *new_free_space;
+    new_free_space=(alloc_data_t*)MALLOC(sizeof(*new_free_space));
+    /* Temporary storage, values need to be multiplied by sector_size */
+    new_free_space->start=le64(extents[i].start);
+    new_free_space->end=le64(extents[i].end);
+    new_free_space->file_stat=NULL;
+    new_free_space->data=1;
+    td_list_add_tail(&new_free_space->list, &list_free_space->list);
+  }
+  session_generation=le32(header->generation);
+  session_journal_replay(session_generation, current_cmd, list_free_space);
+  return 0;
+}
+
+int session_load(char **cmd_device, char **current_cmd, alloc_data_t *list_free_space)
+{
+  FILE *f_session;
+  char *buffer;
+  int taille;
+  int res;
+  struct stat stat_rec;
+  unsigned int buffer_size;
+  f_session=fopen(session_filename,"rb");
   if(!f_session)
   {
-    log_critical("Can't create photorec.ses file: %s\n",strerror(errno));
+    log_info("Can't open photorec.ses file: %s\n",strerror(errno));
+    session_save(NULL, NULL, NULL);
     return -1;
   }
-  if(params!=NULL)
+  if(fstat(fileno(f_session), &stat_rec)<0)
+    buffer_size=SESSION_MAXSIZE;
+  else
+    buffer_size=stat_rec.st_size;
+  buffer=(char *)MALLOC(buffer_size+1);
+  taille=fread(buffer,1,buffer_size,f_session);
+  buffer[taille]='\0';
+  fclose(f_session);
+  if(taille <= 0)
+    res=-1;
+  else if(buffer[0]=='#')
   {
-    struct td_list_head *free_walker = NULL;
-    unsigned int i;
-    const file_enable_t *files_enable=options->list_file_format;
-    unsigned int disable=0;
-    unsigned int enable=0;
-    unsigned int enable_by_default=0;
-    if(options->verbose>1)
+    /* Session saved by a previous version */
+    res=session_load_text(buffer, cmd_device, current_cmd, list_free_space);
+  }
+  else
+    res=session_load_binary((const unsigned char *)buffer, taille, cmd_device, current_cmd, list_free_space);
+  free(buffer);
+  return res;
+}
+
+static void session_cmd_add(session_cmd_t *cmd, const char *format, ...)
+{
+  while(1)
+  {
+    va_list ap;
+    int res;
+    va_start(ap, format);
+    res=vsnprintf(&cmd->buffer[cmd->len], cmd->size - cmd->len, format, ap);
+    va_end(ap);
+    if(res >= 0 && (unsigned int)res < cmd->size - cmd->len)
+    {
+      cmd->len+=res;
+      return ;
+    }
+    cmd->size=(res >= 0 ? cmd->len + res + 1 : cmd->size) * 2;
+    cmd->buffer=(char *)realloc(cmd->buffer, cmd->size);
+    if(cmd->buffer==NULL)
     {
-      log_trace("session_save\n");
+      log_critical("sessionp.c: memory allocation failed\n");
+      exit(EXIT_FAILURE);
     }
-    fprintf(f_session,"#%u\n%s %s,%u",
-	(unsigned int)time(NULL), params->disk->device, params->disk->arch->part_name_option, params->partition->order);
-    if(params->blocksize>0)
-      fprintf(f_session,"blocksize,%u,", params->blocksize);
-    fprintf(f_session,"fileopt,");
+  }
+}
+
+/* Build the command used to resume the recovery */
+static void session_cmd(session_cmd_t *cmd, const struct ph_param *params, const struct ph_options *options)
+{
+  unsigned int i;
+  const file_enable_t *files_enable=options->list_file_format;
+  unsigned int disable=0;
+  unsigned int enable=0;
+  unsigned int enable_by_default=0;
+  cmd->size=1024;
+  cmd->len=0;
+  cmd->buffer=(char *)MALLOC(cmd->size);
+  session_cmd_add(cmd, "%s,%u", params->disk->arch->part_name_option, params->partition->order);
+  if(params->blocksize>0)
+    session_cmd_add(cmd,"blocksize,%u,", params->blocksize);
+  session_cmd_add(cmd,"fileopt,");
+  for(i=0;files_enable[i].file_hint!=NULL;i++)
+  {
+    if(files_enable[i].enable==0)
+      disable++;
+    else
+      enable++;
+    if(files_enable[i].enable==files_enable[i].file_hint->enable_by_default)
+      enable_by_default++;
+  }
+  if(enable_by_default >= disable && enable_by_default >= enable)
+  {
     for(i=0;files_enable[i].file_hint!=NULL;i++)
     {
-      if(files_enable[i].enable==0)
-	disable++;
-      else
-	enable++;
-      if(files_enable[i].enable==files_enable[i].file_hint->enable_by_default)
-	enable_by_default++;
+      if(files_enable[i].enable!=files_enable[i].file_hint->enable_by_default &&
+	  files_enable[i].file_hint->extension!=NULL &&
+	  files_enable[i].file_hint->extension[0]!='\0')
+      {
+	session_cmd_add(cmd,"%s,%s,", files_enable[i].file_hint->extension,
+	    (files_enable[i].enable!=0?"enable":"disable"));
+      }
     }
-    if(enable_by_default >= disable && enable_by_default >= enable)
+  }
+  else if(enable > disable)
+  {
+    session_cmd_add(cmd,"everything,enable,");
+    for(i=0;files_enable[i].file_hint!=NULL;i++)
     {
-      for(i=0;files_enable[i].file_hint!=NULL;i++)
+      if(files_enable[i].enable==0 &&
+	  files_enable[i].file_hint->extension!=NULL &&
+	  files_enable[i].file_hint->extension[0]!='\0')
       {
-	if(files_enable[i].enable!=files_enable[i].file_hint->enable_by_default &&
-	      files_enable[i].file_hint->extension!=NULL &&
-	      files_enable[i].file_hint->extension[0]!='\0')
-	{
-	  fprintf(f_session,"%s,%s,", files_enable[i].file_hint->extension,
-	      (files_enable[i].enable!=0?"enable":"disable"));
-	}
+	session_cmd_add(cmd,"%s,disable,", files_enable[i].file_hint->extension);
       }
     }
-    else if(enable > disable)
+  }
+  else
+  {
+    session_cmd_add(cmd,"everything,disable,");
+    for(i=0;files_enable[i].file_hint!=NULL;i++)
     {
-      fprintf(f_session,"everything,enable,");
-      for(i=0;files_enable[i].file_hint!=NULL;i++)
+      if(files_enable[i].enable!=0 &&
+	  files_enable[i].file_hint->extension!=NULL &&
+	  files_enable[i].file_hint->extension[0]!='\0')
       {
-	if(files_enable[i].enable==0 &&
-	      files_enable[i].file_hint->extension!=NULL &&
-	      files_enable[i].file_hint->extension[0]!='\0')
-	{
-	  fprintf(f_session,"%s,disable,", files_enable[i].file_hint->extension);
-	}
+	session_cmd_add(cmd,"%s,enable,", files_enable[i].file_hint->extension);
       }
     }
+  }
+  /* Save options */
+  session_cmd_add(cmd, "options,");
+  if(options->paranoid==0)
+    session_cmd_add(cmd, "paranoid_no,");
+  else if(options->paranoid==1)
+    session_cmd_add(cmd, "paranoid,");
+  else
+    session_cmd_add(cmd, "paranoid_bf,");
+  if(options->keep_corrupted_file>0)
+    session_cmd_add(cmd, "keep_corrupted_file,");
+  else
+    session_cmd_add(cmd, "keep_corrupted_file_no,");
+  if(options->mode_ext2>0)
+    session_cmd_add(cmd, "mode_ext2,");
+  if(options->expert>0)
+    session_cmd_add(cmd, "expert,");
+  if(options->lowmem>0)
+    session_cmd_add(cmd, "lowmem,");
+  if(options->header_index>0)
+    session_cmd_add(cmd, "header_index,");
+  /* Save options - End */
+  if(params->carve_free_space_only>0)
+    session_cmd_add(cmd,"freespace,");
+  else
+    session_cmd_add(cmd,"wholespace,");
+  session_cmd_add(cmd,"search,");
+  switch(params->status)
+  {
+    case STATUS_UNFORMAT:
+      session_cmd_add(cmd, "status=unformat,");
+      break;
+    case STATUS_FIND_OFFSET:
+      session_cmd_add(cmd, "status=find_offset,");
+      break;
+    case STATUS_EXT2_ON_BF:
+      session_cmd_add(cmd, "status=ext2_on_bf,");
+      break;
+    case STATUS_EXT2_ON_SAVE_EVERYTHING:
+      session_cmd_add(cmd, "status=ext2_on_save_everything,");
+      break;
+    case STATUS_EXT2_ON:
+      session_cmd_add(cmd, "status=ext2_on,");
+      break;
+    case STATUS_EXT2_OFF_SAVE_EVERYTHING:
+      session_cmd_add(cmd, "status=ext2_off_save_everything,");
+      break;
+    case STATUS_EXT2_OFF_BF:
+      session_cmd_add(cmd, "status=ext2_off_bf,");
+      break;
+    case STATUS_EXT2_OFF:
+      session_cmd_add(cmd, "status=ext2_off,");
+      break;
+    case STATUS_QUIT:
+      break;
+  }
+  if(params->status!=STATUS_FIND_OFFSET && params->offset!=-1)
+    session_cmd_add(cmd, "%llu,",
+	(long long unsigned)(params->offset/params->disk->sector_size));
+  session_cmd_add(cmd,"inter");
+}
+
+/* Build the snapshot of the current search space, it takes a new generation */
+static unsigned char *session_snapshot(alloc_data_t *list_free_space, struct ph_param *params,  const struct ph_options *options, session_cmd_t *cmd, size_t *snapshot_size)
+{
+  unsigned char *buffer;
+  size_t buffer_size;
+  session_header_t *header;
+  uint64_t extent_nbr=0;
+  uint32_t crc;
+  cmd->buffer=NULL;
+  cmd->len=0;
+  if(params!=NULL)
+  {
+    struct td_list_head *free_walker = NULL;
+    session_cmd(cmd, params, options);
+    td_list_for_each(free_walker, &list_free_space->list)
+      extent_nbr++;
+  }
+  buffer_size=sizeof(session_header_t) + (params==NULL ? 0 : strlen(params->disk->device)) +
+    cmd->len + extent_nbr * sizeof(session_extent_t) + 4;
+  buffer=(unsigned char *)MALLOC(buffer_size);
+  header=(session_header_t *)buffer;
+  memcpy(header->magic, SESSION_MAGIC, sizeof(header->magic));
+  session_generation=(session_generation >= (uint32_t)time(NULL) ? session_generation + 1 : (uint32_t)time(NULL));
+  header->version=le32(SESSION_VERSION);
+  header->generation=le32(session_generation);
+  header->time=le64(time(NULL));
+  header->device_size=0;
+  header->cmd_size=le32(cmd->len);
+  header->extent_nbr=le64(extent_nbr);
+  if(params!=NULL)
+  {
+    struct td_list_head *free_walker = NULL;
+    const unsigned int device_size=strlen(params->disk->device);
+    session_extent_t *extent;
+    header->device_size=le32(device_size);
+    memcpy(&buffer[sizeof(session_header_t)], params->disk->device, device_size);
+    memcpy(&buffer[sizeof(session_header_t) + device_size], cmd->buffer, cmd->len);
+    extent=(session_extent_t *)&buffer[sizeof(session_header_t) + device_size + cmd->len];
+    td_list_for_each(free_walker, &list_free_space->list)
+    {
+      const alloc_data_t *current_free_space=td_list_entry_const(free_walker, const alloc_data_t, list);
+      extent->start=le64(current_free_space->start/params->disk->sector_size);
+      extent->end=le64(current_free_space->end/params->disk->sector_size);
+      extent++;
+    }
+  }
+  crc=get_crc32(buffer, buffer_size - 4, 0xFFFFFFFF) ^ 0xFFFFFFFF;
+  buffer[buffer_size-4]=crc;
+  buffer[buffer_size-3]=crc>>8;
+  buffer[buffer_size-2]=crc>>16;
+  buffer[buffer_size-1]=crc>>24;
+  *snapshot_size=buffer_size;
+  return buffer;
+}
+
+/* Write the snapshot in a temporary file and rename it */
+static int session_snapshot_write(const char *filename, const unsigned char *buffer, const size_t buffer_size)
+{
+  FILE *f_session;
+  char *tmp_filename;
+  int res=0;
+  tmp_filename=(char *)MALLOC(strlen(filename)+5);
+  strcpy(tmp_filename, filename);
+  strcat(tmp_filename, ".tmp");
+  f_session=fopen(tmp_filename,"wb");
+  if(!f_session)
+  {
+    log_critical("Can't create photorec.ses file: %s\n",strerror(errno));
+    res=-1;
+  }
+  else
+  {
+    if(fwrite(buffer, buffer_size, 1, f_session)!=1 || fflush(f_session)!=0)
+      res=-1;
+#ifdef HAVE_FSYNC
+    else if(fsync(fileno(f_session))<0)
+      res=-1;
+#endif
+    fclose(f_session);
+#ifdef __MINGW32__
+    if(res==0)
+      unlink(filename);
+#endif
+    if(res==0 && rename(tmp_filename, filename)<0)
+      res=-1;
+    if(res<0)
+    {
+      log_critical("Can't write photorec.ses file: %s\n",strerror(errno));
+      unlink(tmp_filename);
+    }
+  }
+  free(tmp_filename);
+  return res;
+}
+
+#ifdef HAVE_PTHREAD
+/* Snapshot written by the background thread */
+typedef struct
+{
+  char *filename;
+  char *journal_old_filename;
+  unsigned char *buffer;
+  size_t buffer_size;
+  int res;
+} session_checkpoint_t;
+
+static session_checkpoint_t session_checkpoint;
+static pthread_t session_checkpoint_thread;
+static int session_checkpoint_running=0;
+
+static void *session_checkpoint_write(void *arg)
+{
+  session_checkpoint_t *checkpoint=(session_checkpoint_t *)arg;
+  checkpoint->res=session_snapshot_write(checkpoint->filename, checkpoint->buffer, checkpoint->buffer_size);
+  return NULL;
+}
+
+static int session_checkpoint_done(void)
+{
+  const int res=session_checkpoint.res;
+  /* The new snapshot includes the old journal */
+  if(res==0)
+  {
+    unlink(session_checkpoint.journal_old_filename);
+    session_journal_chained=0;
+  }
+  free(session_checkpoint.filename);
+  free(session_checkpoint.journal_old_filename);
+  free(session_checkpoint.buffer);
+  return res;
+}
+#endif
+
+/* Wait for the snapshot written in the background.
+ * Returns -1 if it has failed: the previous snapshot and both journals are
+ * still used. */
+static int session_checkpoint_wait(void)
+{
+#ifdef HAVE_PTHREAD
+  if(session_checkpoint_running==0)
+    return 0;
+  pthread_join(session_checkpoint_thread, NULL);
+  session_checkpoint_running=0;
+  return session_checkpoint_done();
+#else
+  return 0;
+#endif
+}
+
+/* Start to write a new snapshot in the background, the recovery goes on
+ * with a new journal.
+ * Returns -1 if it hasn't been started */
+static int session_checkpoint_start(alloc_data_t *list_free_space, struct ph_param *params, const struct ph_options *options)
+{
+#ifdef HAVE_PTHREAD
+  session_cmd_t cmd;
+  const uint32_t previous_generation=session_generation;
+  /* The old journal is needed until a new snapshot has been written */
+  if(session_checkpoint_running>0 || session_journal_chained>0)
+    return -1;
+  session_checkpoint.buffer=session_snapshot(list_free_space, params, options, &cmd, &session_checkpoint.buffer_size);
+  free(cmd.buffer);
+  snprintf(session_journal_old_filename, sizeof(session_journal_old_filename), "%s.jnl.old", session_filename);
+  session_journal_close();
+  if(rename(session_journal_filename, session_journal_old_filename)<0)
+  {
+    log_critical("Can't rename %s: %s\n", session_journal_filename, strerror(errno));
+    free(session_checkpoint.buffer);
+    session_generation=previous_generation;
+    return -1;
+  }
+  session_journal_chained=1;
+  session_journal_open(params->disk->sector_size);
+  session_checkpoint.filename=strdup(session_filename);
+  session_checkpoint.journal_old_filename=strdup(session_journal_old_filename);
+  if(pthread_create(&session_checkpoint_thread, NULL, &session_checkpoint_write, &session_checkpoint)!=0)
+  {
+    session_checkpoint_write(&session_checkpoint);
+    session_checkpoint_done();
+  }
+  else
+    session_checkpoint_running=1;
+  return 0;
+#else
+  (void)list_free_space;
+  (void)params;
+  (void)options;
+  return -1;
+#endif
+}
+
+/* Write a new snapshot and start a new journal */
+int session_save(alloc_data_t *list_free_space, struct ph_param *params,  const struct ph_options *options)
+{
+  unsigned char *buffer;
+  size_t buffer_size;
+  session_cmd_t cmd;
+  int res;
+  if(params!=NULL && params->status==STATUS_QUIT)
+    return 0;
+  session_checkpoint_wait();
+  if(params!=NULL && options->verbose>1)
+  {
+    log_trace("session_save\n");
+  }
+  buffer=session_snapshot(list_free_space, params, options, &cmd, &buffer_size);
+  res=session_snapshot_write(session_filename, buffer, buffer_size);
+  free(buffer);
+  if(params!=NULL)
+  {
+    if(res==0)
+    {
+      session_journal_open(params->disk->sector_size);
+      snprintf(session_journal_old_filename, sizeof(session_journal_old_filename), "%s.jnl.old", session_filename);
+      unlink(session_journal_old_filename);
+      session_journal_chained=0;
+    }
+    else if(session_journal!=NULL)
+    {
+      /* The previous snapshot and its journal are still valid */
+      session_journal_write(SESSION_RECORD_CMD, cmd.buffer, cmd.len);
+      res=session_journal_sync();
+    }
+  }
+  free(cmd.buffer);
+  return res;
+}
+
+/* Save the current progress: only the journal is written and flushed to disk.
+ * When the journal becomes too large, a new snapshot is written by a
+ * background thread, or here without pthread. */
+int session_sync(alloc_data_t *list_free_space, struct ph_param *params, const struct ph_options *options)
+{
+  session_cmd_t cmd;
+  int res;
+  if(params->status==STATUS_QUIT)
+    return 0;
+  if(session_journal==NULL)
+    return session_save(list_free_space, params, options);
+  if(ftell(session_journal) > SESSION_JOURNAL_MAXSIZE)
+  {
+    if(session_checkpoint_wait()<0 ||
+	session_checkpoint_start(list_free_space, params, options)<0 ||
+	session_journal==NULL)
+      return session_save(list_free_space, params, options);
+  }
+  if(options->verbose>1)
+  {
+    log_trace("session_sync\n");
+  }
+  session_cmd(&cmd, params, options);
+  session_journal_write(SESSION_RECORD_CMD, cmd.buffer, cmd.len);
+  free(cmd.buffer);
+  res=session_journal_sync();
+  if(res<0)
+    return session_save(list_free_space, params, options);
+  return 0;
+}
+
+void session_remove(void)
+{
+  session_checkpoint_wait();
+  session_journal_close();
+  unlink(session_filename);
+  snprintf(session_journal_filename, sizeof(session_journal_filename), "%s.jnl", session_filename);
+  unlink(session_journal_filename);
+  snprintf(session_journal_old_filename, sizeof(session_journal_old_filename), "%s.jnl.old", session_filename);
+  unlink(session_journal_old_filename);
+}
+
+/* The range file is shared by the processes recovering the same disk:
+ *   start-end todo
+ *   start-end running hostname:pid
+ *   start-end done stop files first_dir-last_dir ext:nbr,ext:nbr recup_dir
+ * Values are in sectors. It's only modified with range_file.lock held,
+ * the lock file contains the hostname:pid of its owner.
+ * stop is the first sector not used by the process: the file recovered at
+ * the end of a range may continue in the next one, the process working on
+ * the next range must ignore the headers found before it.
+ * Each process lists the files it has recovered in range_file.start:
+ *   sector ext filename
+ * and saves its progress in photorec.start.ses */
+typedef struct
+{
+  uint64_t start;
+  uint64_t end;
+  char *line;
+} range_t;
+
+static FILE *range_list=NULL;
+static unsigned int range_sector_size=DEFAULT_SECTOR_SIZE;
+
+/* Identify the current process for the processes of the other hosts */
+static void range_owner(char *owner, const unsigned int owner_size)
+{
+  const char *hostname="localhost";
+#ifdef HAVE_SYS_UTSNAME_H
+  struct utsname name;
+  if(uname(&name)==0 && name.nodename[0]!='\0')
+    hostname=name.nodename;
+#endif
+  snprintf(owner, owner_size, "%s:%ld", hostname, (long)getpid());
+}
+
+/* Returns 1 if owner is a process of this host that doesn't exist anymore.
+ * The processes of the other hosts can't be checked, they may be alive. */
+static int range_owner_dead(const char *owner)
+{
+#if defined(HAVE_SIGNAL_H) && !defined(__MINGW32__)
+  char me[RANGE_OWNER_MAXSIZE];
+  const char *sep=strrchr(owner, ':');
+  char *end;
+  long pid;
+  if(sep==NULL)
+    return 0;
+  range_owner(me, sizeof(me));
+  /* Compare hostname: */
+  if(strncmp(owner, me, sep - owner + 1)!=0)
+    return 0;
+  pid=strtol(sep+1, &end, 10);
+  if(pid<=0 || end==sep+1 || pid==(long)getpid())
+    return 0;
+  if(kill((pid_t)pid, 0)==0 || errno!=ESRCH)
+    return 0;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/* Read the owner of a lock file, returns -1 if there is none */
+static int range_lock_owner(const char *lock, char *owner, const unsigned int owner_size)
+{
+  FILE *handle;
+  char *eol;
+  handle=fopen(lock, "rb");
+  if(handle==NULL)
+    return -1;
+  if(fgets(owner, owner_size, handle)==NULL)
+    owner[0]='\0';
+  fclose(handle);
+  eol=strchr(owner, '\n');
+  if(eol!=NULL)
+    *eol='\0';
+  return 0;
+}
+
+/* Remove the lock if its owner is a process of this host that doesn't exist
+ * anymore. The lock is renamed to a name unique to this process first: if
+ * several processes find the same stale lock, only one can rename it. If the
+ * renamed lock isn't the stale one, another process has removed the stale
+ * lock and taken a new one in between, it's put back. */
+static int range_lock_break(const char *lock)
+{
+#if defined(HAVE_SIGNAL_H) && !defined(__MINGW32__)
+  char owner[RANGE_OWNER_MAXSIZE];
+  char owner_renamed[RANGE_OWNER_MAXSIZE];
+  char me[RANGE_OWNER_MAXSIZE];
+  char *stale;
+  int res=0;
+  if(range_lock_owner(lock, owner, sizeof(owner))<0 || range_owner_dead(owner)==0)
+    return 0;
+  range_owner(me, sizeof(me));
+  stale=(char *)MALLOC(strlen(lock)+1+strlen(me)+1);
+  sprintf(stale, "%s.%s", lock, me);
+  if(rename(lock, stale)<0)
+  {
+    free(stale);
+    return 0;
+  }
+  if(range_lock_owner(stale, owner_renamed, sizeof(owner_renamed))==0 &&
+      strcmp(owner, owner_renamed)==0)
+  {
+    log_info("Remove %s, process %s doesn't exist anymore\n", lock, owner);
+    res=1;
+  }
+  else if(link(stale, lock)<0)
+    log_critical("Can't restore %s: %s\n", lock, strerror(errno));
+  unlink(stale);
+  free(stale);
+  return res;
+#else
+  return 0;
+#endif
+}
+
+static int range_lock(const char *range_file)
+{
+  char *lock=(char *)MALLOC(strlen(range_file)+6);
+  char owner[RANGE_OWNER_MAXSIZE];
+  unsigned int i;
+  strcpy(lock, range_file);
+  strcat(lock, ".lock");
+  range_owner(owner, sizeof(owner)-1);
+  strcat(owner, "\n");
+  for(i=0; i<RANGE_LOCK_TIMEOUT; i++)
+  {
+    const int fd=open(lock, O_CREAT|O_EXCL|O_WRONLY, 0644);
+    if(fd>=0)
+    {
+      const int owner_size=strlen(owner);
+      if(write(fd, owner, owner_size)!=owner_size)
+	log_critical("Can't write to %s: %s\n", lock, strerror(errno));
+      close(fd);
+      free(lock);
+      return 0;
+    }
+    if(errno!=EEXIST)
+      break;
+    if(range_lock_break(lock)==0)
+      sleep(1);
+  }
+  if(errno==EEXIST && range_lock_owner(lock, owner, sizeof(owner))==0)
+    log_critical("Can't lock %s, it's owned by %s\n", lock, owner);
+  else
+    log_critical("Can't lock %s: %s\n", lock, strerror(errno));
+  free(lock);
+  return -1;
+}
+
+static void range_unlock(const char *range_file)
+{
+  char *lock=(char *)MALLOC(strlen(range_file)+6);
+  char owner[RANGE_OWNER_MAXSIZE];
+  char me[RANGE_OWNER_MAXSIZE];
+  strcpy(lock, range_file);
+  strcat(lock, ".lock");
+  range_owner(me, sizeof(me));
+  /* Don't remove the lock of another process */
+  if(range_lock_owner(lock, owner, sizeof(owner))==0 && strcmp(owner, me)==0)
+    unlink(lock);
+  else
+    log_critical("%s isn't owned by %s anymore\n", lock, me);
+  free(lock);
+}
+
+static void range_free(range_t *ranges, const unsigned int range_nbr)
+{
+  unsigned int i;
+  for(i=0; i<range_nbr; i++)
+    free(ranges[i].line);
+  free(ranges);
+}
+
+static unsigned int range_read(const char *range_file, range_t **ranges)
+{
+  FILE *handle;
+  char line[RANGE_LINE_MAXSIZE];
+  unsigned int range_nbr=0;
+  unsigned int range_max=0;
+  *ranges=NULL;
+  handle=fopen(range_file, "rb");
+  if(handle==NULL)
+    return 0;
+  while(fgets(line, sizeof(line), handle)!=NULL)
+  {
+    unsigned long long start;
+    unsigned long long end;
+    char *eol;
+    if(line[0]=='#' || sscanf(line, "%llu-%llu", &start, &end)!=2)
+      continue;
+    eol=strchr(line, '\n');
+    if(eol!=NULL)
+      *eol='\0';
+    if(range_nbr==range_max)
+    {
+      range_max=(range_max==0 ? 64 : range_max*2);
+      *ranges=(range_t *)realloc(*ranges, range_max * sizeof(range_t));
+      if(*ranges==NULL)
+      {
+	log_critical("sessionp.c: memory allocation failed\n");
+	exit(EXIT_FAILURE);
+      }
+    }
+    (*ranges)[range_nbr].start=start;
+    (*ranges)[range_nbr].end=end;
+    (*ranges)[range_nbr].line=strdup(line);
+    range_nbr++;
+  }
+  fclose(handle);
+  return range_nbr;
+}
+
+static int range_write(const char *range_file, const range_t *ranges, const unsigned int range_nbr)
+{
+  FILE *handle;
+  unsigned int i;
+  handle=fopen(range_file, "wb");
+  if(handle==NULL)
+  {
+    log_critical("Can't create %s: %s\n", range_file, strerror(errno));
+    return -1;
+  }
+  fprintf(handle, "#PhotoRec ranges\n");
+  for(i=0; i<range_nbr; i++)
+    fprintf(handle, "%s\n", ranges[i].line);
+  fclose(handle);
+  return 0;
+}
+
+/* Return the state of a range: todo, running or done */
+static const char *range_state(const range_t *range)
+{
+  const char *state=strchr(range->line, ' ');
+  return (state==NULL ? "" : state+1);
+}
+
+/* Return the first sector not used by a range, 0 if it isn't done */
+static uint64_t range_stop(const range_t *range)
+{
+  const char *state=range_state(range);
+  unsigned long long stop;
+  if(strncmp(state, "done ", 5)!=0 || sscanf(state+5, "%llu", &stop)!=1)
+    return 0;
+  return stop;
+}
+
+static void range_set_line(range_t *range, const char *line)
+{
+  free(range->line);
+  range->line=strdup(line);
+}
+
+static char *range_list_filename(const char *range_file, const range_t *range)
+{
+  char *filename=(char *)MALLOC(strlen(range_file)+32);
+  sprintf(filename, "%s.%llu", range_file, (long long unsigned)range->start);
+  return filename;
+}
+
+/* Split the search space in params->range_nbr ranges of the same size */
+static unsigned int range_create(const struct ph_param *params, const alloc_data_t *list_search_space, range_t **ranges)
+{
+  const unsigned int sector_size=params->disk->sector_size;
+  const alloc_data_t *first;
+  const alloc_data_t *last;
+  const unsigned int range_nbr=(params->range_nbr > 0 ? params->range_nbr : 1);
+  uint64_t start;
+  uint64_t end;
+  uint64_t range_size;
+  unsigned int i;
+  if(td_list_empty(&list_search_space->list))
+    return 0;
+  first=td_list_entry_const(list_search_space->list.next, const alloc_data_t, list);
+  last=td_list_entry_const(list_search_space->list.prev, const alloc_data_t, list);
+  start=first->start / sector_size;
+  end=last->end / sector_size;
+  range_size=(end - start + range_nbr) / range_nbr;
+  *ranges=(range_t *)MALLOC(range_nbr * sizeof(range_t));
+  for(i=0; i<range_nbr && start <= end; i++)
+  {
+    char line[64];
+    range_t *range=&(*ranges)[i];
+    range->start=start;
+    range->end=(end - start >= range_size ? start + range_size - 1 : end);
+    snprintf(line, sizeof(line), "%llu-%llu todo",
+	(long long unsigned)range->start, (long long unsigned)range->end);
+    range->line=strdup(line);
+    start=range->end + 1;
+  }
+  return i;
+}
+
+/* Remove the files recovered by a previous attempt to recover the range */
+static void range_list_remove(const char *filename)
+{
+  FILE *handle;
+  char line[RANGE_LINE_MAXSIZE];
+  unsigned int removed=0;
+  handle=fopen(filename, "rb");
+  if(handle==NULL)
+    return ;
+  while(fgets(line, sizeof(line), handle)!=NULL)
+  {
+    unsigned long long sector;
+    char extension[16];
+    int pos=0;
+    char *eol=strchr(line, '\n');
+    if(eol!=NULL)
+      *eol='\0';
+    if(sscanf(line, "%llu %15s %n", &sector, extension, &pos)==2 && pos>0 &&
+	unlink(&line[pos])==0)
+      removed++;
+  }
+  fclose(handle);
+  log_info("%s: %u files recovered by a previous attempt removed\n", filename, removed);
+}
+
+/* Returns 1 if offset is in one of the nbr sorted extents */
+static int range_extent_find(const session_extent_t *extents, const unsigned int nbr, const uint64_t offset)
+{
+  unsigned int first=0;
+  unsigned int last=nbr;
+  while(first < last)
+  {
+    const unsigned int middle=first + (last - first) / 2;
+    if(offset < extents[middle].start)
+      last=middle;
+    else if(offset > extents[middle].end)
+      first=middle + 1;
     else
+      return 1;
+  }
+  return 0;
+}
+
+/* The files recovered after the last save of the session will be recovered
+ * again when the range is resumed: their first sector is still in the
+ * search space. Remove them and their line from the list. */
+static void range_list_prune(const char *filename, const alloc_data_t *list_search_space)
+{
+  const struct td_list_head *search_walker = NULL;
+  session_extent_t *extents;
+  char *filename_new;
+  char line[RANGE_LINE_MAXSIZE];
+  FILE *handle;
+  FILE *handle_new;
+  unsigned int extent_nbr=0;
+  unsigned int removed=0;
+  handle=fopen(filename, "rb");
+  if(handle==NULL)
+    return ;
+  td_list_for_each(search_walker, &list_search_space->list)
+    extent_nbr++;
+  extents=(session_extent_t *)MALLOC((extent_nbr>0 ? extent_nbr : 1) * sizeof(session_extent_t));
+  extent_nbr=0;
+  td_list_for_each(search_walker, &list_search_space->list)
+  {
+    const alloc_data_t *current_search_space=td_list_entry_const(search_walker, const alloc_data_t, list);
+    extents[extent_nbr].start=current_search_space->start;
+    extents[extent_nbr].end=current_search_space->end;
+    extent_nbr++;
+  }
+  filename_new=(char *)MALLOC(strlen(filename)+5);
+  sprintf(filename_new, "%s.new", filename);
+  handle_new=fopen(filename_new, "wb");
+  if(handle_new==NULL)
+    log_critical("Can't create %s: %s\n", filename_new, strerror(errno));
+  while(handle_new!=NULL && fgets(line, sizeof(line), handle)!=NULL)
+  {
+    unsigned long long sector;
+    char extension[16];
+    int pos=0;
+    char *eol=strchr(line, '\n');
+    if(eol!=NULL)
+      *eol='\0';
+    if(sscanf(line, "%llu %15s %n", &sector, extension, &pos)!=2 || pos==0)
+      continue;
+    if(range_extent_find(extents, extent_nbr, (uint64_t)sector * range_sector_size)>0)
+    {
+      unlink(&line[pos]);
+      removed++;
+      continue;
+    }
+    fprintf(handle_new, "%s\n", line);
+  }
+  fclose(handle);
+  if(handle_new!=NULL)
+  {
+    fclose(handle_new);
+    if(rename(filename_new, filename)<0)
+    {
+      log_critical("Can't rename %s: %s\n", filename_new, strerror(errno));
+      unlink(filename_new);
+    }
+  }
+  if(removed>0)
+    log_info("%s: %u files recovered after the last save removed, they will be recovered again\n",
+	filename, removed);
+  free(extents);
+  free(filename_new);
+}
+
+/* Load the session of an interrupted range: the search space, the block size,
+ * the pass and the position are restored.
+ * resume_cmd is set to the status and the position to use */
+static int range_session_resume(struct ph_param *params, alloc_data_t *list_search_space, char **resume_cmd)
+{
+  alloc_data_t list_saved={
+    .list = TD_LIST_HEAD_INIT(list_saved.list)
+  };
+  struct td_list_head *search_walker = NULL;
+  struct stat stat_rec;
+  char *saved_device=NULL;
+  char *saved_cmd=NULL;
+  const char *search=NULL;
+  const unsigned int sector_size=params->disk->sector_size;
+  if(stat(session_filename, &stat_rec)==0 &&
+      session_load(&saved_device, &saved_cmd, &list_saved)==0 &&
+      saved_device!=NULL && saved_cmd!=NULL)
+    search=strstr(saved_cmd, ",search,");
+  if(search==NULL || strcmp(saved_device, params->disk->device)!=0 ||
+      td_list_empty(&list_saved.list))
+  {
+    free(saved_device);
+    free(saved_cmd);
+    free_search_space(&list_saved);
+    return -1;
+  }
+  {
+    const char *blocksize=strstr(saved_cmd, "blocksize,");
+    if(blocksize!=NULL && blocksize < search)
+      params->blocksize=atoi(blocksize+10);
+  }
+  /* status=name,offset, */
+  *resume_cmd=strdup(search+8);
+  {
+    const unsigned int len=strlen(*resume_cmd);
+    if(len>=5 && strcmp(&(*resume_cmd)[len-5], "inter")==0)
+      (*resume_cmd)[len-5]='\0';
+  }
+  td_list_for_each(search_walker, &list_saved.list)
+  {
+    alloc_data_t *current_search_space;
+    current_search_space=td_list_entry(search_walker, alloc_data_t, list);
+    current_search_space->start=current_search_space->start*sector_size;
+    current_search_space->end=current_search_space->end*sector_size+sector_size-1;
+  }
+  free_search_space(list_search_space);
+  td_list_splice(&list_saved.list, &list_search_space->list);
+  free(saved_device);
+  free(saved_cmd);
+  return 0;
+}
+
+/* Assign ranges[i] to this process, interrupted is set if a process of this
+ * host has been interrupted while recovering it.
+ * returns 0 if the range is assigned, 1 if the previous range covers it,
+ * -1 on error */
+static int range_claim(struct ph_param *params, alloc_data_t *list_search_space, range_t *ranges, const unsigned int range_nbr, const unsigned int i, const int interrupted, char **resume_cmd)
+{
+  const uint64_t stop=(i>0 ? range_stop(&ranges[i-1]) : 0);
+  char owner[RANGE_OWNER_MAXSIZE];
+  char line[96+RANGE_OWNER_MAXSIZE];
+  char *filename;
+  if(stop > ranges[i].end)
+  {
+    /* The last file of the previous range covers this one */
+    snprintf(line, sizeof(line), "%llu-%llu done %llu 0 0-0 - -",
+	(long long unsigned)ranges[i].start, (long long unsigned)ranges[i].end,
+	(long long unsigned)stop);
+    range_set_line(&ranges[i], line);
+    log_info("Sectors %llu-%llu are used by the previous range\n",
+	(long long unsigned)ranges[i].start, (long long unsigned)ranges[i].end);
+    return 1;
+  }
+  range_owner(owner, sizeof(owner));
+  snprintf(line, sizeof(line), "%llu-%llu running %s",
+      (long long unsigned)ranges[i].start, (long long unsigned)ranges[i].end, owner);
+  range_set_line(&ranges[i], line);
+  if(range_write(params->range_file, ranges, range_nbr) < 0)
+    return -1;
+  params->range_start=(stop > ranges[i].start ? stop : ranges[i].start) * params->disk->sector_size;
+  params->range_end=(ranges[i].end + 1) * params->disk->sector_size;
+  session_checkpoint_wait();
+  session_journal_chained=0;
+  snprintf(session_range_filename, sizeof(session_range_filename),
+      "photorec.%llu.ses", (long long unsigned)ranges[i].start);
+  session_journal_close();
+  session_filename=session_range_filename;
+  filename=range_list_filename(params->range_file, &ranges[i]);
+  range_sector_size=params->disk->sector_size;
+  if(interrupted>0 && range_session_resume(params, list_search_space, resume_cmd)==0)
+  {
+    log_info("Resume the recovery of sectors %llu-%llu from %s\n",
+	(long long unsigned)ranges[i].start, (long long unsigned)ranges[i].end,
+	session_filename);
+    range_list_prune(filename, list_search_space);
+    range_list=fopen(filename, "ab");
+  }
+  else
+  {
+    /* The range has been recovered partially before, start again */
+    range_list_remove(filename);
+    range_list=fopen(filename, "wb");
+  }
+  if(range_list==NULL)
+    log_critical("Can't create %s: %s\n", filename, strerror(errno));
+  free(filename);
+  log_info("Recover the files beginning in sectors %llu-%llu\n",
+      (long long unsigned)ranges[i].start, (long long unsigned)ranges[i].end);
+  if(stop > ranges[i].start)
+    log_info("Sectors %llu-%llu are used by the previous range\n",
+	(long long unsigned)ranges[i].start, (long long unsigned)stop-1);
+  return 0;
+}
+
+/* Find a range not yet recovered and set params->range_start/range_end.
+ * The ranges left by the interrupted processes of this host are taken first.
+ * If the recovery of the range can be resumed, resume_cmd is set to the
+ * status and the position saved in its session.
+ * returns -1 if all the ranges have been assigned */
+int session_range_claim(struct ph_param *params, alloc_data_t *list_search_space, char **resume_cmd)
+{
+  range_t *ranges;
+  unsigned int range_nbr;
+  int pass;
+  int res=1;
+  *resume_cmd=NULL;
+  if(range_lock(params->range_file) < 0)
+    return -1;
+  range_nbr=range_read(params->range_file, &ranges);
+  if(range_nbr==0)
+  {
+    range_nbr=range_create(params, list_search_space, &ranges);
+    log_info("Create %s with %u ranges\n", params->range_file, range_nbr);
+  }
+  for(pass=0; res>0 && pass<2; pass++)
+  {
+    const int interrupted=(pass==0);
+    unsigned int i;
+    for(i=0; res>0 && i<range_nbr; i++)
+    {
+      const char *state=range_state(&ranges[i]);
+      if(interrupted>0 ?
+	  (strncmp(state, "running ", 8)==0 && range_owner_dead(state+8)>0) :
+	  strcmp(state, "todo")==0)
+	res=range_claim(params, list_search_space, ranges, range_nbr, i, interrupted, resume_cmd);
+    }
+  }
+  /* Save the ranges covered by the previous ones */
+  if(res>0)
+    range_write(params->range_file, ranges, range_nbr);
+  range_free(ranges, range_nbr);
+  range_unlock(params->range_file);
+  return (res==0 ? 0 : -1);
+}
+
+/* Add a recovered file to the list of the range */
+void session_range_file(const file_recovery_t *file_recovery)
+{
+  const char *extension;
+  if(range_list==NULL)
+    return ;
+  extension=file_recovery->file_stat->file_hint->extension;
+  fprintf(range_list, "%llu %s %s\n",
+      (long long unsigned)(file_recovery->location.start / range_sector_size),
+      (extension!=NULL && extension[0]!='\0' ? extension : "-"),
+      file_recovery->filename);
+  /* Keep the list usable if the process is killed */
+  fflush(range_list);
+}
+
+void session_range_done(const struct ph_param *params, const unsigned int first_dir_num)
+{
+  const uint64_t start=params->range_start / params->disk->sector_size;
+  range_t *ranges;
+  unsigned int range_nbr;
+  unsigned int i;
+  if(range_list!=NULL)
+  {
+    fclose(range_list);
+    range_list=NULL;
+  }
+  if(range_lock(params->range_file) < 0)
+    return ;
+  range_nbr=range_read(params->range_file, &ranges);
+  for(i=0; i<range_nbr; i++)
+  {
+    /* range_start is after the beginning of the range if the previous range used its first sectors */
+    if(ranges[i].start <= start && start <= ranges[i].end)
     {
-      fprintf(f_session,"everything,disable,");
-      for(i=0;files_enable[i].file_hint!=NULL;i++)
+      const unsigned int line_size=RANGE_LINE_MAXSIZE + strlen(params->recup_dir);
+      char *line=(char *)MALLOC(line_size);
+      unsigned int stats=0;
+      unsigned int j;
+      int pos;
+      pos=snprintf(line, line_size, "%llu-%llu done %llu %u %u-%u ",
+	  (long long unsigned)ranges[i].start, (long long unsigned)ranges[i].end,
+	  (long long unsigned)(params->range_end / params->disk->sector_size),
+	  params->file_nbr, first_dir_num, params->dir_num);
+      for(j=0; params->file_stats[j].file_hint!=NULL; j++)
       {
-	if(files_enable[i].enable!=0 &&
-	      files_enable[i].file_hint->extension!=NULL &&
-	      files_enable[i].file_hint->extension[0]!='\0')
+	const file_stat_t *file_stat=&params->file_stats[j];
+	if(file_stat->recovered > 0 &&
+	    file_stat->file_hint->extension!=NULL &&
+	    file_stat->file_hint->extension[0]!='\0' &&
+	    pos + 64 < RANGE_LINE_MAXSIZE)
 	{
-	  fprintf(f_session,"%s,enable,", files_enable[i].file_hint->extension);
+	  pos+=snprintf(&line[pos], line_size - pos, "%s%s:%u",
+	      (stats>0 ? "," : ""), file_stat->file_hint->extension, file_stat->recovered);
+	  stats++;
 	}
       }
+      snprintf(&line[pos], line_size - pos, "%s %s",
+	  (stats>0 ? "" : "-"), params->recup_dir);
+      range_set_line(&ranges[i], line);
+      free(line);
+      range_write(params->range_file, ranges, range_nbr);
+      break;
     }
-    /* Save options */
-    fprintf(f_session, "options,");
-    if(options->paranoid==0)
-      fprintf(f_session, "paranoid_no,");
-    else if(options->paranoid==1)
-      fprintf(f_session, "paranoid,");
-    else
-      fprintf(f_session, "paranoid_bf,");
-    if(options->keep_corrupted_file>0)
-      fprintf(f_session, "keep_corrupted_file,");
-    else
-      fprintf(f_session, "keep_corrupted_file_no,");
-    if(options->mode_ext2>0)
-      fprintf(f_session, "mode_ext2,");
-    if(options->expert>0)
-      fprintf(f_session, "expert,");
-    if(options->lowmem>0)
-      fprintf(f_session, "lowmem,");
-    /* Save options - End */
-    if(params->carve_free_space_only>0)
-      fprintf(f_session,"freespace,");
-    else
-      fprintf(f_session,"wholespace,");
-    fprintf(f_session,"search,");
-    switch(params->status)
+  }
+  range_free(ranges, range_nbr);
+  range_unlock(params->range_file);
+}
+
+typedef struct
+{
+  char extension[16];
+  unsigned int recovered;
+} range_stat_t;
+
+static void range_stat_add(range_stat_t **stats, unsigned int *stats_nbr, const char *extension, const unsigned int recovered)
+{
+  unsigned int j;
+  for(j=0; j<*stats_nbr && strcmp((*stats)[j].extension, extension)!=0; j++);
+  if(j==*stats_nbr)
+  {
+    *stats=(range_stat_t *)realloc(*stats, (*stats_nbr+1) * sizeof(range_stat_t));
+    if(*stats==NULL)
     {
-      case STATUS_UNFORMAT:
-        fprintf(f_session, "status=unformat,");
-	break;
-      case STATUS_FIND_OFFSET:
-        fprintf(f_session, "status=find_offset,");
-	break;
-      case STATUS_EXT2_ON_BF:
-	fprintf(f_session, "status=ext2_on_bf,");
-	break;
-      case STATUS_EXT2_ON_SAVE_EVERYTHING:
-	fprintf(f_session, "status=ext2_on_save_everything,");
-	break;
-      case STATUS_EXT2_ON:
-	fprintf(f_session, "status=ext2_on,");
-	break;
-      case STATUS_EXT2_OFF_SAVE_EVERYTHING:
-	fprintf(f_session, "status=ext2_off_save_everything,");
-	break;
-      case STATUS_EXT2_OFF_BF:
-	fprintf(f_session, "status=ext2_off_bf,");
-	break;
-      case STATUS_EXT2_OFF:
-	fprintf(f_session, "status=ext2_off,");
-	break;
-      case STATUS_QUIT:
-        break;
+      log_critical("sessionp.c: memory allocation failed\n");
+      exit(EXIT_FAILURE);
     }
-    if(params->status!=STATUS_FIND_OFFSET && params->offset!=-1)
-      fprintf(f_session, "%llu,",
-	  (long long unsigned)(params->offset/params->disk->sector_size));
-    fprintf(f_session,"inter\n");
-    td_list_for_each(free_walker, &list_free_space->list)
+    strncpy((*stats)[j].extension, extension, sizeof((*stats)[j].extension)-1);
+    (*stats)[j].extension[sizeof((*stats)[j].extension)-1]='\0';
+    (*stats)[j].recovered=0;
+    (*stats_nbr)++;
+  }
+  (*stats)[j].recovered+=recovered;
+}
+
+/* Add the directory of filename to the space separated list dirs.
+ * A process fills its directories one after the other, only the last one
+ * needs to be checked. */
+static void range_dir_add(char **dirs, const char *filename)
+{
+  const char *sep=strrchr(filename, '/');
+  const unsigned int dir_size=(sep!=NULL ? sep - filename : 0);
+  const unsigned int dirs_size=(*dirs!=NULL ? strlen(*dirs) : 0);
+  unsigned int pos;
+  if(dir_size==0)
+    return ;
+  if(dirs_size >= dir_size &&
+      memcmp(&(*dirs)[dirs_size - dir_size], filename, dir_size)==0 &&
+      (dirs_size==dir_size || (*dirs)[dirs_size - dir_size - 1]==' '))
+    return ;
+  *dirs=(char *)realloc(*dirs, dirs_size + 1 + dir_size + 1);
+  if(*dirs==NULL)
+  {
+    log_critical("sessionp.c: memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  pos=dirs_size;
+  if(pos > 0)
+    (*dirs)[pos++]=' ';
+  memcpy(&(*dirs)[pos], filename, dir_size);
+  (*dirs)[pos + dir_size]='\0';
+}
+
+/* Read the list of the files recovered in a range.
+ * If the range has been started before the previous one was done, the files
+ * beginning before skip may be part of the last file of the previous range:
+ * they aren't counted, their names are written to duplicates.
+ * If no file begins at skip, the duplicates may have used the first sectors
+ * of a file a single process would have recovered: differ is set.
+ * Returns the number of files, -1 if there is no list */
+static int range_list_merge(const char *range_file, const range_t *range, const uint64_t skip, FILE *duplicates, unsigned int *duplicate_nbr, int *differ, range_stat_t **stats, unsigned int *stats_nbr, char **dirs)
+{
+  char *filename=range_list_filename(range_file, range);
+  char line[RANGE_LINE_MAXSIZE];
+  FILE *handle;
+  unsigned int files=0;
+  unsigned int before=0;
+  int at=0;
+  handle=fopen(filename, "rb");
+  free(filename);
+  if(handle==NULL)
+    return -1;
+  while(fgets(line, sizeof(line), handle)!=NULL)
+  {
+    unsigned long long sector;
+    char extension[16];
+    int pos=0;
+    char *eol=strchr(line, '\n');
+    if(eol!=NULL)
+      *eol='\0';
+    if(sscanf(line, "%llu %15s %n", &sector, extension, &pos)!=2 || pos==0)
+      continue;
+    if(sector < skip)
     {
-      alloc_data_t *current_free_space;
-      current_free_space=td_list_entry(free_walker, alloc_data_t, list);
-      fprintf(f_session,"%llu-%llu\n",
-	  (long long unsigned)(current_free_space->start/params->disk->sector_size),
-	  (long long unsigned)(current_free_space->end/params->disk->sector_size));
+      if(duplicates!=NULL)
+	fprintf(duplicates, "%s\n", &line[pos]);
+      before++;
+      continue;
     }
+    if(sector==skip)
+      at=1;
+    if(strcmp(extension, "-")!=0)
+      range_stat_add(stats, stats_nbr, extension, 1);
+    range_dir_add(dirs, &line[pos]);
+    files++;
   }
-  { /* Reserve some space */
-    int res;
-    char *buffer;
-    buffer=(char *)MALLOC(SESSION_MAXSIZE);
-    memset(buffer,0,SESSION_MAXSIZE);
-    res=fwrite(buffer,1,SESSION_MAXSIZE,f_session);
-    free(buffer);
-    if(res<SESSION_MAXSIZE)
+  fclose(handle);
+  *duplicate_nbr+=before;
+  *differ=(before > 0 && at==0);
+  return files;
+}
+
+/* Unify the results of the ranges in a single report.
+ * Nothing is removed: the files recovered twice are listed in
+ * range_file.duplicates */
+int session_range_merge(const char *range_file)
+{
+  range_t *ranges;
+  range_stat_t *stats=NULL;
+  char *duplicates_filename;
+  FILE *duplicates;
+  unsigned int stats_nbr=0;
+  unsigned int range_nbr;
+  unsigned int done=0;
+  unsigned int file_nbr=0;
+  unsigned int duplicate_nbr=0;
+  unsigned int i;
+  if(range_lock(range_file) < 0)
+    return -1;
+  range_nbr=range_read(range_file, &ranges);
+  if(range_nbr==0)
+  {
+    range_unlock(range_file);
+    printf("No range found in %s\n", range_file);
+    return -1;
+  }
+  duplicates_filename=(char *)MALLOC(strlen(range_file)+12);
+  sprintf(duplicates_filename, "%s.duplicates", range_file);
+  duplicates=fopen(duplicates_filename, "wb");
+  if(duplicates==NULL)
+    log_critical("Can't create %s: %s\n", duplicates_filename, strerror(errno));
+  printf("\n%-25s %-8s %8s  %s\n", "Sectors", "State", "Files", "Directories");
+  for(i=0; i<range_nbr; i++)
+  {
+    const char *state=range_state(&ranges[i]);
+    const uint64_t skip=(i>0 ? range_stop(&ranges[i-1]) : 0);
+    char sectors[48];
+    char *dirs=NULL;
+    unsigned long long stop;
+    unsigned int files;
+    unsigned int first_dir;
+    unsigned int last_dir;
+    int list_files;
+    int differ=0;
+    int pos=0;
+    snprintf(sectors, sizeof(sectors), "%llu-%llu",
+	(long long unsigned)ranges[i].start, (long long unsigned)ranges[i].end);
+    if(strncmp(state, "done ", 5)!=0 ||
+	sscanf(state+5, "%llu %u %u-%u %n", &stop, &files, &first_dir, &last_dir, &pos)!=4 || pos==0)
     {
-      fclose(f_session);
-      return -1;
+      printf("%-25s %-8s\n", sectors, state);
+      continue;
     }
+    if(i>0 && skip==0)
+      printf("%s: the previous range isn't done, run /merge again once it is\n", sectors);
+    list_files=range_list_merge(range_file, &ranges[i], skip, duplicates, &duplicate_nbr, &differ, &stats, &stats_nbr, &dirs);
+    if(differ>0)
+    {
+      printf("%s: no file begins in sector %llu where the previous range stops,\n"
+	  "the files may differ from the ones recovered by a single process.\n"
+	  "To recover this range again, set its state to todo in %s:\n"
+	  "the files of this range will be removed when it's claimed.\n",
+	  sectors, (long long unsigned)skip, range_file);
+      log_info("%s: sectors %s may have to be recovered again\n", range_file, sectors);
+    }
+    if(list_files >= 0)
+    {
+      printf("%-25s %-8s %8u  %s\n", sectors, "done", (unsigned int)list_files,
+	  (dirs!=NULL ? dirs : ""));
+      files=list_files;
+    }
+    else
+    {
+      /* No list of files, use the statistics of the range: ext:nbr,ext:nbr recup_dir */
+      char *ext=ranges[i].line + (state + 5 + pos - ranges[i].line);
+      char *recup_dir=strchr(ext, ' ');
+      if(recup_dir!=NULL)
+	*recup_dir++='\0';
+      if(files > 0)
+	printf("%-25s %-8s %8u  %s.%u-%u\n", sectors, "done", files,
+	    (recup_dir!=NULL ? recup_dir : ""), first_dir, last_dir);
+      else
+	printf("%-25s %-8s %8u\n", sectors, "done", files);
+      while(*ext!='\0' && *ext!='-')
+      {
+	char *sep=strchr(ext, ':');
+	if(sep==NULL)
+	  break;
+	*sep='\0';
+	range_stat_add(&stats, &stats_nbr, ext, strtoul(sep+1, &ext, 10));
+	if(*ext==',')
+	  ext++;
+      }
+    }
+    free(dirs);
+    file_nbr+=files;
+    done++;
   }
-  fclose(f_session);
-  return 0;
+  range_unlock(range_file);
+  if(duplicates!=NULL)
+    fclose(duplicates);
+  printf("\n%u/%u ranges done, %u files recovered\n", done, range_nbr, file_nbr);
+  log_info("%s: %u/%u ranges done, %u files recovered\n", range_file, done, range_nbr, file_nbr);
+  if(duplicate_nbr > 0)
+  {
+    printf("%u files begin in sectors used by the last file of the previous range,\n"
+	"they are listed in %s\n", duplicate_nbr, duplicates_filename);
+    log_info("%s: %u files recovered twice\n", duplicates_filename, duplicate_nbr);
+  }
+  else
+    unlink(duplicates_filename);
+  free(duplicates_filename);
+  for(i=0; i<stats_nbr; i++)
+  {
+    printf("%s: %u recovered\n", stats[i].extension, stats[i].recovered);
+    log_info("%s: %u recovered\n", stats[i].extension, stats[i].recovered);
+  }
+  free(stats);
+  range_free(ranges, range_nbr);
+  return (done==range_nbr ? 0 : 1);
 }
@@ -25,6 +25,14 @@ extern "C" {
 
 int session_load(char **cmd_device, char **current_cmd, alloc_data_t *list_free_space);
 int session_save(alloc_data_t *list_free_space, struct ph_param *params, const struct ph_options *options);
+int session_sync(alloc_data_t *list_free_space, struct ph_param *params, const struct ph_options *options);
+void session_journal_del(const uint64_t start, const uint64_t end);
+void session_journal_file(const file_recovery_t *file_recovery);
+void session_remove(void);
+int session_range_claim(struct ph_param *params, alloc_data_t *list_search_space, char **resume_cmd);
+void session_range_file(const file_recovery_t *file_recovery);
+void session_range_done(const struct ph_param *params, const unsigned int first_dir_num);
+int session_range_merge(const char *range_file);
 
 #ifdef __cplusplus
 } /* closing brace for extern "C" */